@@ -0,0 +1,127 @@
+
+/**
+
+	Benchmark da alocacao de bits nos bitmaps (bitmap2)
+
+	Mede alocacoes/segundo no bitmap de blocos de dados de uma particao ja
+	formatada, para varios niveis de ocupacao. Os bits iniciais sao marcados
+	como ocupados (como em um disco preenchido com first-fit) e cada
+	alocacao eh desfeita em seguida, de modo que o nivel fica constante.
+
+	Compara a busca bit a bit usada originalmente em allocBlockOrInode
+	(getBitmap2 ate achar um zero) com allocBitmap2 (palavras de 64 bits e
+	dica do proximo livre).
+
+	O conteudo original do bitmap eh restaurado antes de fechar, portanto a
+	imagem do disco nao eh alterada.
+
+	Uso: bench_alloc [particao] [repeticoes]
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../include/apidisk.h"
+#include "../include/bitmap2.h"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Setor do superbloco: primeiro setor da particao, lido do MBR (setor 0) */
+static int superblockSector(int partition) {
+	unsigned char mbr[SECTOR_SIZE];
+	if (read_sector(0, mbr))
+		return -1;
+
+	int partitions = mbr[6] | (mbr[7] << 8);
+	if (partition < 0 || partition >= partitions)
+		return -1;
+
+	int entry = (mbr[4] | (mbr[5] << 8)) + 32 * partition;
+	return mbr[entry] | (mbr[entry + 1] << 8) | (mbr[entry + 2] << 16) | (mbr[entry + 3] << 24);
+}
+
+static BITMAP2* bitmaps = NULL;
+
+/* Busca original: um getBitmap2 por bit */
+static int allocLinear(int nBits) {
+	int index = 0;
+	int ret = 0;
+	while (index < nBits && (ret = getBitmap2(bitmaps, BITMAP_DADOS, index++)) == 1);
+	if (index >= nBits || ret != 0)
+		return -1;
+	setBitmap2(bitmaps, BITMAP_DADOS, --index, 1);
+	return index;
+}
+
+static double run(int useWords, int nBits, int reps) {
+	double start = now();
+	for (int r = 0; r < reps; r++) {
+		int bit = useWords ? allocBitmap2(bitmaps, BITMAP_DADOS, nBits) : allocLinear(nBits);
+		if (bit < 0) {
+			printf("Erro: nenhum bit livre\n");
+			exit(1);
+		}
+		setBitmap2(bitmaps, BITMAP_DADOS, bit, 0);
+	}
+	return reps / (now() - start);
+}
+
+int main(int argc, char* argv[]) {
+	int partition = argc > 1 ? atoi(argv[1]) : 0;
+	int reps = argc > 2 ? atoi(argv[2]) : 20000;
+
+	int sector = superblockSector(partition);
+	if (sector < 0 || reps <= 0) {
+		printf("Uso: %s [particao] [repeticoes]\n", argv[0]);
+		return 1;
+	}
+
+	bitmaps = openBitmap2(NULL, sector);
+	if (bitmaps == NULL) {
+		printf("Erro ao abrir os bitmaps da particao %d (formatada?)\n", partition);
+		return 1;
+	}
+
+	int nBits = 0;
+	while (getBitmap2(bitmaps, BITMAP_DADOS, nBits) >= 0)
+		nBits++;
+
+	char* saved = (char*)malloc(nBits);
+	for (int i = 0; i < nBits; i++)
+		saved[i] = (char)getBitmap2(bitmaps, BITMAP_DADOS, i);
+
+	printf("particao %d: %d bits no bitmap de dados, %d alocacoes por medida\n", partition, nBits, reps);
+	printf("%-10s %16s %16s\n", "ocupacao", "bit a bit", "palavras");
+
+	const int levels[] = { 0, 50, 90, 99 };
+	for (int l = 0; l < 4; l++) {
+		// Deixa livres ao menos os dois ultimos bits (a busca original nunca usa o ultimo)
+		int used = (int)((long long)nBits * levels[l] / 100);
+		if (used > nBits - 2)
+			used = nBits - 2;
+		for (int i = 0; i < nBits; i++)
+			setBitmap2(bitmaps, BITMAP_DADOS, i, i < used);
+
+		double linear = run(0, nBits, reps);
+		double words = run(1, nBits, reps);
+		printf("%8d%% %16.0f %16.0f (%.1fx)\n", levels[l], linear, words, words / linear);
+	}
+
+	for (int i = 0; i < nBits; i++)
+		setBitmap2(bitmaps, BITMAP_DADOS, i, saved[i]);
+	free(saved);
+
+	if (closeBitmap2(bitmaps)) {
+		printf("Erro ao gravar os bitmaps\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,163 @@
+
+/**
+
+	Benchmark de escritas pequenas intercaladas (logs) e da alocacao adiada
+
+	Varios arquivos abertos ao mesmo tempo recebem registros pequenos, um
+	arquivo de cada vez, como logs. Com alocacao na escrita
+	(delayAllocMax < 0), cada bloco novo eh alocado e ligado ao inode no
+	write2 que o alcanca, e os blocos dos arquivos ficam intercalados na
+	particao. Com alocacao adiada (padrao), os blocos ficam em memoria e sao
+	alocados contiguos quando passam do limite ou no close2.
+
+	Mede MB/s das escritas (ate o close2) e da leitura sequencial de cada
+	arquivo depois de remontar a particao. O conteudo eh conferido e os
+	arquivos sao apagados.
+
+	Uso: bench_append [particao] [arquivos] [bytes por registro] [kbytes por arquivo]
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/t2fs.h"
+
+#define MAX_FILES		16
+#define CACHE_BLOCKS	64
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fileName(char* name, int index) {
+	sprintf(name, "log%d", index);
+}
+
+/* Conteudo do byte "pos" do arquivo "index" */
+static char contents(int index, int pos) {
+	return (char)(pos * 7 + index * 13 + pos / 251);
+}
+
+/* Grava os arquivos intercalados; retorna o numero de erros */
+static int appendFiles(int files, int record, int fileBytes) {
+	FILE2 handles[MAX_FILES];
+	char name[16];
+	char* buffer = (char*)malloc(record);
+	int errors = 0;
+
+	for (int f = 0; f < files; f++) {
+		fileName(name, f);
+		if ((handles[f] = create2(name)) < 0)
+			errors++;
+	}
+
+	for (int pos = 0; pos < fileBytes; pos += record) {
+		int size = fileBytes - pos < record ? fileBytes - pos : record;
+		for (int f = 0; f < files; f++) {
+			for (int i = 0; i < size; i++)
+				buffer[i] = contents(f, pos + i);
+			if (write2(handles[f], buffer, size) != size)
+				errors++;
+		}
+	}
+
+	for (int f = 0; f < files; f++)
+		if (close2(handles[f]))
+			errors++;
+
+	free(buffer);
+	return errors;
+}
+
+/* Le cada arquivo inteiro e confere; retorna o numero de erros */
+static int readFiles(int files, int fileBytes) {
+	char name[16];
+	char* buffer = (char*)malloc(fileBytes);
+	int errors = 0;
+
+	for (int f = 0; f < files; f++) {
+		fileName(name, f);
+		FILE2 handle = open2(name);
+		if (handle < 0) {
+			errors++;
+			continue;
+		}
+
+		int total = 0;
+		int ret;
+		while (total < fileBytes && (ret = read2(handle, buffer + total, fileBytes - total)) > 0)
+			total += ret;
+		close2(handle);
+
+		if (total != fileBytes)
+			errors++;
+		else
+			for (int i = 0; i < fileBytes; i++)
+				if (buffer[i] != contents(f, i)) {
+					errors++;
+					break;
+				}
+	}
+
+	free(buffer);
+	return errors;
+}
+
+int main(int argc, char* argv[]) {
+	int partition = argc > 1 ? atoi(argv[1]) : 0;
+	int files = argc > 2 ? atoi(argv[2]) : 4;
+	int record = argc > 3 ? atoi(argv[3]) : 64;
+	int kbytes = argc > 4 ? atoi(argv[4]) : 32;
+
+	if (files <= 0 || files > MAX_FILES || record <= 0 || kbytes <= 0) {
+		printf("Uso: %s [particao] [arquivos (1 a %d)] [bytes por registro] [kbytes por arquivo]\n", argv[0], MAX_FILES);
+		return 1;
+	}
+	int fileBytes = kbytes * 1024;
+
+	printf("particao %d: %d arquivos de %d KB, registros de %d bytes\n", partition, files, kbytes, record);
+	printf("%-20s %12s %12s\n", "alocacao", "escrita MB/s", "leitura MB/s");
+
+	int errors = 0;
+	const char* modes[2] = { "na escrita", "adiada" };
+	for (int m = 0; m < 2; m++) {
+		MOUNTOPT2 options = { 0 };
+		options.cacheBlocks = CACHE_BLOCKS;
+		options.delayAllocMax = m == 0 ? -1 : 0;
+
+		int err = mount2(partition, &options);
+		if (err) {
+			printf("Erro em mount2: %d (particao formatada?)\n", err);
+			return 1;
+		}
+
+		double start = now();
+		errors += appendFiles(files, record, fileBytes);
+		double writeRate = files * (double)fileBytes / (1024.0 * 1024.0) / (now() - start);
+
+		// Leitura com a cache vazia
+		umount();
+		mount2(partition, &options);
+		start = now();
+		errors += readFiles(files, fileBytes);
+		double readRate = files * (double)fileBytes / (1024.0 * 1024.0) / (now() - start);
+
+		printf("%-20s %12.2f %12.2f\n", modes[m], writeRate, readRate);
+
+		char name[16];
+		for (int f = 0; f < files; f++) {
+			fileName(name, f);
+			delete2(name);
+		}
+		umount();
+	}
+
+	printf("erros: %d\n", errors);
+	return errors ? 1 : 0;
+}
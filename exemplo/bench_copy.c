@@ -0,0 +1,183 @@
+
+/**
+
+	Benchmark de copia de arquivos (copy2, read2 e write2)
+
+	Mede MB/s de tres formas de copia em uma particao ja formatada:
+		host -> T2FS: fread + write2 em trechos de FSCP_BUFFER bytes (fscp -t)
+		T2FS -> T2FS: copy2 e, para comparacao, read2/write2 de 1 byte (cp original)
+		T2FS -> host: read2 + fwrite em trechos de FSCP_BUFFER bytes (fscp -f)
+
+	O arquivo copiado tem conteudo pseudo-aleatorio e eh conferido ao final.
+	Os arquivos criados no T2FS sao apagados antes de desmontar a particao.
+
+	Uso: bench_copy [particao] [kbytes] [repeticoes]
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/t2fs.h"
+
+#define FSCP_BUFFER	(64 * 1024)
+
+#define HOST_SRC	"bench_copy.src"
+#define HOST_DST	"bench_copy.dst"
+#define T2FS_SRC	"bcsrc"
+#define T2FS_DST	"bcdst"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char* what, int err) {
+	printf("Erro em %s: %d\n", what, err);
+	umount();
+	remove(HOST_SRC);
+	remove(HOST_DST);
+	exit(1);
+}
+
+static void hostToT2fs(char* buffer) {
+	FILE* hSrc = fopen(HOST_SRC, "rb");
+	FILE2 hDst = create2(T2FS_SRC);
+	if (hSrc == NULL || hDst < 0)
+		fail("host -> T2FS (abertura)", hDst);
+
+	int bytesRead = 0;
+	int ret = 0;
+	while ((bytesRead = (int)fread(buffer, 1, FSCP_BUFFER, hSrc)) > 0)
+		if ((ret = write2(hDst, buffer, bytesRead)) != bytesRead)
+			fail("write2", ret);
+
+	fclose(hSrc);
+	close2(hDst);
+}
+
+static void t2fsToHost(char* buffer) {
+	FILE2 hSrc = open2(T2FS_DST);
+	FILE* hDst = fopen(HOST_DST, "wb");
+	if (hSrc < 0 || hDst == NULL)
+		fail("T2FS -> host (abertura)", hSrc);
+
+	int bytesRead = 0;
+	while ((bytesRead = read2(hSrc, buffer, FSCP_BUFFER)) > 0)
+		if ((int)fwrite(buffer, 1, bytesRead, hDst) != bytesRead)
+			fail("fwrite", bytesRead);
+
+	close2(hSrc);
+	fclose(hDst);
+}
+
+/* Copia original do t2shell: um read2/write2 por byte */
+static void byteCopy(void) {
+	FILE2 hSrc = open2(T2FS_SRC);
+	FILE2 hDst = create2(T2FS_DST);
+	if (hSrc < 0 || hDst < 0)
+		fail("copia byte a byte (abertura)", hSrc < 0 ? hSrc : hDst);
+
+	char buffer[2];
+	while (read2(hSrc, buffer, 1) == 1)
+		write2(hDst, buffer, 1);
+
+	close2(hSrc);
+	close2(hDst);
+}
+
+static void blockCopy(void) {
+	int ret = copy2(T2FS_SRC, T2FS_DST);
+	if (ret < 0)
+		fail("copy2", ret);
+}
+
+static double mbPerSecond(int bytes, int reps, double elapsed) {
+	return (double)bytes * reps / (1024.0 * 1024.0) / elapsed;
+}
+
+static int sameContents(void) {
+	FILE* a = fopen(HOST_SRC, "rb");
+	FILE* b = fopen(HOST_DST, "rb");
+	int same = (a != NULL && b != NULL);
+	while (same) {
+		int ca = fgetc(a);
+		int cb = fgetc(b);
+		same = (ca == cb);
+		if (ca == EOF)
+			break;
+	}
+	if (a)
+		fclose(a);
+	if (b)
+		fclose(b);
+	return same;
+}
+
+int main(int argc, char* argv[]) {
+	int partition = argc > 1 ? atoi(argv[1]) : 0;
+	int kbytes = argc > 2 ? atoi(argv[2]) : 128;
+	int reps = argc > 3 ? atoi(argv[3]) : 20;
+
+	if (kbytes <= 0 || reps <= 0) {
+		printf("Uso: %s [particao] [kbytes] [repeticoes]\n", argv[0]);
+		return 1;
+	}
+
+	int bytes = kbytes * 1024;
+	char* buffer = (char*)malloc(FSCP_BUFFER);
+
+	// Arquivo de origem no host, com conteudo pseudo-aleatorio
+	FILE* host = fopen(HOST_SRC, "wb");
+	if (host == NULL || buffer == NULL) {
+		printf("Erro ao criar %s\n", HOST_SRC);
+		return 1;
+	}
+	unsigned int seed = 2019;
+	for (int i = 0; i < bytes; i++)
+		fputc(rand_r(&seed) & 0xFF, host);
+	fclose(host);
+
+	int err = mount(partition);
+	if (err)
+		fail("mount", err);
+
+	printf("particao %d: arquivo de %d KB, %d repeticoes (MB/s)\n", partition, kbytes, reps);
+
+	double start = now();
+	for (int r = 0; r < reps; r++)
+		hostToT2fs(buffer);
+	printf("%-28s %10.2f\n", "host -> T2FS (fscp -t)", mbPerSecond(bytes, reps, now() - start));
+
+	start = now();
+	byteCopy();
+	double bytewise = mbPerSecond(bytes, 1, now() - start);
+	printf("%-28s %10.2f\n", "T2FS -> T2FS (byte a byte)", bytewise);
+
+	start = now();
+	for (int r = 0; r < reps; r++)
+		blockCopy();
+	double blockwise = mbPerSecond(bytes, reps, now() - start);
+	printf("%-28s %10.2f (%.0fx)\n", "T2FS -> T2FS (copy2)", blockwise, blockwise / bytewise);
+
+	start = now();
+	for (int r = 0; r < reps; r++)
+		t2fsToHost(buffer);
+	printf("%-28s %10.2f\n", "T2FS -> host (fscp -f)", mbPerSecond(bytes, reps, now() - start));
+
+	int ok = sameContents();
+	printf("conteudo: %s\n", ok ? "ok" : "DIFERENTE");
+
+	delete2(T2FS_SRC);
+	delete2(T2FS_DST);
+	umount();
+	remove(HOST_SRC);
+	remove(HOST_DST);
+	free(buffer);
+
+	return ok ? 0 : 1;
+}
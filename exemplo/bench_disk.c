@@ -0,0 +1,139 @@
+
+/**
+
+	Benchmark do subsistema de E/S no disco (apidisk)
+
+	Mede setores/segundo de read_sector/write_sector sobre o arquivo t2fs_disk.dat
+	para cada backend: "stdio" (implementacao original, fopen/fseek/fclose a cada
+	setor), "pread" (descritor persistente), "mmap" (imagem mapeada em memoria)
+	e "uring" (io_uring). O ultimo teste grava os setores em ordem aleatoria com
+	um unico write_sectors_batch, como no flush da cache de blocos no umount.
+
+	Os setores escritos recebem o mesmo conteudo que foi lido, portanto a
+	imagem do disco nao eh alterada.
+
+	Uso: bench_disk [qtde_setores] [repeticoes]
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/apidisk.h"
+
+static const char* backends[] = { "stdio", "pread", "mmap", "uring" };
+#define NUM_BACKENDS 4
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Le e reescreve "sectors" setores (sequenciais ou aleatorios), "reps" vezes */
+static double run(unsigned int sectors, int reps, int random, int doWrite) {
+	unsigned char buffer[SECTOR_SIZE];
+	unsigned int seed = 2019;
+
+	double start = now();
+	for (int r = 0; r < reps; r++) {
+		for (unsigned int i = 0; i < sectors; i++) {
+			unsigned int s = random ? (unsigned int)(rand_r(&seed) % sectors) : i;
+			if (read_sector(s, buffer)) {
+				printf("Erro na leitura do setor %u\n", s);
+				exit(1);
+			}
+			if (doWrite && write_sector(s, buffer)) {
+				printf("Erro na escrita do setor %u\n", s);
+				exit(1);
+			}
+		}
+	}
+	if (doWrite && flush_disk()) {
+		printf("Erro no flush do disco\n");
+		exit(1);
+	}
+	double elapsed = now() - start;
+
+	return (double)sectors * reps / elapsed;
+}
+
+/* Le os setores e os grava de volta, em ordem aleatoria, com um unico lote por repeticao */
+static double runBatch(unsigned int sectors, int reps) {
+	unsigned char* data = (unsigned char*)malloc((size_t)sectors * SECTOR_SIZE);
+	struct sector_iovec* iov = (struct sector_iovec*)malloc(sectors * sizeof(struct sector_iovec));
+	struct sector_run* runs = (struct sector_run*)malloc(sectors * sizeof(struct sector_run));
+	if (data == NULL || iov == NULL || runs == NULL || read_sectors(0, sectors, data)) {
+		printf("Erro ao preparar o lote\n");
+		exit(1);
+	}
+
+	unsigned int seed = 2019;
+	for (unsigned int i = 0; i < sectors; i++) {
+		unsigned int s = (unsigned int)(rand_r(&seed) % sectors);
+		iov[i].buffer = &data[(size_t)s * SECTOR_SIZE];
+		iov[i].count = 1;
+		runs[i].sector = s;
+		runs[i].iov = &iov[i];
+		runs[i].iovcnt = 1;
+	}
+
+	double start = now();
+	for (int r = 0; r < reps; r++) {
+		if (write_sectors_batch(runs, sectors)) {
+			printf("Erro na escrita do lote\n");
+			exit(1);
+		}
+	}
+	if (flush_disk()) {
+		printf("Erro no flush do disco\n");
+		exit(1);
+	}
+	double elapsed = now() - start;
+
+	free(data);
+	free(iov);
+	free(runs);
+
+	return (double)sectors * reps / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned int sectors = argc > 1 ? (unsigned int)atoi(argv[1]) : 4096;
+	int reps = argc > 2 ? atoi(argv[2]) : 4;
+
+	if (sectors == 0 || reps <= 0) {
+		printf("Uso: %s [qtde_setores] [repeticoes]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%u setores x %d repeticoes (setores/s)\n", sectors, reps);
+	printf("%-24s", "");
+	for (int b = 0; b < NUM_BACKENDS; b++)
+		printf(" %14s", backends[b]);
+	printf("\n");
+
+	const char* names[] = { "leitura sequencial", "leitura aleatoria", "leitura+escrita seq.", "leitura+escrita aleat.", "escrita em lote aleat." };
+	for (int t = 0; t < 5; t++) {
+		printf("%-24s", names[t]);
+		double base = 0;
+		for (int b = 0; b < NUM_BACKENDS; b++) {
+			if (set_disk_backend(backends[b])) {
+				printf("Erro ao ativar o backend %s\n", backends[b]);
+				return 1;
+			}
+			double rate = (t == 4) ? runBatch(sectors, reps) : run(sectors, reps, t & 1, t >> 1);
+			if (b == 0)
+				base = rate;
+			printf(" %14.0f", rate);
+			if (b > 0)
+				printf(" (%.1fx)", rate / base);
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,174 @@
+
+/**
+
+	Benchmark de varias particoes montadas ao mesmo tempo (mount_ex)
+
+	Cada particao recebe um arquivo; as leituras alternam entre as duas
+	particoes.
+
+	Troca: apenas uma particao montada por vez (mount/mount2), como antes de
+	mount_ex: cada troca de particao desmonta a anterior, grava e descarta
+	sua cache e fecha os seus handles, que sao abertos de novo.
+
+	Montagens: as duas particoes montadas com mount_ex, cada uma com a sua
+	cache; o arquivo eh reaberto a cada leitura, sem remontar. Primeiro uma
+	thread, alternando entre as particoes, e depois uma thread por particao.
+
+	Uso: bench_mount [particao A] [particao B] [kbytes por arquivo] [repeticoes]
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/t2fs.h"
+
+#define CACHE_BLOCKS	256
+
+struct worker {
+	pthread_t thread;
+	MOUNT2 mount;
+	FILE2 handle;
+	int errors;
+	unsigned long long bytes;
+};
+
+static int fileBytes = 0;
+static int reps = 0;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Le o arquivo inteiro a partir do inicio (reabre o handle) */
+static int readAll(MOUNT2 mount, FILE2* handle, char* buffer) {
+	if (*handle >= 0)
+		close2(*handle);
+	if ((*handle = open2_ex(mount, "hot")) < 0)
+		return -1;
+
+	int total = 0;
+	int ret;
+	while (total < fileBytes && (ret = read2(*handle, buffer + total, fileBytes - total)) > 0)
+		total += ret;
+	return total == fileBytes ? 0 : -1;
+}
+
+static int createFile(MOUNT2 mount, char* buffer) {
+	FILE2 handle = create2_ex(mount, "hot");
+	if (handle < 0)
+		return handle;
+
+	int ret = write2(handle, buffer, fileBytes);
+	close2(handle);
+	return ret == fileBytes ? 0 : -1;
+}
+
+static void* workerMain(void* arg) {
+	struct worker* w = (struct worker*)arg;
+	char* buffer = (char*)malloc(fileBytes);
+
+	w->handle = -1;
+	for (int r = 0; r < reps; r++) {
+		if (readAll(w->mount, &w->handle, buffer))
+			w->errors++;
+		else
+			w->bytes += fileBytes;
+	}
+	close2(w->handle);
+
+	free(buffer);
+	return NULL;
+}
+
+int main(int argc, char* argv[]) {
+	int partitions[2];
+	partitions[0] = argc > 1 ? atoi(argv[1]) : 0;
+	partitions[1] = argc > 2 ? atoi(argv[2]) : 1;
+	int kbytes = argc > 3 ? atoi(argv[3]) : 64;
+	reps = argc > 4 ? atoi(argv[4]) : 200;
+
+	if (partitions[0] == partitions[1] || kbytes <= 0 || reps <= 0) {
+		printf("Uso: %s [particao A] [particao B] [kbytes] [repeticoes]\n", argv[0]);
+		return 1;
+	}
+	fileBytes = kbytes * 1024;
+
+	MOUNTOPT2 options = { 0 };
+	options.cacheBlocks = CACHE_BLOCKS;
+	options.threadSafe = 1;
+
+	MOUNT2 mounts[2];
+	char* buffer = (char*)malloc(fileBytes);
+	memset(buffer, 'x', fileBytes);
+	for (int p = 0; p < 2; p++) {
+		mounts[p] = mount_ex(partitions[p], &options);
+		if (mounts[p] < 0 || createFile(mounts[p], buffer)) {
+			printf("Erro ao preparar a particao %d (formatada?)\n", partitions[p]);
+			return 1;
+		}
+	}
+	umount_ex(mounts[0]);
+	umount_ex(mounts[1]);
+
+	printf("particoes %d e %d: %d KB por arquivo, %d leituras\n", partitions[0], partitions[1], kbytes, reps);
+	printf("%-24s %12s\n", "modo", "MB/s");
+	int errors = 0;
+
+	// Uma particao por vez: cada troca remonta e reabre o arquivo
+	double start = now();
+	for (int r = 0; r < reps; r++) {
+		FILE2 handle = -1;
+		int p = r % 2;
+		if (mount2(partitions[p], &options) || readAll(partitions[p], &handle, buffer))
+			errors++;
+	}
+	double base = reps * (double)fileBytes / (1024.0 * 1024.0) / (now() - start);
+	printf("%-24s %12.2f\n", "troca (mount2)", base);
+	umount();
+
+	// As duas montadas: a cache de cada particao continua valida entre as leituras
+	for (int p = 0; p < 2; p++)
+		mounts[p] = mount_ex(partitions[p], &options);
+
+	FILE2 handles[2] = { -1, -1 };
+	start = now();
+	for (int r = 0; r < reps; r++)
+		if (readAll(mounts[r % 2], &handles[r % 2], buffer))
+			errors++;
+	double rate = reps * (double)fileBytes / (1024.0 * 1024.0) / (now() - start);
+	printf("%-24s %12.2f %7.2fx\n", "mount_ex, 1 thread", rate, rate / base);
+	close2(handles[0]);
+	close2(handles[1]);
+
+	struct worker workers[2];
+	memset(workers, 0, sizeof(workers));
+	start = now();
+	for (int p = 0; p < 2; p++) {
+		workers[p].mount = mounts[p];
+		pthread_create(&workers[p].thread, NULL, workerMain, &workers[p]);
+	}
+	unsigned long long bytes = 0;
+	for (int p = 0; p < 2; p++) {
+		pthread_join(workers[p].thread, NULL);
+		errors += workers[p].errors;
+		bytes += workers[p].bytes;
+	}
+	rate = bytes / (1024.0 * 1024.0) / (now() - start);
+	printf("%-24s %12.2f %7.2fx\n", "mount_ex, 2 threads", rate, rate / base);
+
+	for (int p = 0; p < 2; p++) {
+		delete2_ex(mounts[p], "hot");
+		umount_ex(mounts[p]);
+	}
+	free(buffer);
+
+	printf("erros: %d\n", errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,318 @@
+
+/**
+
+	Benchmark e teste de estresse do modo thread-safe (MOUNTOPT2.threadSafe)
+
+	Leitura: de 1 ate N threads, cada uma lendo o seu proprio arquivo (handles
+	independentes) varias vezes e conferindo o conteudo; mostra MB/s total e
+	o ganho em relacao a uma thread.
+
+	Misto: N threads ao mesmo tempo; as pares regravam o proprio arquivo
+	(create2 + write2) e as impares leem o arquivo que a thread anterior
+	esta regravando, enquanto outra thread cria, copia, liga (hln2) e apaga
+	arquivos temporarios no diretorio. Cada leitura deve encontrar o arquivo
+	vazio (entre create2 e write2) ou inteiro em alguma versao ja gravada.
+
+	Consistencia: a particao eh desmontada e montada de novo (sem threads);
+	o diretorio deve conter exatamente os arquivos do benchmark, cada um com
+	o tamanho e o conteudo da ultima gravacao. Os arquivos sao apagados ao
+	final.
+
+	Uso: bench_mt [particao] [threads] [kbytes por arquivo] [repeticoes]
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/t2fs.h"
+
+#define MAX_THREADS		64
+#define CACHE_BLOCKS	512
+
+struct worker {
+	pthread_t thread;
+	int index;
+	int write;			/* Fase mista: regrava o arquivo em vez de ler */
+	int concurrent;		/* Fase mista: le um arquivo que outra thread regrava */
+	int errors;
+	unsigned long long bytes;
+};
+
+static int fileBytes = 0;
+static int reps = 0;
+static int version[MAX_THREADS];	/* Ultima gravacao completa de cada arquivo */
+static int stopChurn = 0;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fileName(char* name, int index) {
+	sprintf(name, "mt%d", index);
+}
+
+/* Conteudo do arquivo "index" depois da gravacao "version" */
+static void fillContents(char* buffer, int index, int version) {
+	unsigned int seed = 1000u * index + version;
+	for (int i = 0; i < fileBytes; i++)
+		buffer[i] = (char)(rand_r(&seed) & 0xFF);
+}
+
+static int writeFile(int index, int version, char* buffer) {
+	char name[16];
+	fileName(name, index);
+	fillContents(buffer, index, version);
+
+	FILE2 handle = create2(name);
+	if (handle < 0)
+		return handle;
+
+	int ret = write2(handle, buffer, fileBytes);
+	close2(handle);
+
+	return ret == fileBytes ? 0 : -1;
+}
+
+/* Le o arquivo inteiro e confere com a ultima versao gravada ou, se "concurrent", com qualquer versao */
+static int readFile(int index, int concurrent, char* buffer, char* expected) {
+	char name[16];
+	fileName(name, index);
+
+	FILE2 handle = open2(name);
+	if (handle < 0)
+		return handle;
+
+	int total = 0;
+	int ret;
+	while (total < fileBytes && (ret = read2(handle, buffer + total, fileBytes - total)) > 0)
+		total += ret;
+	close2(handle);
+
+	if (concurrent && total == 0)
+		return 0;
+	if (total != fileBytes)
+		return -1;
+
+	int newest = __atomic_load_n(&version[index], __ATOMIC_ACQUIRE);
+	if (!concurrent) {
+		fillContents(expected, index, newest);
+		return memcmp(buffer, expected, fileBytes) ? -1 : 0;
+	}
+
+	// Regravado por outra thread: a gravacao seguinte pode ter terminado antes de "version" mudar
+	for (int v = newest + 1; v >= 0; v--) {
+		fillContents(expected, index, v);
+		if (!memcmp(buffer, expected, fileBytes))
+			return 0;
+	}
+	return -1;
+}
+
+static void* readerMain(void* arg) {
+	struct worker* w = (struct worker*)arg;
+	char* buffer = (char*)malloc(fileBytes);
+	char* expected = (char*)malloc(fileBytes);
+
+	for (int r = 0; r < reps; r++) {
+		if (readFile(w->index, w->concurrent, buffer, expected))
+			w->errors++;
+		else
+			w->bytes += fileBytes;
+	}
+
+	free(buffer);
+	free(expected);
+	return NULL;
+}
+
+static void* writerMain(void* arg) {
+	struct worker* w = (struct worker*)arg;
+	char* buffer = (char*)malloc(fileBytes);
+
+	for (int r = 0; r < reps; r++) {
+		if (writeFile(w->index, version[w->index] + 1, buffer))
+			w->errors++;
+		else {
+			__atomic_add_fetch(&version[w->index], 1, __ATOMIC_RELEASE);
+			w->bytes += fileBytes;
+		}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/* Cria, copia, liga e apaga arquivos temporarios ate stopChurn */
+static void* churnMain(void* arg) {
+	struct worker* w = (struct worker*)arg;
+	char buffer[512];
+	memset(buffer, 'x', sizeof(buffer));
+
+	for (int n = 0; !__atomic_load_n(&stopChurn, __ATOMIC_ACQUIRE); n++) {
+		FILE2 handle = create2("tmp");
+		if (handle < 0 || write2(handle, buffer, sizeof(buffer)) != sizeof(buffer))
+			w->errors++;
+		if (handle >= 0)
+			close2(handle);
+
+		if (copy2("tmp", "tmpcp") != sizeof(buffer) || hln2("tmphl", "tmpcp"))
+			w->errors++;
+
+		DIRENT2 entries[64];
+		if (opendir2() || readdirv2(entries, 64) < 0 || closedir2())
+			w->errors++;
+
+		if (delete2("tmphl") || delete2("tmpcp") || delete2("tmp"))
+			w->errors++;
+		w->bytes += 2 * sizeof(buffer);
+	}
+
+	return NULL;
+}
+
+static int runThreads(struct worker* workers, int count) {
+	for (int i = 0; i < count; i++)
+		pthread_create(&workers[i].thread, NULL, workers[i].write ? writerMain : readerMain, &workers[i]);
+
+	int errors = 0;
+	for (int i = 0; i < count; i++) {
+		pthread_join(workers[i].thread, NULL);
+		errors += workers[i].errors;
+	}
+	return errors;
+}
+
+/* Remonta sem threads e confere diretorio, tamanhos e conteudos */
+static int checkConsistency(int partition, int threads) {
+	if (umount() || mount(partition))
+		return -1;
+
+	int found[MAX_THREADS] = { 0 };
+	int errors = 0;
+	DIRENT2 dentry;
+
+	opendir2();
+	while (readdir2(&dentry) == 0) {
+		int index = -1;
+		if (sscanf(dentry.name, "mt%d", &index) == 1 && index >= 0 && index < threads && dentry.fileSize == (DWORD)fileBytes)
+			found[index]++;
+		else {
+			printf("entrada inesperada: %s (%u bytes)\n", dentry.name, dentry.fileSize);
+			errors++;
+		}
+	}
+	closedir2();
+
+	char* buffer = (char*)malloc(fileBytes);
+	char* expected = (char*)malloc(fileBytes);
+	for (int i = 0; i < threads; i++) {
+		if (found[i] != 1 || readFile(i, 0, buffer, expected)) {
+			printf("arquivo mt%d inconsistente\n", i);
+			errors++;
+		}
+	}
+	free(buffer);
+	free(expected);
+
+	return errors;
+}
+
+int main(int argc, char* argv[]) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int partition = argc > 1 ? atoi(argv[1]) : 0;
+	int threads = argc > 2 ? atoi(argv[2]) : (cpus < 2 ? 2 : (cpus > MAX_THREADS ? MAX_THREADS : (int)cpus));
+	int kbytes = argc > 3 ? atoi(argv[3]) : 16;
+	reps = argc > 4 ? atoi(argv[4]) : 200;
+
+	if (threads <= 0 || threads > MAX_THREADS || kbytes <= 0 || reps <= 0) {
+		printf("Uso: %s [particao] [threads (1 a %d)] [kbytes] [repeticoes]\n", argv[0], MAX_THREADS);
+		return 1;
+	}
+	fileBytes = kbytes * 1024;
+
+	MOUNTOPT2 options = { 0 };
+	options.cacheBlocks = CACHE_BLOCKS;
+	options.threadSafe = 1;
+	int err = mount2(partition, &options);
+	if (err) {
+		printf("Erro em mount2: %d\n", err);
+		return 1;
+	}
+
+	char* buffer = (char*)malloc(fileBytes);
+	for (int i = 0; i < threads; i++) {
+		if ((err = writeFile(i, 0, buffer))) {
+			printf("Erro ao criar mt%d: %d\n", i, err);
+			umount();
+			return 1;
+		}
+	}
+	free(buffer);
+
+	printf("particao %d: %d KB por arquivo, %d repeticoes, %ld processadores\n", partition, kbytes, reps, cpus);
+	printf("%-10s %12s %8s\n", "leitores", "MB/s", "ganho");
+
+	struct worker workers[MAX_THREADS + 1];
+	int errors = 0;
+	double base = 0;
+	for (int t = 1; t <= threads; t++) {
+		memset(workers, 0, sizeof(workers));
+		for (int i = 0; i < t; i++)
+			workers[i].index = i;
+
+		double start = now();
+		errors += runThreads(workers, t);
+		double elapsed = now() - start;
+
+		unsigned long long bytes = 0;
+		for (int i = 0; i < t; i++)
+			bytes += workers[i].bytes;
+		double rate = bytes / (1024.0 * 1024.0) / elapsed;
+		if (t == 1)
+			base = rate;
+		printf("%-10d %12.2f %7.2fx\n", t, rate, rate / base);
+	}
+
+	// Fase mista: threads pares regravam, impares leem o arquivo da anterior e uma thread usa o diretorio
+	memset(workers, 0, sizeof(workers));
+	for (int i = 0; i < threads; i++) {
+		workers[i].write = (i % 2 == 0);
+		workers[i].concurrent = !workers[i].write;
+		workers[i].index = workers[i].write ? i : i - 1;
+	}
+
+	struct worker* churn = &workers[threads];
+	pthread_create(&churn->thread, NULL, churnMain, churn);
+
+	double start = now();
+	errors += runThreads(workers, threads);
+	__atomic_store_n(&stopChurn, 1, __ATOMIC_RELEASE);
+	pthread_join(churn->thread, NULL);
+	double elapsed = now() - start;
+	errors += churn->errors;
+
+	unsigned long long bytes = churn->bytes;
+	for (int i = 0; i < threads; i++)
+		bytes += workers[i].bytes;
+	printf("%-10s %12.2f (%d threads + diretorio)\n", "misto", bytes / (1024.0 * 1024.0) / elapsed, threads);
+
+	int inconsistent = checkConsistency(partition, threads);
+	printf("erros: %d, consistencia: %s\n", errors, inconsistent ? "FALHOU" : "ok");
+
+	char name[16];
+	for (int i = 0; i < threads; i++) {
+		fileName(name, i);
+		delete2(name);
+	}
+	umount();
+
+	return (errors || inconsistent) ? 1 : 0;
+}
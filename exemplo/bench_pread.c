@@ -0,0 +1,223 @@
+
+/**
+
+	Benchmark de leituras aleatorias com pread2 (indice de consulta)
+
+	Um arquivo grande eh gravado uma vez; de 1 ate N threads fazem leituras
+	de "bytes por leitura" bytes em posicoes aleatorias com pread2 e
+	conferem o conteudo. Com handle unico, todas as threads usam o mesmo
+	handle (antes de pread2, cada leitura esperaria pelas outras no
+	contador de posicao do handle); com handle por thread, cada thread
+	abre o seu. Os dois devem escalar da mesma forma: o ganho em relacao a
+	uma thread so aparece com varios processadores na maquina.
+
+	Tambem confere pwrite2: registros regravados em posicoes aleatorias
+	por varias threads no mesmo handle, sem alterar o contador de posicao.
+
+	Uso: bench_pread [particao] [threads] [kbytes do arquivo] [bytes por leitura] [leituras por thread]
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/t2fs.h"
+
+#define MAX_THREADS		64
+#define CACHE_BLOCKS	512
+#define FILE_NAME		"index"
+
+struct worker {
+	pthread_t thread;
+	int index;
+	FILE2 handle;
+	int errors;
+};
+
+static int fileBytes = 0;
+static int record = 0;
+static int reads = 0;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Conteudo do byte "pos" do arquivo */
+static char contents(int pos) {
+	return (char)(pos * 31 + pos / 509);
+}
+
+/* Conteudo do registro regravado "rec" pela thread "index" */
+static char recordByte(int index, int rec, int i) {
+	return (char)(index * 17 + rec * 5 + i);
+}
+
+static void* readerMain(void* arg) {
+	struct worker* w = (struct worker*)arg;
+	char* buffer = (char*)malloc(record);
+	unsigned int seed = 1 + w->index;
+
+	for (int r = 0; r < reads; r++) {
+		int offset = rand_r(&seed) % (fileBytes - record + 1);
+		if (pread2(w->handle, buffer, record, offset) != record) {
+			w->errors++;
+			continue;
+		}
+		for (int i = 0; i < record; i++)
+			if (buffer[i] != contents(offset + i)) {
+				w->errors++;
+				break;
+			}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/* Cada thread regrava os registros de indice igual ao seu modulo o numero de threads */
+static int writers = 0;
+
+static void* writerMain(void* arg) {
+	struct worker* w = (struct worker*)arg;
+	char* buffer = (char*)malloc(record);
+	int records = fileBytes / record;
+
+	for (int rec = w->index; rec < records; rec += writers) {
+		for (int i = 0; i < record; i++)
+			buffer[i] = recordByte(w->index, rec, i);
+		if (pwrite2(w->handle, buffer, record, rec * record) != record)
+			w->errors++;
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/* Executa "threads" threads de "start"; retorna o numero de erros */
+static int runThreads(int threads, FILE2 shared, void* (*start)(void*)) {
+	struct worker workers[MAX_THREADS];
+	memset(workers, 0, sizeof(workers));
+	int errors = 0;
+
+	for (int t = 0; t < threads; t++) {
+		workers[t].index = t;
+		workers[t].handle = shared >= 0 ? shared : open2(FILE_NAME);
+		if (workers[t].handle < 0)
+			errors++;
+		pthread_create(&workers[t].thread, NULL, start, &workers[t]);
+	}
+
+	for (int t = 0; t < threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		errors += workers[t].errors;
+		if (shared < 0)
+			close2(workers[t].handle);
+	}
+
+	return errors;
+}
+
+static int writeFile(void) {
+	char* buffer = (char*)malloc(fileBytes);
+	for (int i = 0; i < fileBytes; i++)
+		buffer[i] = contents(i);
+
+	FILE2 handle = create2(FILE_NAME);
+	int errors = (handle < 0 || write2(handle, buffer, fileBytes) != fileBytes);
+	if (close2(handle))
+		errors++;
+
+	free(buffer);
+	return errors;
+}
+
+/* Regrava os registros com pwrite2 pelo mesmo handle e confere com read2 */
+static int checkWrites(int threads) {
+	FILE2 handle = open2(FILE_NAME);
+	if (handle < 0)
+		return 1;
+
+	writers = threads;
+	int errors = runThreads(threads, handle, writerMain);
+
+	// O contador de posicao continua no inicio do arquivo
+	char* buffer = (char*)malloc(fileBytes);
+	int total = 0;
+	int ret;
+	while (total < fileBytes && (ret = read2(handle, buffer + total, fileBytes - total)) > 0)
+		total += ret;
+	if (total != fileBytes || close2(handle))
+		errors++;
+
+	int records = fileBytes / record;
+	for (int pos = 0; pos < total; pos++) {
+		int rec = pos / record;
+		char expected = rec < records ? recordByte(rec % threads, rec, pos % record) : contents(pos);
+		if (buffer[pos] != expected) {
+			errors++;
+			break;
+		}
+	}
+
+	free(buffer);
+	return errors;
+}
+
+int main(int argc, char* argv[]) {
+	int partition = argc > 1 ? atoi(argv[1]) : 0;
+	int maxThreads = argc > 2 ? atoi(argv[2]) : 4;
+	int kbytes = argc > 3 ? atoi(argv[3]) : 256;
+	record = argc > 4 ? atoi(argv[4]) : 128;
+	reads = argc > 5 ? atoi(argv[5]) : 20000;
+
+	fileBytes = kbytes * 1024;
+	if (maxThreads <= 0 || maxThreads > MAX_THREADS || kbytes <= 0 || record <= 0 || record > fileBytes || reads <= 0) {
+		printf("Uso: %s [particao] [threads (1 a %d)] [kbytes do arquivo] [bytes por leitura] [leituras por thread]\n", argv[0], MAX_THREADS);
+		return 1;
+	}
+
+	MOUNTOPT2 options = { 0 };
+	options.cacheBlocks = CACHE_BLOCKS;
+	options.threadSafe = 1;
+	int err = mount2(partition, &options);
+	if (err) {
+		printf("Erro em mount2: %d (particao formatada?)\n", err);
+		return 1;
+	}
+
+	int errors = writeFile();
+
+	printf("arquivo de %d KB, leituras de %d bytes, %ld processadores\n", kbytes, record, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%-8s %22s %22s\n", "threads", "handle unico (mil/s)", "handle por thread");
+	double base[2] = { 0 };
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		double rates[2];
+		for (int m = 0; m < 2; m++) {
+			FILE2 shared = m == 0 ? open2(FILE_NAME) : -1;
+			double start = now();
+			errors += runThreads(threads, shared, readerMain);
+			rates[m] = threads * (double)reads / 1000.0 / (now() - start);
+			if (shared >= 0)
+				close2(shared);
+		}
+
+		if (threads == 1)
+			memcpy(base, rates, sizeof(base));
+		printf("%-8d %15.1f %5.2fx %15.1f %5.2fx\n", threads, rates[0], rates[0] / base[0], rates[1], rates[1] / base[1]);
+	}
+
+	errors += checkWrites(maxThreads);
+
+	delete2(FILE_NAME);
+	umount();
+
+	printf("erros: %d\n", errors);
+	return errors ? 1 : 0;
+}
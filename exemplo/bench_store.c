@@ -0,0 +1,231 @@
+
+/**
+
+	Benchmark do armazenamento distribuido em particoes (shardstore.h)
+
+	Para 1 ate N particoes (as primeiras da lista), abre o conjunto e mede:
+
+	Dividido: uma thread grava e depois le varias vezes um objeto dividido
+	(striping) entre as particoes; os pedacos sao lidos e gravados em
+	paralelo pelas threads de E/S das particoes.
+
+	Inteiros: uma thread chamadora por particao, cada uma lendo os seus
+	objetos nao divididos, colocados nas particoes pelo hash do nome.
+
+	O conteudo lido eh conferido. O ganho eh relativo a uma particao; so
+	aparece com varios processadores (ou discos) na maquina.
+
+	Com -i N, o conjunto usa N arquivos de disco (shard_K.dat, copias de
+	t2fs_disk.dat com a particao 0 formatada), um por particao: cada shard
+	tem o seu proprio descritor do disco (openstore_ex).
+
+	Uso: bench_store [particoes, ex: 0,1,3 | -i imagens] [kbytes por objeto] [repeticoes]
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/t2fs.h"
+#include "../include/shardstore.h"
+
+#define CACHE_BLOCKS	256
+#define THREAD_OBJECTS	4		/* Objetos inteiros por thread chamadora */
+#define IMAGE_SECTORS	4		/* Setores por bloco das imagens formatadas por -i */
+
+struct worker {
+	pthread_t thread;
+	int index;
+	int errors;
+	unsigned long long bytes;
+};
+
+static int objectBytes = 0;
+static int reps = 0;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fillContents(char* buffer, int size, unsigned int seed) {
+	for (int i = 0; i < size; i++)
+		buffer[i] = (char)(rand_r(&seed) & 0xFF);
+}
+
+static int checkObject(char* name, char* buffer, char* expected, int size) {
+	return getobj2(name, buffer, size) != size || memcmp(buffer, expected, size) ? -1 : 0;
+}
+
+static void* workerMain(void* arg) {
+	struct worker* w = (struct worker*)arg;
+	int size = objectBytes / THREAD_OBJECTS;
+	char* buffer = (char*)malloc(size);
+	char* expected = (char*)malloc(size);
+	char name[16];
+
+	for (int j = 0; j < THREAD_OBJECTS; j++) {
+		sprintf(name, "w%d_%d", w->index, j);
+		fillContents(expected, size, 100u * w->index + j);
+		if (putobj2(name, expected, size, 0))
+			w->errors++;
+	}
+
+	for (int r = 0; r < reps; r++) {
+		int j = r % THREAD_OBJECTS;
+		sprintf(name, "w%d_%d", w->index, j);
+		fillContents(expected, size, 100u * w->index + j);
+		if (checkObject(name, buffer, expected, size))
+			w->errors++;
+		else
+			w->bytes += size;
+	}
+
+	for (int j = 0; j < THREAD_OBJECTS; j++) {
+		sprintf(name, "w%d_%d", w->index, j);
+		delobj2(name);
+	}
+
+	free(buffer);
+	free(expected);
+	return NULL;
+}
+
+/* Cria a imagem "name" copiando t2fs_disk.dat e formata a sua particao 0 */
+static int createImage(char* name) {
+	FILE* src = fopen("t2fs_disk.dat", "rb");
+	FILE* dst = fopen(name, "wb");
+	int err = src == NULL || dst == NULL;
+	char buffer[4096];
+	size_t n;
+	while (!err && (n = fread(buffer, 1, sizeof(buffer), src)) > 0)
+		err = fwrite(buffer, 1, n, dst) != n;
+	if (src != NULL)
+		fclose(src);
+	if (dst != NULL)
+		fclose(dst);
+
+	return err ? -1 : formatimage_ex(name, 0, IMAGE_SECTORS, 0);
+}
+
+/* Mede as fases com o conjunto aberto; "rates" recebe gravacao e leitura do dividido e leitura dos inteiros */
+static int runStore(int shards, double* rates) {
+	char* buffer = (char*)malloc(objectBytes);
+	char* expected = (char*)malloc(objectBytes);
+	int errors = 0;
+
+	// A conferencia fica fora do tempo medido
+	fillContents(expected, objectBytes, 7);
+	double start = now();
+	for (int r = 0; r < reps; r++)
+		if (putobj2("big", expected, objectBytes, 1))
+			errors++;
+	rates[0] = reps * (double)objectBytes / (1024.0 * 1024.0) / (now() - start);
+
+	start = now();
+	for (int r = 0; r < reps; r++)
+		if (getobj2("big", buffer, objectBytes) != objectBytes)
+			errors++;
+	rates[1] = reps * (double)objectBytes / (1024.0 * 1024.0) / (now() - start);
+	if (memcmp(buffer, expected, objectBytes))
+		errors++;
+	delobj2("big");
+
+	struct worker workers[STORE_MAX_SHARDS];
+	memset(workers, 0, sizeof(workers));
+	start = now();
+	for (int t = 0; t < shards; t++) {
+		workers[t].index = t;
+		pthread_create(&workers[t].thread, NULL, workerMain, &workers[t]);
+	}
+	unsigned long long bytes = 0;
+	for (int t = 0; t < shards; t++) {
+		pthread_join(workers[t].thread, NULL);
+		errors += workers[t].errors;
+		bytes += workers[t].bytes;
+	}
+	rates[2] = bytes / (1024.0 * 1024.0) / (now() - start);
+
+	free(buffer);
+	free(expected);
+	return errors;
+}
+
+int main(int argc, char* argv[]) {
+	int images = argc > 2 && strcmp(argv[1], "-i") == 0;
+	int arg = images ? 2 : 1;
+	char* list = argc > arg ? argv[arg] : "0,1,3";
+	int kbytes = argc > arg + 1 ? atoi(argv[arg + 1]) : 32;
+	reps = argc > arg + 2 ? atoi(argv[arg + 2]) : 200;
+
+	int partitions[STORE_MAX_SHARDS];
+	char names[STORE_MAX_SHARDS][16];
+	char* imageNames[STORE_MAX_SHARDS];
+	int count = 0;
+	if (images) {
+		count = atoi(list);
+		if (count > STORE_MAX_SHARDS)
+			count = STORE_MAX_SHARDS;
+	}
+	else {
+		for (char* p = list; *p && count < STORE_MAX_SHARDS; p++) {
+			partitions[count++] = (int)strtol(p, &p, 10);
+			if (*p != ',')
+				break;
+		}
+	}
+
+	if (count <= 0 || kbytes <= 0 || reps <= 0) {
+		printf("Uso: %s [particoes, ex: 0,1,3 | -i imagens] [kbytes] [repeticoes]\n", argv[0]);
+		return 1;
+	}
+	objectBytes = kbytes * 1024;
+
+	for (int n = 0; images && n < count; n++) {
+		sprintf(names[n], "shard_%d.dat", n);
+		imageNames[n] = names[n];
+		int err = createImage(names[n]);
+		if (err) {
+			printf("Erro ao criar a imagem %s: %d\n", names[n], err);
+			return 1;
+		}
+	}
+
+	STOREOPT2 options = { 0 };
+	options.cacheBlocks = CACHE_BLOCKS;
+
+	printf("%d KB por objeto, %d repeticoes, %ld processadores\n", kbytes, reps, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%-10s %14s %14s %14s\n", images ? "imagens" : "particoes", "div. grav.", "div. leit.", "inteiros");
+	int errors = 0;
+	double base[3] = { 0 };
+	for (int n = 1; n <= count; n++) {
+		int err = images ? openstore_ex(imageNames, 0, n, &options) : openstore2(partitions, n, &options);
+		if (err) {
+			printf("Erro ao abrir o conjunto (%d particoes): %d (formatadas?)\n", n, err);
+			return 1;
+		}
+
+		double rates[3];
+		errors += runStore(n, rates);
+		closestore2();
+
+		if (n == 1)
+			memcpy(base, rates, sizeof(base));
+		printf("%-10d", n);
+		for (int i = 0; i < 3; i++)
+			printf(" %8.2f %4.2fx", rates[i], rates[i] / base[i]);
+		printf("\n");
+	}
+
+	for (int n = 0; images && n < count; n++)
+		remove(names[n]);
+
+	printf("MB/s; erros: %d\n", errors);
+	return errors ? 1 : 0;
+}
@@ -75,7 +75,7 @@ char helpCreate[] = "[file]       -> create new [file] in T2FS";
 char helpDelete[] = "[file]       -> deletes [file] from T2FS";
 char helpSeek[] = "[hdl] [pos]  -> set CP of [hdl] file on [pos]";
 char helpLn[] = "[type] [lnk] [file] -> create soft [-s] or hard [-h] link [lnk] to [file]";
-char helpFormat[] = "[part]  [bs] -> format virtual disk";
+char helpFormat[] = "[part]  [bs] [-h] -> format virtual disk (-h: hashed root directory)";
 
 char helpCopy[] = "[src] [dst]  -> copy files: [src] -> [dst]";
 char helpFscp[] = "[src] [dst]  -> copy files: [src] -> [dst]"
@@ -461,7 +461,12 @@ void cmdFormat(void) {
 		return;
 	}
 
-	int err = format2(partition, sectors_per_block);
+	int flags = 0;
+	token = strtok(NULL, " \t\n");
+	if (token != NULL && strcmp(token, "-h") == 0)
+		flags |= FORMAT2_HASHDIR;
+
+	int err = format2_ex(partition, sectors_per_block, flags);
 	if (err) {
 		printf("Error: %d\n", err);
 		return;
@@ -499,31 +504,18 @@ void cmdCp(void) {
 		printf("Missing parameter\n");
 		return;
 	}
-	// Abre o arquivo origem, que deve existir
-	FILE2 hSrc = open2(src);
-	if (hSrc < 0) {
-		printf("Open source file error: %d\n", hSrc);
-		return;
-	}
-	// Cria o arquivo de destino, que ser� resetado se existir
-	FILE2 hDst = create2(dst);
-	if (hDst < 0) {
-		close2(hSrc);
-		printf("Create destination file error: %d\n", hDst);
+	// Copia dentro do T2FS, em trechos de varios blocos
+	int copied = copy2(src, dst);
+	if (copied < 0) {
+		printf("Copy error: %d\n", copied);
 		return;
 	}
-	// Copia os dados de source para destination
-	char buffer[2];
-	while (read2(hSrc, buffer, 1) == 1) {
-		write2(hDst, buffer, 1);
-	}
-	// Fecha os arquicos
-	close2(hSrc);
-	close2(hDst);
 
 	printf("Files successfully copied\n");
 }
 
+#define FSCP_BUFFER	(64 * 1024)	/* Bytes transferidos por vez em fscp */
+
 /**
 Copia arquivo de um sistema de arquivos para o outro
 Os parametros s�o:
@@ -561,15 +553,16 @@ void cmdFscp(void) {
 			return;
 		}
 		// Copia os dados de source para destination
-		char buffer[SECTOR_SIZE + 1];
+		char* buffer = (char*)malloc(FSCP_BUFFER);
 		int bytesRead = 0;
 		int bytesWritten = 0;
-		while ((bytesRead = fread((void*)buffer, (size_t)1, (size_t)SECTOR_SIZE, hSrc)) > 0) {
+		while ((bytesRead = fread((void*)buffer, (size_t)1, (size_t)FSCP_BUFFER, hSrc)) > 0) {
 			if ((bytesWritten = write2(hDst, buffer, bytesRead)) != bytesRead) {
 				printf("Error on write operation. Error: %d\n", bytesWritten);
-				return;
+				break;
 			}
 		}
+		free(buffer);
 		// Fecha os arquicos
 		fclose(hSrc);
 		close2(hDst);
@@ -591,11 +584,11 @@ void cmdFscp(void) {
 			return;
 		}
 		// Copia os dados de source para destination
-		char buffer[SECTOR_SIZE + 1];
+		char* buffer = (char*)malloc(FSCP_BUFFER);
 		int bytesRead = 0;
 		int bytesWritten = 0;
-		while ((bytesRead = read2(hSrc, buffer, SECTOR_SIZE)) > 0) {
-			if ((bytesWritten = fwrite((void*)buffer, (size_t)1, (size_t)SECTOR_SIZE, hDst)) != bytesRead) {
+		while ((bytesRead = read2(hSrc, buffer, FSCP_BUFFER)) > 0) {
+			if ((bytesWritten = fwrite((void*)buffer, (size_t)1, (size_t)bytesRead, hDst)) != bytesRead) {
 				printf("Error on write operation. Expected: %d. Written: %d\n", bytesRead, bytesWritten);
 				break;
 			}
@@ -847,6 +840,8 @@ void cmdWrite(void) {
 	printf("%d bytes writen to file-handle %d\n", err, handle);
 }
 
+#define LS_BATCH	32	/* Entradas lidas por chamada de readdirv2 */
+
 void cmdLs(void) {
 
 	// Abre o diret�rio pedido
@@ -857,10 +852,12 @@ void cmdLs(void) {
 		return;
 	}
 
-	// Coloca diretorio na tela
-	DIRENT2 dentry;
-	while (readdir2(&dentry) == 0) {
-		printf("%c %8u %s\n", (dentry.fileType == 0x02 ? 'd' : '-'), dentry.fileSize, dentry.name);
+	// Coloca diretorio na tela (varias entradas por chamada)
+	DIRENT2 dentry[LS_BATCH];
+	int n;
+	while ((n = readdirv2(dentry, LS_BATCH)) > 0) {
+		for (int i = 0; i < n; i++)
+			printf("%c %8u %s\n", (dentry[i].fileType == 0x02 ? 'd' : '-'), dentry[i].fileSize, dentry[i].name);
 	}
 
 	closedir2();
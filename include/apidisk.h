@@ -7,6 +7,11 @@
 	Os setores são endereçados através de sua numeração sequencial, a partir de ZERO.
 	O setor lógico tem, sempre, 256 bytes (SECTOR_SIZE)
 
+	As funções sem o sufixo _ex usam a imagem padrão t2fs_disk.dat. Outras
+	imagens são abertas com open_disk e passadas às funções _ex, cada uma
+	com o seu próprio descritor, mapeamento e anel do backend; NULL nas
+	funções _ex indica a imagem padrão.
+
 	Versão: 16.2
 
 *************************************************************************/
@@ -14,8 +19,19 @@
 #ifndef __apidisk_h__
 #define __apidisk_h__
 
+#include <stddef.h>
+
 #define SECTOR_SIZE 256
 
+/* Imagem de disco aberta com open_disk */
+struct disk_image;
+
+/* Trecho de memória usado nas operações de espalhamento/agrupamento (scatter/gather) */
+struct sector_iovec {
+	unsigned char* buffer;	/* área de memória com "count" setores */
+	unsigned int count;	/* número de setores do trecho */
+};
+
 /*------------------------------------------------------------------------
 Função:	Realiza leitura de um setor lógico do disco
 
@@ -39,6 +55,165 @@ Retorna:"0", se a leitura foi realizada corretamente
 ------------------------------------------------------------------------*/
 int write_sector(unsigned int sector, unsigned char* buffer);
 
+
+/*------------------------------------------------------------------------
+Função:	Realiza leitura de "count" setores lógicos consecutivos do disco,
+	em uma única operação de E/S
+
+Entra:	sector -> primeiro setor lógico a ser lido, iniciando em ZERO
+	count -> quantidade de setores
+	buffer -> área de memória com espaço para count * SECTOR_SIZE bytes
+
+Retorna:"0", se a leitura foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int read_sectors(unsigned int sector, unsigned int count, unsigned char* buffer);
+
+
+/*------------------------------------------------------------------------
+Função:	Realiza escrita de "count" setores lógicos consecutivos do disco,
+	em uma única operação de E/S
+
+Entra:	sector -> primeiro setor lógico a ser escrito, iniciando em ZERO
+	count -> quantidade de setores
+	buffer -> área de memória com os count * SECTOR_SIZE bytes a serem escritos
+
+Retorna:"0", se a escrita foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int write_sectors(unsigned int sector, unsigned int count, unsigned char* buffer);
+
+
+/*------------------------------------------------------------------------
+Função:	Lê uma faixa contígua de setores, a partir de "sector", espalhando
+	os dados pelos trechos de memória de "iov" (na ordem do vetor)
+
+Entra:	sector -> primeiro setor lógico a ser lido
+	iov -> vetor de trechos de memória
+	iovcnt -> número de elementos de iov
+
+Retorna:"0", se a leitura foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int read_sectorsv(unsigned int sector, const struct sector_iovec* iov, int iovcnt);
+
+
+/*------------------------------------------------------------------------
+Função:	Escreve em uma faixa contígua de setores, a partir de "sector",
+	os dados agrupados dos trechos de memória de "iov" (na ordem do vetor)
+
+Retorna:"0", se a escrita foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int write_sectorsv(unsigned int sector, const struct sector_iovec* iov, int iovcnt);
+
+
+/* Faixa contígua de setores de uma requisição em lote (read_sectors_batch/write_sectors_batch) */
+struct sector_run {
+	unsigned int sector;			/* primeiro setor lógico da faixa */
+	const struct sector_iovec* iov;	/* trechos de memória, como em read_sectorsv */
+	int iovcnt;
+};
+
+
+/*------------------------------------------------------------------------
+Função:	Lê várias faixas de setores (não necessariamente adjacentes) em um
+	único lote. No backend "uring" todas as faixas são submetidas juntas e
+	as conclusões são recolhidas juntas; nos demais, são lidas em sequência.
+
+Entra:	runs -> vetor de faixas
+	nruns -> número de elementos de runs
+
+Retorna:"0", se todas as leituras foram realizadas corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int read_sectors_batch(const struct sector_run* runs, int nruns);
+
+
+/*------------------------------------------------------------------------
+Função:	Escreve várias faixas de setores em um único lote (ver read_sectors_batch)
+
+Retorna:"0", se todas as escritas foram realizadas corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int write_sectors_batch(const struct sector_run* runs, int nruns);
+
+
+/*------------------------------------------------------------------------
+Função:	Informa uma área de memória usada em muitas requisições (ex.: a cache
+	de blocos). O backend "uring" a registra no kernel e usa operações com
+	buffer fixo para os trechos contidos nela. NULL desfaz o registro.
+
+Retorna:"0" (o registro é apenas uma otimização; se falhar, é ignorado)
+------------------------------------------------------------------------*/
+int register_disk_buffer(unsigned char* buffer, size_t size);
+
+
+/*------------------------------------------------------------------------
+Função:	Força a gravação em disco dos setores já escritos
+	(msync no backend "mmap", fsync nos backends "pread" e "uring")
+
+Retorna:"0", se a operação foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int flush_disk(void);
+
+
+/*------------------------------------------------------------------------
+Função:	Abre o arquivo "path" como uma imagem de disco, com o backend
+	selecionado (ver set_disk_backend). A imagem é independente da padrão
+	e das demais: pode ser usada ao mesmo tempo por outras threads.
+
+Retorna: a imagem, se sucesso
+	NULL, se erro na abertura do arquivo
+------------------------------------------------------------------------*/
+struct disk_image* open_disk(const char* path);
+
+
+/*------------------------------------------------------------------------
+Função:	Força a gravação dos setores escritos e fecha a imagem
+	(NULL: nada a fazer)
+
+Retorna:"0", se a operação foi realizada corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int close_disk(struct disk_image* disk);
+
+
+/*------------------------------------------------------------------------
+	Versões das funções acima para a imagem "disk" (NULL: imagem padrão).
+	Parâmetros e retornos iguais aos das funções sem o sufixo _ex.
+------------------------------------------------------------------------*/
+int read_sectors_ex(struct disk_image* disk, unsigned int sector, unsigned int count, unsigned char* buffer);
+int write_sectors_ex(struct disk_image* disk, unsigned int sector, unsigned int count, unsigned char* buffer);
+int read_sectorsv_ex(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt);
+int write_sectorsv_ex(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt);
+int read_sectors_batch_ex(struct disk_image* disk, const struct sector_run* runs, int nruns);
+int write_sectors_batch_ex(struct disk_image* disk, const struct sector_run* runs, int nruns);
+int register_disk_buffer_ex(struct disk_image* disk, unsigned char* buffer, size_t size);
+int flush_disk_ex(struct disk_image* disk);
+
+
+/*------------------------------------------------------------------------
+Função:	Seleciona o backend de acesso ao arquivo de disco
+	O backend padrão é definido por APIDISK_BACKEND na compilação,
+	ou pela variável de ambiente T2FS_DISK_BACKEND. A imagem padrão é
+	reaberta com o backend; as de open_disk mantêm o seu.
+
+Entra:	name -> "stdio", "pread", "mmap" ou "uring" (io_uring no Linux;
+		usa pread/pwrite se io_uring não estiver disponível)
+
+Retorna:"0", se o backend foi ativado corretamente
+	Valor diferente de zero, caso tenha ocorrido algum erro.
+------------------------------------------------------------------------*/
+int set_disk_backend(const char* name);
+
+
+/*------------------------------------------------------------------------
+Função:	Informa o nome do backend ativo (NULL em caso de erro)
+------------------------------------------------------------------------*/
+const char* get_disk_backend(void);
+
 #endif
 
 
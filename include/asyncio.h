@@ -0,0 +1,45 @@
+/*************************************************************************
+
+	E/S assincrona do T2FS (read2_async, write2_async, poll2 e wait2)
+
+	As requisicoes sao colocadas em uma fila sem bloqueio (lock-free) e
+	atendidas, em ordem, por uma thread de E/S criada na primeira requisicao.
+	A thread junta requisicoes consecutivas do mesmo tipo sobre o mesmo
+	handle em uma unica chamada de readv2/writev2, sobre os buffers das
+	proprias requisicoes. A juncao eh por handle, no nivel das chamadas do
+	T2FS: requisicoes de handles diferentes nao sao juntadas, mesmo que os
+	setores sejam vizinhos no disco (os setores de uma chamada vao ao
+	disco pela cache de blocos e pelo backend de apidisk).
+
+	Enquanto houver requisicoes pendentes, as funcoes sincronas do T2FS
+	esperam por elas (drainAsync) antes de executar. Na montagem
+	thread-safe (MOUNTOPT2.threadSafe), read2, write2, pread2, pwrite2,
+	readv2, writev2 e close2 esperam apenas pelas requisicoes do proprio
+	handle (drainAsyncHandle) e executam ao mesmo tempo que a thread de E/S.
+
+*************************************************************************/
+
+#ifndef __ASYNCIO__
+#define __ASYNCIO__
+
+#define ASYNCIO_MAX_REQUESTS	64			/* Requisicoes pendentes ao mesmo tempo (potencia de 2) */
+#define ASYNCIO_MERGE_MAX		(256 * 1024)	/* Maior leitura/escrita resultante da juncao */
+
+/*------------------------------------------------------------------------
+Funcao:	Espera o fim de todas as requisicoes pendentes. Nao faz nada se for
+		chamada pela propria thread de E/S.
+------------------------------------------------------------------------*/
+void drainAsync(void);
+
+/*------------------------------------------------------------------------
+Funcao:	Espera o fim das requisicoes pendentes sobre o handle "handle". Nao
+		faz nada se for chamada pela propria thread de E/S.
+------------------------------------------------------------------------*/
+void drainAsyncHandle(int handle);
+
+/*------------------------------------------------------------------------
+Funcao:	Espera as requisicoes pendentes e termina a thread de E/S
+------------------------------------------------------------------------*/
+void closeAsync(void);
+
+#endif
@@ -5,27 +5,34 @@
 #define	BITMAP_INODE	0
 #define	BITMAP_DADOS	1
 
+/* Bitmaps de uma partio, mantidos em memria de openBitmap2 at closeBitmap2 */
+typedef struct bitmap2 BITMAP2;
+
+struct disk_image;
+
 
 /*------------------------------------------------------------------------
 Funo:	Abre os bitmaps de uma partio
-Entra:	Nmero do setor onde se encontra o superbloco
-Retorna: ==0, se sucesso
-		 !=0, se erro
+Entra:	disk -> imagem de disco da partio (NULL: t2fs_disk.dat)
+		Nmero do setor onde se encontra o superbloco
+Retorna: os bitmaps da partio, se sucesso
+		 NULL, se erro
 ------------------------------------------------------------------------*/
-int openBitmap2(int superbloco_sector);
+BITMAP2* openBitmap2(struct disk_image* disk, int superbloco_sector);
 
 /*------------------------------------------------------------------------
 Funo:	Fecha os bitmaps de uma partio.
 		Garante que as informaes que esto em cache sero atualizadas no disco
-Entra:	-
+Entra:	bitmaps -> retornados por openBitmap2 (NULL: nada a fazer)
 Retorna: ==0, se sucesso
 		 !=0, se erro
 ------------------------------------------------------------------------*/
-int closeBitmap2(void);
+int closeBitmap2(BITMAP2* bitmaps);
 
 /*------------------------------------------------------------------------
 	Recupera o bit indicado do bitmap solicitado
 Entra:
+	bitmaps -> retornados por openBitmap2
 	handle -> bitmap
 		==0 -> i-node
 		!=0 -> blocos de dados
@@ -34,11 +41,12 @@ Retorna:
 	Sucesso: valor do bit: ZERO ou UM (0 ou 1)
 	Erro: nmero negativo
 ------------------------------------------------------------------------*/
-int	getBitmap2(int handle, int bitNumber);
+int	getBitmap2(BITMAP2* bitmaps, int handle, int bitNumber);
 
 /*------------------------------------------------------------------------
 	Seta o bit indicado do bitmap solicitado
 Entra:
+	bitmaps -> retornados por openBitmap2
 	handle -> bitmap
 		==0 -> i-node
 		!=0 -> blocos de dados
@@ -50,21 +58,78 @@ Retorna
 	Sucesso: ZERO (0)
 	Erro: nmero negativo
 ------------------------------------------------------------------------*/
-int	setBitmap2(int handle, int bitNumber, int bitValue);
+int	setBitmap2(BITMAP2* bitmaps, int handle, int bitNumber, int bitValue);
 
 /*------------------------------------------------------------------------
 	Procura no bitmap solicitado pelo valor indicado
 Entra:
+	bitmaps -> retornados por openBitmap2
+	handle -> bitmap
+		==0 -> i-node
+		!=0 -> blocos de dados
+	bitValue -> valor procurado
+Retorna
+	Sucesso: ndice associado ao bit (ZERO ou positivo; o bit 0  vlido)
+	No achou: -1
+	Erro: outro nmero negativo
+------------------------------------------------------------------------*/
+int	searchBitmap2(BITMAP2* bitmaps, int handle, int bitValue);
+
+/*------------------------------------------------------------------------
+	Procura o primeiro bit livre (ZERO) do bitmap solicitado e o seta
+Entra:
+	bitmaps -> retornados por openBitmap2
+	handle -> bitmap
+		==0 -> i-node
+		!=0 -> blocos de dados
+	maxBits -> apenas bits com ndice menor que maxBits (<= 0: todos)
+Retorna
+	Sucesso: ndice do bit alocado
+	No achou ou erro: nmero negativo
+------------------------------------------------------------------------*/
+int	allocBitmap2(BITMAP2* bitmaps, int handle, int maxBits);
+
+/*------------------------------------------------------------------------
+	Reserva (seta) uma sequncia de at "count" bits livres contguos
+Entra:
+	bitmaps -> retornados por openBitmap2
+	handle -> bitmap
+		==0 -> i-node
+		!=0 -> blocos de dados
+	goal -> ndice preferido para o incio da sequncia (< 0: nenhum)
+	count -> quantidade de bits desejada
+	maxBits -> apenas bits com ndice menor que maxBits (<= 0: todos)
+	allocated -> recebe a quantidade de bits reservados (1 a count)
+Retorna
+	Sucesso: ndice do primeiro bit da sequncia
+	No achou ou erro: nmero negativo
+------------------------------------------------------------------------*/
+int	allocExtentBitmap2(BITMAP2* bitmaps, int handle, int goal, int count, int maxBits, int* allocated);
+
+/*------------------------------------------------------------------------
+	Conta os bits com o valor indicado no bitmap solicitado. A contagem do
+	bitmap inteiro  mantida a cada bit alterado; s os bits a partir de
+	maxBits so percorridos
+Entra:
+	bitmaps -> retornados por openBitmap2
 	handle -> bitmap
 		==0 -> i-node
 		!=0 -> blocos de dados
 	bitValue -> valor procurado
+	maxBits -> apenas bits com ndice menor que maxBits (<= 0: todos)
 Retorna
-	Sucesso
-		Achou o bit: ndice associado ao bit (nmero positivo)
-		No achou: ZERO
+	Sucesso: quantidade de bits com o valor
 	Erro: nmero negativo
 ------------------------------------------------------------------------*/
-int	searchBitmap2(int handle, int bitValue);
+int	countBitmap2(BITMAP2* bitmaps, int handle, int bitValue, int maxBits);
+
+/*------------------------------------------------------------------------
+Funo:	Grava no disco os setores dos bitmaps alterados por setBitmap2
+		e allocBitmap2, mantendo os bitmaps abertos
+Entra:	bitmaps -> retornados por openBitmap2
+Retorna: ==0, se sucesso
+		 !=0, se erro
+------------------------------------------------------------------------*/
+int flushBitmap2(BITMAP2* bitmaps);
 
 #endif
@@ -0,0 +1,100 @@
+/*************************************************************************
+
+	Cache de blocos (write-back) entre o T2FS e o subsistema de E/S (apidisk)
+
+	Cada particao montada tem a sua cache (openBlockCache), passada como
+	primeiro parametro das demais funcoes. Os blocos da particao sao mantidos
+	em memoria em uma tabela hash, com substituicao LRU. Escritas apenas marcam o bloco como sujo; ele eh
+	gravado no disco quando for substituido ou em flushBlockCache().
+
+	Os blocos sao identificados pelo indice dentro da particao (o mesmo usado
+	nos ponteiros do inode).
+
+	As funcoes podem ser chamadas por varias threads ao mesmo tempo (um mutex
+	interno protege cada cache).
+
+*************************************************************************/
+
+#ifndef __BLOCKCACHE__
+#define __BLOCKCACHE__
+
+#define BLOCKCACHE_DEFAULT_SIZE	64	/* Numero de blocos da cache, se nao informado */
+
+struct blockcache;
+struct disk_image;
+
+struct blockcache_stats {
+	unsigned long long hits;		/* Acessos atendidos pela cache */
+	unsigned long long misses;		/* Acessos a blocos que nao estavam na cache */
+	unsigned long long writebacks;	/* Blocos sujos gravados no disco */
+	unsigned long long evictions;	/* Blocos substituidos por falta de espaco */
+	unsigned long long prefetched;	/* Blocos lidos antecipadamente (prefetchBlockCache) */
+	unsigned long long prefetchHits;	/* Blocos antecipados acessados depois */
+	unsigned long long prefetchUnused;	/* Blocos antecipados substituidos sem uso */
+};
+
+/*------------------------------------------------------------------------
+Funcao:	Cria uma cache para uma particao
+Entra:	disk -> imagem de disco da particao (NULL: t2fs_disk.dat)
+		firstSector -> primeiro setor da particao
+		sectorsPerBlock -> numero de setores por bloco
+		capacity -> numero de blocos mantidos em memoria (<= 0: padrao)
+Retorna: a cache, se sucesso
+		 NULL, se erro na alocacao de memoria
+------------------------------------------------------------------------*/
+struct blockcache* openBlockCache(struct disk_image* disk, unsigned int firstSector, int sectorsPerBlock, int capacity);
+
+/*------------------------------------------------------------------------
+Funcao:	Grava os blocos sujos e libera a cache (NULL: nada a fazer)
+Retorna: ==0, se sucesso
+		 !=0, se erro na gravacao de algum bloco
+------------------------------------------------------------------------*/
+int closeBlockCache(struct blockcache* cache);
+
+/*------------------------------------------------------------------------
+Funcao:	Copia "size" bytes do bloco "block", a partir de "offset", para "buffer"
+Retorna: ==0, se sucesso
+		 !=0, se erro (cache fechada, faixa invalida ou erro de leitura)
+------------------------------------------------------------------------*/
+int readBlockCache(struct blockcache* cache, unsigned int block, unsigned int offset, unsigned int size, unsigned char* buffer);
+
+/*------------------------------------------------------------------------
+Funcao:	Copia "size" bytes de "buffer" para o bloco "block", a partir de "offset".
+		Se o bloco nao esta na cache e a escrita eh parcial, ele eh lido antes.
+Retorna: ==0, se sucesso
+		 !=0, se erro
+------------------------------------------------------------------------*/
+int writeBlockCache(struct blockcache* cache, unsigned int block, unsigned int offset, unsigned int size, unsigned char* buffer);
+
+/*------------------------------------------------------------------------
+Funcao:	Carrega na cache os blocos "block" ate "block + count - 1" (leitura
+		antecipada). Os que ja estao na cache sao mantidos; os ausentes sao
+		lidos com um unico lote de requisicoes (read_sectors_batch_ex), uma por
+		sequencia de blocos consecutivos. No maximo metade da cache eh usada.
+Retorna: >=0, numero de blocos lidos do disco
+		 <0, se erro (cache fechada ou erro de leitura)
+------------------------------------------------------------------------*/
+int prefetchBlockCache(struct blockcache* cache, unsigned int block, int count);
+
+/*------------------------------------------------------------------------
+Funcao:	Como prefetchBlockCache, para os "count" blocos (nao necessariamente
+		consecutivos) do vetor "blocks", lidos tambem em um unico lote
+Retorna: >=0, numero de blocos lidos do disco
+		 <0, se erro (cache fechada ou erro de leitura)
+------------------------------------------------------------------------*/
+int prefetchBlockList(struct blockcache* cache, const unsigned int* blocks, int count);
+
+/*------------------------------------------------------------------------
+Funcao:	Grava no disco todos os blocos sujos (que permanecem na cache).
+		Blocos consecutivos sao gravados com uma unica requisicao.
+Retorna: ==0, se sucesso
+		 !=0, se erro na gravacao de algum bloco
+------------------------------------------------------------------------*/
+int flushBlockCache(struct blockcache* cache);
+
+/*------------------------------------------------------------------------
+Funcao:	Copia os contadores da cache para "stats"
+------------------------------------------------------------------------*/
+void blockCacheStats(struct blockcache* cache, struct blockcache_stats* stats);
+
+#endif
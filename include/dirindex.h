@@ -0,0 +1,78 @@
+/*************************************************************************
+
+	Indice em memoria das entradas do diretorio raiz do T2FS
+
+	Tabela hash do nome do arquivo para a entrada de diretorio (copia do
+	registro e indice da entrada no diretorio). Eh construida pelo T2FS na
+	primeira busca apos o mount e mantida atualizada a cada entrada incluida
+	ou removida, de modo que a busca por nome nao le o disco.
+
+	Cada particao montada tem o seu indice (struct dirindex), passado como
+	primeiro parametro das funcoes. Um indice zerado esta fechado.
+
+*************************************************************************/
+
+#ifndef __DIRINDEX__
+#define __DIRINDEX__
+
+#include "t2fs.h"
+
+#define DIRINDEX_DEFAULT_SIZE	64	/* Numero inicial de entradas, se nao informado */
+
+struct dirindex {
+	struct dirindex_entry* entries;
+	int* buckets;
+	int capacity;		/* Entradas alocadas (igual ao numero de buckets) */
+	int used;			/* Entradas ja usadas alguma vez */
+	int freeList;		/* Primeira entrada livre (-1: nenhuma) */
+};
+
+/*------------------------------------------------------------------------
+Funcao:	Cria um indice vazio (liberando o anterior, se houver)
+Entra:	expected -> numero esperado de entradas (<= 0: padrao).
+		O indice cresce automaticamente.
+Retorna: ==0, se sucesso
+		 !=0, se erro na alocacao de memoria
+------------------------------------------------------------------------*/
+int openDirIndex(struct dirindex* index, int expected);
+
+/*------------------------------------------------------------------------
+Funcao:	Libera o indice. Ate o proximo openDirIndex, isDirIndexOpen retorna 0
+------------------------------------------------------------------------*/
+void closeDirIndex(struct dirindex* index);
+
+/*------------------------------------------------------------------------
+Funcao:	Informa se o indice esta aberto (construido)
+------------------------------------------------------------------------*/
+int isDirIndexOpen(struct dirindex* index);
+
+/*------------------------------------------------------------------------
+Funcao:	Inclui (ou atualiza) o registro "record", que esta na entrada
+		"dirEntry" do diretorio
+Retorna: ==0, se sucesso
+		 !=0, se erro (indice fechado ou erro na alocacao de memoria)
+------------------------------------------------------------------------*/
+int insertDirIndex(struct dirindex* index, struct t2fs_record* record, int dirEntry);
+
+/*------------------------------------------------------------------------
+Funcao:	Procura o arquivo "name", copiando o registro para "record"
+Retorna: >=0, indice da entrada no diretorio
+		 <0, se nao encontrado ou indice fechado
+------------------------------------------------------------------------*/
+int findDirIndex(struct dirindex* index, char* name, struct t2fs_record* record);
+
+/*------------------------------------------------------------------------
+Funcao:	Hash FNV-1a do nome, usado pelo indice, pelo diretorio com hash
+		extensivel do T2FS (gravado no disco: nao pode mudar) e pela
+		escolha da particao dos objetos em shardstore
+------------------------------------------------------------------------*/
+unsigned int hashDirName(char* name);
+
+/*------------------------------------------------------------------------
+Funcao:	Remove o arquivo "name" do indice
+Retorna: ==0, se sucesso
+		 !=0, se nao encontrado ou indice fechado
+------------------------------------------------------------------------*/
+int removeDirIndex(struct dirindex* index, char* name);
+
+#endif
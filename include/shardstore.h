@@ -0,0 +1,129 @@
+/*************************************************************************
+
+	Armazenamento de objetos distribuido em varias particoes do T2FS
+	(openstore2, closestore2, putobj2, getobj2 e delobj2)
+
+	Cada particao do conjunto (shard) eh montada com mount_ex e tem os seus
+	proprios diretorio, bitmaps, cache e locks. Com openstore_ex cada shard
+	fica em um arquivo de disco proprio (mountimage_ex), com o seu proprio
+	descritor: a capacidade e a vazao crescem com o numero de imagens. O objeto eh colocado na
+	particao escolhida pelo hash do nome; um objeto dividido (striping) eh
+	gravado em pedacos de "stripeBytes" bytes distribuidos em rodizio entre
+	as particoes, como em RAID-0.
+
+	Cada particao tem uma thread de E/S: as operacoes sobre particoes
+	diferentes, de um mesmo objeto dividido ou de threads chamadoras
+	diferentes, executam em paralelo. As operacoes sobre uma particao sao
+	executadas em ordem de chegada.
+
+	Formato em disco, na particao "home" (hash do nome) e nas seguintes:
+		nome      objeto inteiro (nao dividido), na particao home
+		nome.s    descritor do objeto dividido (struct storeheader), na home
+		nome.K    pedaco K do objeto dividido, na particao (home + K) % N
+
+	O conjunto deve ser aberto sempre com as mesmas particoes (ou imagens),
+	na mesma ordem, para que os objetos sejam encontrados. Operacoes concorrentes
+	sobre o mesmo objeto nao sao serializadas.
+
+*************************************************************************/
+
+#ifndef __SHARDSTORE__
+#define __SHARDSTORE__
+
+#include "t2fs.h"
+
+#define STORE_MAX_SHARDS		8			/* Particoes por conjunto (no maximo 8 particoes ou imagens montadas) */
+#define STORE_MAX_NAME			46			/* Tamanho maximo do nome: cabem o sufixo e o '\0' */
+#define STORE_STRIPE_DEFAULT	4096		/* Bytes por pedaco, se nao informado */
+
+/** Opcoes do conjunto, usadas por openstore2 e openstore_ex (campos com valor zero assumem o padrao) */
+typedef struct {
+	int     stripeBytes;                /* Bytes por pedaco dos objetos divididos (multiplo do bloco) */
+	int     cacheBlocks;                /* Blocos de cache de cada particao (ver MOUNTOPT2)    */
+} STOREOPT2;
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Monta as particoes indicadas em "partitions" como um conjunto de
+		armazenamento e cria uma thread de E/S para cada uma. As particoes
+		devem estar formatadas e nao podem estar montadas.
+
+Entra:	partitions -> numeros das particoes do conjunto
+		count -> quantidade de particoes (1 a STORE_MAX_SHARDS)
+		options -> opcoes do conjunto (NULL: valores padrao)
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Se ja houver um conjunto aberto, sera retornado -20.
+		Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int openstore2(int* partitions, int count, STOREOPT2* options);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Como openstore2, mas cada shard eh a particao "partition" de um
+		arquivo de disco diferente, montada com mountimage_ex. As imagens
+		devem estar formatadas (formatimage_ex).
+
+Entra:	images -> nomes dos arquivos de disco do conjunto
+		partition -> particao usada em cada imagem
+		count -> quantidade de imagens (1 a STORE_MAX_SHARDS)
+		options -> opcoes do conjunto (NULL: valores padrao)
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Se ja houver um conjunto aberto, sera retornado -20; se uma imagem
+		nao puder ser aberta, -2.
+		Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int openstore_ex(char** images, int partition, int count, STOREOPT2* options);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Termina as threads de E/S e desmonta as particoes do conjunto
+		(fechando as imagens abertas por openstore_ex).
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Em caso de erro, sera retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int closestore2(void);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Grava o objeto "name" com os "size" bytes de "buffer", substituindo
+		o anterior de mesmo nome, se houver. Com "striped" diferente de zero,
+		o objeto eh dividido entre as particoes e os pedacos sao gravados em
+		paralelo.
+
+Entra:	name -> nome do objeto: letras, digitos, '-' e '_' (ate STORE_MAX_NAME)
+		buffer -> conteudo do objeto
+		size -> numero de bytes do objeto
+		striped -> !=0: divide o objeto entre as particoes
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int putobj2(char* name, char* buffer, int size, int striped);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le ate "size" bytes do inicio do objeto "name" para "buffer". Os
+		pedacos de um objeto dividido sao lidos em paralelo.
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna o numero de
+		bytes lidos (menor que "size" se o objeto for menor).
+		Se o objeto nao existir, sera retornado -10; se o objeto dividido
+		estiver incompleto, -21.
+		Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int getobj2(char* name, char* buffer, int size);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Apaga o objeto "name" (e todos os seus pedacos, se for dividido)
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Se o objeto nao existir, sera retornado -10.
+		Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int delobj2(char* name);
+
+#endif
@@ -17,6 +17,12 @@ Retornos:
 		-14: HANDLE invalido
 		-15: Particao ou diretorio nao montado
 		-16: Linkname ja existe
+		-17: Erro na alocacao de memoria
+		-18: Limite de requisicoes assincronas excedido (ou erro ao criar a thread de E/S)
+		-19: Requisicao assincrona invalida
+		-20: Particao ja montada
+		-21: Objeto dividido (striping) incompleto ou invalido
+		-22: Limite de imagens de disco montadas excedido
 */
 
 #ifndef __LIBT2FS___
@@ -31,6 +37,7 @@ Retornos:
 #include <stdarg.h>
 
 typedef int FILE2;
+typedef int MOUNT2;
 
 typedef unsigned char BYTE;
 typedef unsigned short int WORD;
@@ -48,6 +55,35 @@ typedef struct {
 
 #pragma pack(pop)
 
+/** Buffer de uma lista de buffers, usada por readv2 e writev2 */
+typedef struct {
+	char*   buffer;                     /* Area de memoria do buffer                           */
+	int     size;                       /* Numero de bytes do buffer                           */
+} IOVEC2;
+
+/** Opcoes de montagem, usadas por mount2 (campos com valor zero assumem o padrao) */
+typedef struct {
+	int     cacheBlocks;                /* Numero de blocos mantidos na cache de blocos        */
+	int     readAheadMax;               /* Maximo de blocos lidos antecipadamente (<0: nenhum) */
+	int     threadSafe;                 /* !=0: funcoes do T2FS podem ser chamadas por varias threads */
+	int     delayAllocMax;              /* Maximo de blocos de um arquivo gravados em memoria antes da alocacao (<0: aloca na escrita) */
+} MOUNTOPT2;
+
+/** Contadores de desempenho da particao montada, lidos com stats2 */
+typedef struct {
+	unsigned long long cacheHits;       /* Acessos a blocos atendidos pela cache               */
+	unsigned long long cacheMisses;     /* Acessos a blocos que nao estavam na cache           */
+	unsigned long long cacheWritebacks; /* Blocos modificados gravados no disco                */
+	unsigned long long cacheEvictions;  /* Blocos retirados da cache por falta de espaco       */
+	unsigned long long inodeHits;       /* Leituras de inode atendidas pela tabela em memoria  */
+	unsigned long long inodeMisses;     /* Inodes carregados da area de inodes                 */
+	unsigned long long blockMapHits;    /* Blocos de arquivo achados no mapa do handle         */
+	unsigned long long blockMapMisses;  /* Blocos de indirecao lidos para o mapa do handle     */
+	unsigned long long readAheadBlocks; /* Blocos lidos antecipadamente (read-ahead)           */
+	unsigned long long readAheadHits;   /* Blocos antecipados que foram acessados depois       */
+	unsigned long long readAheadMisses; /* Blocos antecipados descartados sem serem acessados  */
+} STATS2;
+
 
 /*-----------------------------------------------------------------------------
 Funcao: Usada para identificar os desenvolvedores do T2FS.
@@ -78,6 +114,39 @@ Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
 int format2(int partition, int sectors_per_block);
 
 
+/** Opcoes de format2_ex */
+#define FORMAT2_HASHDIR	0x01	/* Diretorio raiz com hash extensivel no disco (versao 0x7E33) */
+
+/*-----------------------------------------------------------------------------
+Funcao:	Formata uma particao do disco virtual, com opcoes.
+		format2(partition, sectors_per_block) equivale a format2_ex(partition, sectors_per_block, 0).
+
+Entra:	partition -> numero da particao a ser formatada
+		sectors_per_block -> numero de setores que formam um bloco
+		flags -> combinacao das opcoes FORMAT2_xxx
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Em caso de erro, sera retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int format2_ex(int partition, int sectors_per_block, int flags);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Formata a particao "partition" do arquivo de disco "image" (no lugar
+		do disco padrao), como format2_ex.
+
+Entra:	image -> nome do arquivo de disco
+		partition -> numero da particao a ser formatada
+		sectors_per_block -> numero de setores que formam um bloco
+		flags -> combinacao das opcoes FORMAT2_xxx
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Se a imagem nao puder ser aberta, sera retornado -2.
+		Em caso de erro, sera retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int formatimage_ex(char* image, int partition, int sectors_per_block, int flags);
+
+
 /*-----------------------------------------------------------------------------
 Funcao:	Monta a particao indicada por "partition" no diretorio raiz
 
@@ -89,6 +158,74 @@ Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
 int mount(int partition);
 
 
+/*-----------------------------------------------------------------------------
+Funcao:	Monta a particao indicada por "partition" no diretorio raiz, com opcoes.
+		mount(partition) equivale a mount2(partition, NULL).
+		A particao passa a ser usada pelas funcoes sem identificador de
+		montagem (create2, open2, ...); a particao montada antes por
+		mount/mount2, se for outra, eh desmontada.
+
+		Com options->threadSafe, as funcoes do T2FS podem ser chamadas por
+		varias threads ao mesmo tempo: handles diferentes sao lidos em
+		paralelo (lock compartilhado por inode), escritas em um arquivo sao
+		exclusivas e as alteracoes no diretorio sao serializadas. mount2,
+		umount, format2_ex e sync2 esperam as demais funcoes da mesma
+		particao terminarem; particoes diferentes nao compartilham locks.
+		Um mesmo handle usado por varias threads eh atendido uma chamada por vez.
+
+		Alocacao adiada: os blocos escritos alem do fim dos blocos ja
+		alocados do arquivo ficam em memoria e so sao alocados (contiguos,
+		no tamanho final) no close2, sync2, umount ou quando passam de
+		options->delayAllocMax blocos (padrao: metade da cache de blocos).
+		Os blocos livres sao reservados no write2, que continua retornando
+		erro quando falta espaco.
+
+Entra:	partition -> numero da particao a ser montada
+		options -> opcoes de montagem (NULL: valores padrao)
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Em caso de erro, sera retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int mount2(int partition, MOUNTOPT2* options);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Monta a particao indicada por "partition" sem desmontar as demais.
+		Cada particao montada tem seus proprios diretorio, bitmaps, cache de
+		blocos, tabela de inodes e locks, e pode ser usada por threads
+		diferentes ao mesmo tempo. Os handles abertos guardam a sua
+		montagem: read2, write2 e close2 nao recebem o identificador.
+
+Entra:	partition -> numero da particao a ser montada
+		options -> opcoes de montagem, como em mount2 (NULL: valores padrao)
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna o identificador
+		da montagem (numero nao negativo), usado nas funcoes _ex.
+		Se a particao ja estiver montada, sera retornado -20.
+		Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+MOUNT2 mount_ex(int partition, MOUNTOPT2* options);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Monta a particao "partition" do arquivo de disco "image", como
+		mount_ex. Cada imagem montada tem o seu proprio descritor (e anel do
+		io_uring, se usado): montagens de imagens diferentes escalam em
+		capacidade e vazao. A imagem eh fechada em umount_ex.
+
+Entra:	image -> nome do arquivo de disco
+		partition -> numero da particao a ser montada
+		options -> opcoes de montagem, como em mount2 (NULL: valores padrao)
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna o identificador
+		da montagem (8 ou maior), usado nas funcoes _ex.
+		Se a imagem nao puder ser aberta, sera retornado -2; se ja houver
+		8 imagens montadas, -22.
+		Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+MOUNT2 mountimage_ex(char* image, int partition, MOUNTOPT2* options);
+
+
 /*-----------------------------------------------------------------------------
 Funcao:	Desmonta a particao atualmente montada, liberando o ponto de montagem.
 
@@ -100,6 +237,42 @@ Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
 int umount(void);
 
 
+/*-----------------------------------------------------------------------------
+Funcao:	Desmonta a particao identificada por "mount" (retornado por mount_ex
+		ou mountimage_ex), fechando apenas os handles dessa particao e, se
+		for de outra imagem, o arquivo de disco.
+
+Entra:	mount -> identificador da montagem
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Em caso de erro, sera retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int umount_ex(MOUNT2 mount);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Grava no disco todos os dados modificados da particao montada
+		que ainda estao em memoria (cache de blocos).
+
+Entra:	-
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Em caso de erro, sera retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int sync2(void);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le os contadores de desempenho da particao montada.
+
+Entra:	stats -> estrutura onde a funcao coloca os contadores
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
+		Em caso de erro, sera retornado um valor diferente de zero.
+-----------------------------------------------------------------------------*/
+int stats2(STATS2* stats);
+
+
 /*-----------------------------------------------------------------------------
 Funcao: Criar um novo arquivo.
 	O nome desse novo arquivo eh aquele informado pelo parametro "filename".
@@ -151,7 +324,9 @@ Funcao:	Fecha o arquivo identificado pelo parametro "handle".
 Entra:	handle -> identificador do arquivo a ser fechado
 
 Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
-	Em caso de erro, sera retornado um valor diferente de zero.
+	Em caso de erro, sera retornado um valor diferente de zero (inclusive
+	se os dados ainda em memoria nao puderem ser gravados: ver alocacao
+	adiada em mount2).
 -----------------------------------------------------------------------------*/
 int close2(FILE2 handle);
 
@@ -187,6 +362,145 @@ Saida:	Se a operacao foi realizada com sucesso, a funcao retorna o numero de byt
 int write2(FILE2 handle, char* buffer, int size);
 
 
+/*-----------------------------------------------------------------------------
+Funcao:	Realiza a leitura de "size" bytes do arquivo identificado por "handle",
+	a partir do byte "offset", sem usar nem alterar o contador de posicao.
+	No modo thread-safe, varias leituras posicionais no mesmo handle sao
+	feitas em paralelo (o handle eh preso apenas para ser validado).
+
+Entra:	handle -> identificador do arquivo a ser lido
+	buffer -> buffer onde colocar os bytes lidos do arquivo
+	size -> numero de bytes a serem lidos
+	offset -> posicao, em bytes desde o inicio do arquivo, do primeiro byte lido
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna o numero de bytes lidos
+	(menor que "size" se o fim do arquivo for atingido; zero se "offset" estiver no fim ou depois dele).
+	Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int pread2(FILE2 handle, char* buffer, int size, DWORD offset);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Realiza a escrita de "size" bytes no arquivo identificado por "handle",
+	a partir do byte "offset", sem usar nem alterar o contador de posicao.
+	Se "offset" estiver depois do fim do arquivo, o intervalo entre o fim e
+	"offset" eh preenchido com zeros. Escritas no mesmo arquivo (por
+	qualquer handle) sao feitas uma de cada vez.
+
+Entra:	handle -> identificador do arquivo a ser escrito
+	buffer -> buffer de onde pegar os bytes a serem escritos no arquivo
+	size -> numero de bytes a serem escritos
+	offset -> posicao, em bytes desde o inicio do arquivo, do primeiro byte escrito
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna o numero de bytes efetivamente escritos.
+	Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int pwrite2(FILE2 handle, char* buffer, int size, DWORD offset);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Realiza a leitura de bytes do arquivo identificado por "handle" para
+	varios buffers (scatter): os bytes a partir do contador de posicao
+	preenchem, em ordem, os "count" buffers de "iov". O mapa de blocos, o
+	superbloco e o inode sao consultados uma unica vez para todos os buffers.
+	Apos a leitura, o contador de posicao eh ajustado como em read2.
+
+Entra:	handle -> identificador do arquivo a ser lido
+	iov -> lista de buffers (endereco e tamanho de cada um)
+	count -> numero de buffers em "iov"
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna o numero total de bytes lidos.
+	Se o valor retornado for menor do que a soma dos tamanhos, entao o contador de posicao atingiu o final do arquivo.
+	Em caso de erro, sera retornado um valor negativo (-1 se a lista de buffers for invalida).
+-----------------------------------------------------------------------------*/
+int readv2(FILE2 handle, IOVEC2* iov, int count);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Realiza a escrita do conteudo de varios buffers (gather) no arquivo
+	identificado por "handle": os "count" buffers de "iov" sao gravados, em
+	ordem, a partir do contador de posicao, como uma unica escrita (um bloco
+	compartilhado por buffers vizinhos eh lido e gravado uma so vez).
+	Apos a escrita, o contador de posicao eh ajustado como em write2.
+
+Entra:	handle -> identificador do arquivo a ser escrito
+	iov -> lista de buffers (endereco e tamanho de cada um)
+	count -> numero de buffers em "iov"
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna o numero total de bytes escritos.
+	Em caso de erro, sera retornado um valor negativo (-1 se a lista de buffers for invalida).
+-----------------------------------------------------------------------------*/
+int writev2(FILE2 handle, IOVEC2* iov, int count);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Inicia a leitura de "size" bytes do arquivo "handle" para "buffer" e
+	retorna sem esperar por ela. A leitura eh feita por uma thread de E/S,
+	na ordem de submissao, e ajusta o contador de posicao como read2.
+	"buffer" nao deve ser usado ate a requisicao terminar (poll2/wait2).
+
+	Enquanto houver requisicoes pendentes, as demais funcoes do T2FS (exceto
+	read2_async, write2_async, poll2 e wait2) esperam que elas terminem. Na
+	montagem thread-safe, as funcoes sobre um handle (read2, write2, close2,
+	...) esperam apenas pelas requisicoes do mesmo handle.
+
+Entra:	handle, buffer, size -> como em read2
+
+Saida:	Identificador (positivo) da requisicao, usado em poll2 e wait2.
+	Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int read2_async(FILE2 handle, char* buffer, int size);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Inicia a escrita de "size" bytes de "buffer" no arquivo "handle", como
+	read2_async. Escritas consecutivas no mesmo handle podem ser juntadas em
+	uma unica escrita (handles diferentes nao sao juntados); o resultado de
+	cada requisicao eh o mesmo que ela teria em write2, inclusive com o
+	disco cheio.
+
+Saida:	Identificador (positivo) da requisicao, usado em poll2 e wait2.
+	Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int write2_async(FILE2 handle, char* buffer, int size);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Informa se a requisicao assincrona "request" terminou, sem esperar
+
+Saida:	1, se terminou (o resultado eh obtido com wait2); 0, se ainda nao.
+	Em caso de erro (requisicao invalida), sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int poll2(int request);
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Espera o fim da requisicao assincrona "request" e a libera. Depois
+	disso o identificador deixa de ser valido.
+
+Saida:	O resultado da operacao, como em read2/write2 (bytes lidos ou
+	escritos, ou um valor negativo em caso de erro).
+	Se a requisicao for invalida, sera retornado -19.
+-----------------------------------------------------------------------------*/
+int wait2(int request);
+
+
+#define COPY2_CHUNK_BLOCKS	64	/* Blocos copiados por vez em copy2 */
+
+/*-----------------------------------------------------------------------------
+Funcao:	Copia o arquivo "src" para o arquivo "dst" dentro do T2FS.
+	Se "dst" ja existir, seu conteudo sera substituido.
+	A copia eh feita em trechos de varios blocos inteiros.
+
+Entra:	src -> nome do arquivo de origem
+	dst -> nome do arquivo de destino
+
+Saida:	Se a operacao foi realizada com sucesso, a funcao retorna o numero de bytes copiados.
+	Em caso de erro (inclusive se "src" e "dst" forem o mesmo arquivo), sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int copy2(char* src, char* dst);
+
+
 /*-----------------------------------------------------------------------------
 Funcao:	Abre o diretorio raiz da particao ativa.
 		Se a operacao foi realizada com sucesso,
@@ -217,6 +531,21 @@ Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
 int readdir2(DIRENT2* dentry);
 
 
+/*-----------------------------------------------------------------------------
+Funcao:	Le varias entradas do diretorio aberto em uma unica chamada.
+		Continua a partir da entrada seguinte a ultima lida (por readdir2 ou
+		readdirv2). Cada bloco do diretorio e cada setor de inodes sao lidos
+		uma unica vez por chamada.
+
+Entra:	out -> vetor onde a funcao coloca as entradas lidas
+		max -> numero de posicoes de "out"
+
+Saida:	Numero de entradas colocadas em "out" (0: nao ha mais entradas).
+		Em caso de erro, sera retornado um valor negativo.
+-----------------------------------------------------------------------------*/
+int readdirv2(DIRENT2* out, int max);
+
+
 /*-----------------------------------------------------------------------------
 Funcao:	Fecha o diretorio identificado pelo parametro "handle".
 
@@ -252,6 +581,32 @@ Saida:	Se a operacao foi realizada com sucesso, a funcao retorna "0" (zero).
 int hln2(char* linkname, char* filename);
 
 
+/*-----------------------------------------------------------------------------
+Funcao:	Variantes das funcoes acima para a particao identificada por "mount"
+		(retornado por mount_ex ou, para a particao de mount/mount2, o
+		numero dela). Cada uma equivale a funcao de mesmo nome sem o sufixo,
+		executada nessa particao; os handles retornados sao usados
+		normalmente em read2, write2 e close2.
+
+Entra:	mount -> identificador da montagem
+		demais -> como na funcao sem o sufixo
+
+Saida:	As mesmas da funcao sem o sufixo.
+-----------------------------------------------------------------------------*/
+int sync2_ex(MOUNT2 mount);
+int stats2_ex(MOUNT2 mount, STATS2* stats);
+FILE2 create2_ex(MOUNT2 mount, char* filename);
+int delete2_ex(MOUNT2 mount, char* filename);
+FILE2 open2_ex(MOUNT2 mount, char* filename);
+int copy2_ex(MOUNT2 mount, char* src, char* dst);
+int opendir2_ex(MOUNT2 mount);
+int readdir2_ex(MOUNT2 mount, DIRENT2* dentry);
+int readdirv2_ex(MOUNT2 mount, DIRENT2* out, int max);
+int closedir2_ex(MOUNT2 mount);
+int sln2_ex(MOUNT2 mount, char* linkname, char* filename);
+int hln2_ex(MOUNT2 mount, char* linkname, char* filename);
+
+
 
 
 #endif
@@ -0,0 +1,967 @@
+/*************************************************************************
+
+	Implementacao do subsistema de E/S no disco usado pelo T2FS (apidisk.h)
+
+	Backends disponiveis:
+		"stdio"	-> comportamento original: fopen/fseek/fclose a cada setor
+		"pread"	-> descritor aberto uma unica vez, E/S posicionada (pread/pwrite)
+		"mmap"	-> imagem inteira mapeada em memoria, setores copiados com memcpy
+		"uring"	-> io_uring (Linux): as faixas de um lote (read_sectors_batch,
+				   write_sectors_batch) sao submetidas juntas, com o arquivo e a
+				   area de register_disk_buffer registrados no kernel. Se o
+				   io_uring nao estiver disponivel, usa as funcoes do "pread".
+
+	O backend padrao eh definido em tempo de compilacao/ligacao por APIDISK_BACKEND
+	(ex.: make APIDISK_BACKEND=mmap) e pode ser trocado em execucao pela variavel
+	de ambiente T2FS_DISK_BACKEND ou pela funcao set_disk_backend().
+
+	Cada imagem de disco (struct disk_image) tem o seu proprio estado: backend,
+	descritor, mapeamento, area registrada e anel do io_uring. As funcoes sem
+	o sufixo _ex usam a imagem padrao t2fs_disk.dat, aberta na primeira
+	requisicao; as demais imagens sao abertas com open_disk, com o backend
+	selecionado naquele momento.
+
+	Toda requisicao (read_sector, read_sectors ou read_sectorsv, e as de escrita)
+	eh atendida pelo backend como uma unica transferencia contigua no disco.
+
+	As funcoes podem ser chamadas por varias threads (uma cache de blocos por
+	particao montada): o anel do io_uring de uma imagem eh usado por um lote
+	de cada vez.
+
+*************************************************************************/
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#include "../include/apidisk.h"
+
+#define DISK_NAME	"t2fs_disk.dat"
+
+/* Quantidade maxima de buffers enviados em uma unica chamada preadv/pwritev */
+#define IOV_BATCH	64
+
+#ifndef APIDISK_BACKEND
+#define APIDISK_BACKEND	"pread"
+#endif
+
+#ifdef HAVE_IO_URING
+/* Anel do io_uring de uma imagem (fd < 0: sem io_uring, usa pread/pwrite) */
+struct uringRing {
+	int fd;
+	int fixedFile;
+	int fixedBuffer;
+	void* sqRing;
+	void* cqRing;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	struct io_uring_sqe* sqes;
+	size_t sqesSize;
+	unsigned int* sqHead;
+	unsigned int* sqTail;
+	unsigned int* sqMask;
+	unsigned int* sqArray;
+	unsigned int sqEntries;
+	unsigned int* cqHead;
+	unsigned int* cqTail;
+	unsigned int* cqMask;
+	struct io_uring_cqe* cqes;
+};
+#endif
+
+struct disk_image {
+	const struct diskBackend* backend;	/* NULL: imagem padrao ainda nao aberta */
+	const char* path;
+	int fd;
+	unsigned char* map;
+	size_t mapSize;
+	unsigned long long sectors;
+
+	unsigned char* registeredBuffer;	/* Area informada em register_disk_buffer */
+	size_t registeredSize;
+	pthread_mutex_t ringLock;			/* Anel do io_uring e registeredBuffer */
+#ifdef HAVE_IO_URING
+	struct uringRing ring;
+#endif
+};
+
+struct diskBackend {
+	const char* name;
+	int (*attach)(struct disk_image* disk);
+	void (*detach)(struct disk_image* disk);
+	int (*read)(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt);
+	int (*write)(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt);
+	int (*flush)(struct disk_image* disk);
+	int (*readBatch)(struct disk_image* disk, const struct sector_run* runs, int nruns);		/* NULL: uma faixa por vez */
+	int (*writeBatch)(struct disk_image* disk, const struct sector_run* runs, int nruns);
+};
+
+static struct disk_image defaultDisk = { NULL, DISK_NAME, -1, NULL, 0, 0, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+static const struct diskBackend* selected = NULL;	/* Backend das proximas aberturas */
+static int exitRegistered = 0;
+static pthread_mutex_t attachLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*-----------------------------------------------------------------------------
+Backend "stdio": abre e fecha o arquivo de disco a cada requisicao
+-----------------------------------------------------------------------------*/
+static int stdioAttach(struct disk_image* disk) {
+	return 0;
+}
+
+static void stdioDetach(struct disk_image* disk) {
+}
+
+static int stdioRead(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	FILE* f = fopen(disk->path, "rb");
+	if (f == NULL)
+		return -1;
+	if (fseek(f, (long)sector * SECTOR_SIZE, SEEK_SET)) {
+		fclose(f);
+		return -2;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (fread(iov[i].buffer, SECTOR_SIZE, iov[i].count, f) != iov[i].count) {
+			fclose(f);
+			return -3;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static int stdioWrite(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	FILE* f = fopen(disk->path, "r+b");
+	if (f == NULL)
+		return -1;
+	if (fseek(f, (long)sector * SECTOR_SIZE, SEEK_SET)) {
+		fclose(f);
+		return -2;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (fwrite(iov[i].buffer, SECTOR_SIZE, iov[i].count, f) != iov[i].count) {
+			fclose(f);
+			return -4;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static int stdioFlush(struct disk_image* disk) {
+	return 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Backend "pread": descritor persistente e E/S posicionada (preadv/pwritev)
+-----------------------------------------------------------------------------*/
+static int preadAttach(struct disk_image* disk) {
+	disk->fd = open(disk->path, O_RDWR);
+	return disk->fd < 0 ? -1 : 0;
+}
+
+static void preadDetach(struct disk_image* disk) {
+	close(disk->fd);
+	disk->fd = -1;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Executa preadv/pwritev ate transferir todos os bytes do vetor,
+		tratando transferencias parciais e EINTR
+
+Retorno:
+		 0: Sucesso
+		-2: Erro na transferencia
+		-3 (leitura) / -4 (escrita): Transferencia incompleta (fim do arquivo)
+-----------------------------------------------------------------------------*/
+static int preadTransfer(struct disk_image* disk, int isWrite, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	struct iovec vec[IOV_BATCH];
+	off_t offset = (off_t)sector * SECTOR_SIZE;
+	int next = 0;
+	size_t skip = 0;
+
+	while (next < iovcnt) {
+		int n = 0;
+		for (int i = next; i < iovcnt && n < IOV_BATCH; i++, n++) {
+			size_t first = (i == next) ? skip : 0;
+			vec[n].iov_base = iov[i].buffer + first;
+			vec[n].iov_len = (size_t)iov[i].count * SECTOR_SIZE - first;
+		}
+
+		ssize_t done = isWrite ? pwritev(disk->fd, vec, n, offset) : preadv(disk->fd, vec, n, offset);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0)
+			return -2;
+		if (done == 0)
+			return isWrite ? -4 : -3;
+
+		offset += done;
+		while (done > 0) {
+			size_t left = (size_t)iov[next].count * SECTOR_SIZE - skip;
+			if ((size_t)done < left) {
+				skip += done;
+				break;
+			}
+			done -= left;
+			skip = 0;
+			next++;
+		}
+	}
+
+	return 0;
+}
+
+static int preadRead(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	return preadTransfer(disk, 0, sector, iov, iovcnt);
+}
+
+static int preadWrite(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	return preadTransfer(disk, 1, sector, iov, iovcnt);
+}
+
+static int preadFlush(struct disk_image* disk) {
+	return fsync(disk->fd) ? -5 : 0;
+}
+
+
+/*-----------------------------------------------------------------------------
+Backend "uring": io_uring com o arquivo de disco registrado (IOSQE_FIXED_FILE)
+e a area de register_disk_buffer registrada (READ_FIXED/WRITE_FIXED). Sem
+io_uring (ring.fd < 0), as requisicoes sao atendidas como no backend "pread".
+-----------------------------------------------------------------------------*/
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES	128
+
+struct uringOp {
+	int isWrite;
+	off_t offset;
+	struct iovec* vec;		/* Trechos da operacao (1 se buffer fixo) */
+	int vecCount;
+	size_t length;
+	int fixed;
+};
+
+static void uringTeardown(struct uringRing* ring) {
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing && ring->cqRing != ring->sqRing)
+		munmap(ring->cqRing, ring->cqRingSize);
+	if (ring->sqRing)
+		munmap(ring->sqRing, ring->sqRingSize);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Registra (ou remove o registro de) registeredBuffer no anel da imagem
+		(o chamador prende ringLock)
+-----------------------------------------------------------------------------*/
+static void uringRegisterBuffer(struct disk_image* disk) {
+	struct uringRing* ring = &disk->ring;
+	if (ring->fd < 0)
+		return;
+
+	if (ring->fixedBuffer)
+		syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	ring->fixedBuffer = 0;
+
+	if (disk->registeredBuffer == NULL)
+		return;
+
+	struct iovec region = { disk->registeredBuffer, disk->registeredSize };
+	ring->fixedBuffer = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &region, 1) == 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Cria o anel da imagem e mapeia as filas de submissao e de conclusao
+
+Retorno:
+		 0: Sucesso
+		-1: io_uring indisponivel (o backend usa pread/pwrite)
+-----------------------------------------------------------------------------*/
+static int uringSetup(struct disk_image* disk) {
+	struct uringRing* ring = &disk->ring;
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqRingSize > ring->sqRingSize)
+			ring->sqRingSize = ring->cqRingSize;
+		ring->cqRingSize = ring->sqRingSize;
+	}
+
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED) {
+		ring->sqRing = NULL;
+		uringTeardown(ring);
+		return -1;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cqRing = ring->sqRing;
+	else {
+		ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED) {
+			ring->cqRing = NULL;
+			uringTeardown(ring);
+			return -1;
+		}
+	}
+
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		uringTeardown(ring);
+		return -1;
+	}
+
+	ring->sqHead = (unsigned int*)((char*)ring->sqRing + params.sq_off.head);
+	ring->sqTail = (unsigned int*)((char*)ring->sqRing + params.sq_off.tail);
+	ring->sqMask = (unsigned int*)((char*)ring->sqRing + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned int*)((char*)ring->sqRing + params.sq_off.array);
+	ring->sqEntries = params.sq_entries;
+	ring->cqHead = (unsigned int*)((char*)ring->cqRing + params.cq_off.head);
+	ring->cqTail = (unsigned int*)((char*)ring->cqRing + params.cq_off.tail);
+	ring->cqMask = (unsigned int*)((char*)ring->cqRing + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cqRing + params.cq_off.cqes);
+
+	ring->fixedFile = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &disk->fd, 1) == 0;
+	pthread_mutex_lock(&disk->ringLock);
+	uringRegisterBuffer(disk);
+	pthread_mutex_unlock(&disk->ringLock);
+
+	return 0;
+}
+
+static int uringAttach(struct disk_image* disk) {
+	if (preadAttach(disk))
+		return -1;
+
+	disk->ring.fd = -1;
+	uringSetup(disk);	// Sem io_uring: continua com pread/pwrite
+
+	return 0;
+}
+
+static void uringDetach(struct disk_image* disk) {
+	uringTeardown(&disk->ring);
+	preadDetach(disk);
+}
+
+static int insideRegistered(struct disk_image* disk, const unsigned char* buffer, size_t length) {
+	return disk->ring.fixedBuffer && buffer >= disk->registeredBuffer && buffer + length <= disk->registeredBuffer + disk->registeredSize;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Completa com pread/pwrite uma operacao que o anel transferiu so em parte
+
+Entra:	op   -> operacao
+		done -> bytes ja transferidos pelo anel
+-----------------------------------------------------------------------------*/
+static int uringRetry(struct disk_image* disk, const struct uringOp* op, size_t done) {
+	off_t offset = op->offset;
+	for (int i = 0; i < op->vecCount; i++) {
+		size_t length = op->vec[i].iov_len;
+		size_t skip = done < length ? done : length;
+		done -= skip;
+		while (skip < length) {
+			ssize_t n = op->isWrite ?
+				pwrite(disk->fd, (char*)op->vec[i].iov_base + skip, length - skip, offset + skip) :
+				pread(disk->fd, (char*)op->vec[i].iov_base + skip, length - skip, offset + skip);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -2;
+			skip += n;
+		}
+		offset += length;
+	}
+	return 0;
+}
+
+static void uringPrepare(struct disk_image* disk, struct io_uring_sqe* sqe, const struct uringOp* op, unsigned long long id) {
+	memset(sqe, 0, sizeof(*sqe));
+
+	if (op->fixed) {
+		sqe->opcode = op->isWrite ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long long)(uintptr_t)op->vec[0].iov_base;
+		sqe->len = (unsigned int)op->vec[0].iov_len;
+		sqe->buf_index = 0;
+	}
+	else {
+		sqe->opcode = op->isWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (unsigned long long)(uintptr_t)op->vec;
+		sqe->len = op->vecCount;
+	}
+
+	sqe->fd = disk->ring.fixedFile ? 0 : disk->fd;
+	sqe->flags = disk->ring.fixedFile ? IOSQE_FIXED_FILE : 0;
+	sqe->off = (unsigned long long)op->offset;
+	// Sem RWF_NOWAIT: o que bloquearia eh repassado pelo kernel ao io-wq
+	sqe->user_data = id;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Submete todas as operacoes, ate URING_ENTRIES por vez, e recolhe as
+		conclusoes de uma unica chamada io_uring_enter a cada rodada. Uma
+		conclusao com EAGAIN/EINTR volta para o anel; uma transferencia
+		parcial eh completada por uringRetry
+
+Retorno:
+		 0: Sucesso
+		-2: Erro na transferencia
+-----------------------------------------------------------------------------*/
+static int uringSubmit(struct disk_image* disk, struct uringOp* ops, int nops) {
+	struct uringRing* ring = &disk->ring;
+	int* again = (int*)malloc(nops * sizeof(int));	/* Operacoes a resubmeter */
+	int againCount = 0;
+	int next = 0;
+	int inFlight = 0;
+	int completed = 0;
+	int ret = 0;
+
+	if (again == NULL)
+		return -2;
+
+	while (completed < nops) {
+		unsigned int tail = *ring->sqTail;
+		int queued = 0;
+		while ((againCount > 0 || next < nops) && inFlight + queued < (int)ring->sqEntries) {
+			int id = againCount > 0 ? again[--againCount] : next++;
+			unsigned int index = tail & *ring->sqMask;
+			uringPrepare(disk, &ring->sqes[index], &ops[id], (unsigned long long)id);
+			ring->sqArray[index] = index;
+			tail++;
+			queued++;
+		}
+		__atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+		int entered;
+		do {
+			entered = (int)syscall(__NR_io_uring_enter, ring->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		} while (entered < 0 && errno == EINTR);
+		if (entered < 0) {
+			free(again);
+			return -2;
+		}
+		inFlight += queued;
+
+		unsigned int head = *ring->cqHead;
+		while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+			int id = (int)cqe->user_data;
+			struct uringOp* op = &ops[id];
+			head++;
+			inFlight--;
+			if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+				again[againCount++] = id;
+				continue;
+			}
+			if (cqe->res < 0)
+				ret = -2;
+			else if ((size_t)cqe->res < op->length && uringRetry(disk, op, (size_t)cqe->res))
+				ret = -2;
+			completed++;
+		}
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	free(again);
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Converte as faixas em operacoes do anel: um READ/WRITE_FIXED por trecho
+		contido na area registrada, ou um READV/WRITEV por grupo de ate
+		IOV_BATCH trechos, e as submete em um unico lote
+-----------------------------------------------------------------------------*/
+static int uringBatch(struct disk_image* disk, int isWrite, const struct sector_run* runs, int nruns) {
+	// Uma faixa so nao ganha nada com o anel: vai direto com preadv/pwritev
+	if (disk->ring.fd < 0 || nruns == 1) {
+		for (int r = 0; r < nruns; r++)
+			if (preadTransfer(disk, isWrite, runs[r].sector, runs[r].iov, runs[r].iovcnt))
+				return -2;
+		return 0;
+	}
+
+	int total = 0;
+	for (int r = 0; r < nruns; r++)
+		total += runs[r].iovcnt;
+
+	struct uringOp* ops = (struct uringOp*)malloc(total * sizeof(struct uringOp));
+	struct iovec* vec = (struct iovec*)malloc(total * sizeof(struct iovec));
+	if (ops == NULL || vec == NULL) {
+		free(ops);
+		free(vec);
+		return -2;
+	}
+
+	// O registro da area nao muda entre a montagem das operacoes e a submissao
+	pthread_mutex_lock(&disk->ringLock);
+
+	int nops = 0;
+	int v = 0;
+	for (int r = 0; r < nruns; r++) {
+		off_t offset = (off_t)runs[r].sector * SECTOR_SIZE;
+		int i = 0;
+		while (i < runs[r].iovcnt) {
+			struct uringOp* op = &ops[nops++];
+			op->isWrite = isWrite;
+			op->offset = offset;
+			op->vec = &vec[v];
+			op->vecCount = 0;
+			op->length = 0;
+			op->fixed = insideRegistered(disk, runs[r].iov[i].buffer, (size_t)runs[r].iov[i].count * SECTOR_SIZE);
+
+			do {
+				vec[v].iov_base = runs[r].iov[i].buffer;
+				vec[v].iov_len = (size_t)runs[r].iov[i].count * SECTOR_SIZE;
+				op->length += vec[v].iov_len;
+				op->vecCount++;
+				v++;
+				i++;
+			} while (!op->fixed && i < runs[r].iovcnt && op->vecCount < IOV_BATCH &&
+				!insideRegistered(disk, runs[r].iov[i].buffer, (size_t)runs[r].iov[i].count * SECTOR_SIZE));
+
+			offset += op->length;
+		}
+	}
+
+	int ret = uringSubmit(disk, ops, nops);
+	pthread_mutex_unlock(&disk->ringLock);
+
+	free(ops);
+	free(vec);
+
+	return ret;
+}
+
+static int uringRead(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	struct sector_run run = { sector, iov, iovcnt };
+	return uringBatch(disk, 0, &run, 1);
+}
+
+static int uringWrite(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	struct sector_run run = { sector, iov, iovcnt };
+	return uringBatch(disk, 1, &run, 1);
+}
+
+static int uringReadBatch(struct disk_image* disk, const struct sector_run* runs, int nruns) {
+	return uringBatch(disk, 0, runs, nruns);
+}
+
+static int uringWriteBatch(struct disk_image* disk, const struct sector_run* runs, int nruns) {
+	return uringBatch(disk, 1, runs, nruns);
+}
+
+#else
+
+/* Sem <linux/io_uring.h>: o backend "uring" equivale ao "pread" */
+#define uringAttach		preadAttach
+#define uringDetach		preadDetach
+#define uringRead		preadRead
+#define uringWrite		preadWrite
+#define uringReadBatch	NULL
+#define uringWriteBatch	NULL
+
+static void uringRegisterBuffer(struct disk_image* disk) {
+}
+
+#endif
+
+
+/*-----------------------------------------------------------------------------
+Backend "mmap": imagem inteira mapeada em memoria (MAP_SHARED)
+-----------------------------------------------------------------------------*/
+static int mmapAttach(struct disk_image* disk) {
+	disk->fd = open(disk->path, O_RDWR);
+	if (disk->fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(disk->fd, &st) || st.st_size < SECTOR_SIZE) {
+		close(disk->fd);
+		disk->fd = -1;
+		return -1;
+	}
+
+	disk->mapSize = (size_t)st.st_size;
+	disk->map = mmap(NULL, disk->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+	if (disk->map == MAP_FAILED) {
+		disk->map = NULL;
+		close(disk->fd);
+		disk->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void mmapDetach(struct disk_image* disk) {
+	msync(disk->map, disk->mapSize, MS_SYNC);
+	munmap(disk->map, disk->mapSize);
+	close(disk->fd);
+	disk->map = NULL;
+	disk->mapSize = 0;
+	disk->fd = -1;
+}
+
+static int mmapRead(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	size_t offset = (size_t)sector * SECTOR_SIZE;
+
+	for (int i = 0; i < iovcnt; i++) {
+		size_t len = (size_t)iov[i].count * SECTOR_SIZE;
+		if (offset + len > disk->mapSize)
+			return -3;
+		memcpy(iov[i].buffer, disk->map + offset, len);
+		offset += len;
+	}
+
+	return 0;
+}
+
+static int mmapWrite(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	size_t offset = (size_t)sector * SECTOR_SIZE;
+
+	for (int i = 0; i < iovcnt; i++) {
+		size_t len = (size_t)iov[i].count * SECTOR_SIZE;
+		if (offset + len > disk->mapSize)
+			return -4;
+		memcpy(disk->map + offset, iov[i].buffer, len);
+		offset += len;
+	}
+
+	return 0;
+}
+
+static int mmapFlush(struct disk_image* disk) {
+	return msync(disk->map, disk->mapSize, MS_SYNC) ? -5 : 0;
+}
+
+
+static const struct diskBackend backends[] = {
+	{ "stdio", stdioAttach, stdioDetach, stdioRead, stdioWrite, stdioFlush, NULL, NULL },
+	{ "pread", preadAttach, preadDetach, preadRead, preadWrite, preadFlush, NULL, NULL },
+	{ "mmap", mmapAttach, mmapDetach, mmapRead, mmapWrite, mmapFlush, NULL, NULL },
+	{ "uring", uringAttach, uringDetach, uringRead, uringWrite, preadFlush, uringReadBatch, uringWriteBatch },
+};
+
+#define NUM_BACKENDS	(sizeof(backends) / sizeof(backends[0]))
+
+static const struct diskBackend* findBackend(const char* name) {
+	for (size_t i = 0; i < NUM_BACKENDS; i++)
+		if (!strcmp(backends[i].name, name))
+			return &backends[i];
+	return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Backend das proximas aberturas: o de set_disk_backend ou, se ela nao
+		foi chamada, T2FS_DISK_BACKEND ou APIDISK_BACKEND (o chamador prende
+		attachLock)
+-----------------------------------------------------------------------------*/
+static const struct diskBackend* selectedBackend(void) {
+	if (selected == NULL) {
+		const char* name = getenv("T2FS_DISK_BACKEND");
+		if (name == NULL || findBackend(name) == NULL)
+			name = APIDISK_BACKEND;
+		selected = findBackend(name);
+	}
+
+	return selected;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Libera o backend da imagem (o da imagem padrao eh liberado no atexit)
+-----------------------------------------------------------------------------*/
+static void detachImage(struct disk_image* disk) {
+	if (disk->backend)
+		disk->backend->detach(disk);
+	disk->backend = NULL;
+}
+
+static void detachDefault(void) {
+	detachImage(&defaultDisk);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Abre a imagem com o backend "next", liberando o anterior (o chamador
+		prende attachLock)
+
+Retorno:
+		 0: Sucesso
+		-1: Erro na abertura do arquivo de disco
+-----------------------------------------------------------------------------*/
+static int attachImage(struct disk_image* disk, const struct diskBackend* next) {
+	detachImage(disk);
+
+	struct stat st;
+	if (stat(disk->path, &st))
+		return -1;
+	disk->sectors = (unsigned long long)st.st_size / SECTOR_SIZE;
+
+	if (next->attach(disk))
+		return -1;
+	__atomic_store_n(&disk->backend, next, __ATOMIC_RELEASE);
+
+	if (disk == &defaultDisk && !exitRegistered) {
+		atexit(detachDefault);
+		exitRegistered = 1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Imagem de uma requisicao: "disk" ou, se NULL, a imagem padrao, que eh
+		aberta na primeira requisicao
+
+Retorno:
+		   #: Imagem, com um backend ativo
+		NULL: Erro na abertura da imagem padrao
+-----------------------------------------------------------------------------*/
+static struct disk_image* attachDisk(struct disk_image* disk) {
+	if (disk != NULL)
+		return disk;
+	if (__atomic_load_n(&defaultDisk.backend, __ATOMIC_ACQUIRE))
+		return &defaultDisk;
+
+	pthread_mutex_lock(&attachLock);
+	int ret = 0;
+	if (defaultDisk.backend == NULL)
+		ret = attachImage(&defaultDisk, selectedBackend());
+	pthread_mutex_unlock(&attachLock);
+
+	return ret ? NULL : &defaultDisk;
+}
+
+struct disk_image* open_disk(const char* path) {
+	if (path == NULL)
+		return NULL;
+
+	struct disk_image* disk = (struct disk_image*)calloc(1, sizeof(struct disk_image));
+	char* name = strdup(path);
+	if (disk == NULL || name == NULL) {
+		free(disk);
+		free(name);
+		return NULL;
+	}
+	disk->path = name;
+	disk->fd = -1;
+	pthread_mutex_init(&disk->ringLock, NULL);
+
+	pthread_mutex_lock(&attachLock);
+	int ret = attachImage(disk, selectedBackend());
+	pthread_mutex_unlock(&attachLock);
+
+	if (ret) {
+		close_disk(disk);
+		return NULL;
+	}
+
+	return disk;
+}
+
+int close_disk(struct disk_image* disk) {
+	if (disk == NULL || disk == &defaultDisk)
+		return 0;
+
+	int ret = flush_disk_ex(disk);
+	detachImage(disk);
+	pthread_mutex_destroy(&disk->ringLock);
+	free((char*)disk->path);
+	free(disk);
+
+	return ret;
+}
+
+int read_sector(unsigned int sector, unsigned char* buffer) {
+	return read_sectors_ex(NULL, sector, 1, buffer);
+}
+
+int write_sector(unsigned int sector, unsigned char* buffer) {
+	return write_sectors_ex(NULL, sector, 1, buffer);
+}
+
+int read_sectors(unsigned int sector, unsigned int count, unsigned char* buffer) {
+	return read_sectors_ex(NULL, sector, count, buffer);
+}
+
+int write_sectors(unsigned int sector, unsigned int count, unsigned char* buffer) {
+	return write_sectors_ex(NULL, sector, count, buffer);
+}
+
+int read_sectors_ex(struct disk_image* disk, unsigned int sector, unsigned int count, unsigned char* buffer) {
+	struct sector_iovec iov = { buffer, count };
+	return read_sectorsv_ex(disk, sector, &iov, 1);
+}
+
+int write_sectors_ex(struct disk_image* disk, unsigned int sector, unsigned int count, unsigned char* buffer) {
+	struct sector_iovec iov = { buffer, count };
+	return write_sectorsv_ex(disk, sector, &iov, 1);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Verifica se a faixa de setores da requisicao esta dentro do disco
+		(o tamanho do disco nao eh alterado por escritas fora dele)
+-----------------------------------------------------------------------------*/
+static int inDisk(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	unsigned long long last = sector;
+	for (int i = 0; i < iovcnt; i++)
+		last += iov[i].count;
+
+	return last <= disk->sectors;
+}
+
+int read_sectorsv(unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	return read_sectorsv_ex(NULL, sector, iov, iovcnt);
+}
+
+int write_sectorsv(unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	return write_sectorsv_ex(NULL, sector, iov, iovcnt);
+}
+
+int read_sectorsv_ex(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	if ((disk = attachDisk(disk)) == NULL)
+		return -1;
+	if (!inDisk(disk, sector, iov, iovcnt))
+		return -2;
+
+	return disk->backend->read(disk, sector, iov, iovcnt);
+}
+
+int write_sectorsv_ex(struct disk_image* disk, unsigned int sector, const struct sector_iovec* iov, int iovcnt) {
+	if ((disk = attachDisk(disk)) == NULL)
+		return -1;
+	if (!inDisk(disk, sector, iov, iovcnt))
+		return -2;
+
+	return disk->backend->write(disk, sector, iov, iovcnt);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Executa as faixas de um lote com o backend da imagem: de uma vez, se
+		ele tiver readBatch/writeBatch, ou uma faixa por vez
+-----------------------------------------------------------------------------*/
+static int transferBatch(struct disk_image* disk, int isWrite, const struct sector_run* runs, int nruns) {
+	if ((disk = attachDisk(disk)) == NULL)
+		return -1;
+
+	for (int r = 0; r < nruns; r++)
+		if (!inDisk(disk, runs[r].sector, runs[r].iov, runs[r].iovcnt))
+			return -2;
+
+	const struct diskBackend* backend = disk->backend;
+	int (*batch)(struct disk_image*, const struct sector_run*, int) = isWrite ? backend->writeBatch : backend->readBatch;
+	if (batch)
+		return batch(disk, runs, nruns);
+
+	for (int r = 0; r < nruns; r++) {
+		int ret = isWrite ? backend->write(disk, runs[r].sector, runs[r].iov, runs[r].iovcnt) : backend->read(disk, runs[r].sector, runs[r].iov, runs[r].iovcnt);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int read_sectors_batch(const struct sector_run* runs, int nruns) {
+	return transferBatch(NULL, 0, runs, nruns);
+}
+
+int write_sectors_batch(const struct sector_run* runs, int nruns) {
+	return transferBatch(NULL, 1, runs, nruns);
+}
+
+int read_sectors_batch_ex(struct disk_image* disk, const struct sector_run* runs, int nruns) {
+	return transferBatch(disk, 0, runs, nruns);
+}
+
+int write_sectors_batch_ex(struct disk_image* disk, const struct sector_run* runs, int nruns) {
+	return transferBatch(disk, 1, runs, nruns);
+}
+
+int register_disk_buffer(unsigned char* buffer, size_t size) {
+	return register_disk_buffer_ex(NULL, buffer, size);
+}
+
+int register_disk_buffer_ex(struct disk_image* disk, unsigned char* buffer, size_t size) {
+	if (disk == NULL)
+		disk = &defaultDisk;
+
+	pthread_mutex_lock(&disk->ringLock);
+	disk->registeredBuffer = buffer;
+	disk->registeredSize = buffer ? size : 0;
+
+	const struct diskBackend* active = __atomic_load_n(&disk->backend, __ATOMIC_ACQUIRE);
+	if (active && !strcmp(active->name, "uring"))
+		uringRegisterBuffer(disk);
+	pthread_mutex_unlock(&disk->ringLock);
+
+	return 0;
+}
+
+int flush_disk(void) {
+	return flush_disk_ex(NULL);
+}
+
+int flush_disk_ex(struct disk_image* disk) {
+	if (disk == NULL)
+		disk = &defaultDisk;
+
+	const struct diskBackend* active = __atomic_load_n(&disk->backend, __ATOMIC_ACQUIRE);
+	if (active == NULL)
+		return 0;
+
+	return active->flush(disk);
+}
+
+int set_disk_backend(const char* name) {
+	const struct diskBackend* next = findBackend(name);
+	if (next == NULL)
+		return -6;
+
+	pthread_mutex_lock(&attachLock);
+	selected = next;
+	int ret = attachImage(&defaultDisk, next);
+	pthread_mutex_unlock(&attachLock);
+
+	return ret;
+}
+
+const char* get_disk_backend(void) {
+	struct disk_image* disk = attachDisk(NULL);
+	if (disk == NULL)
+		return NULL;
+
+	return disk->backend->name;
+}
@@ -0,0 +1,415 @@
+/*************************************************************************
+
+	E/S assincrona do T2FS - ver asyncio.h
+
+	Cada requisicao ocupa uma posicao de "requests" (reservada com
+	compare-and-swap) e seu indice eh colocado na fila de submissao, um
+	vetor circular limitado com um numero de sequencia por celula: varios
+	produtores reservam posicoes com compare-and-swap e o unico consumidor eh
+	a thread de E/S. A thread dorme em uma variavel de condicao apenas
+	quando a fila esta vazia.
+
+	A thread eh criada e terminada com "lock" preso (startWorker e
+	closeAsync), e a requisicao entra na fila tambem com "lock" preso:
+	duas threads submetendo a primeira requisicao nao criam dois
+	consumidores, e nenhuma requisicao entra na fila de uma thread que ja
+	decidiu terminar.
+
+	O identificador devolvido ao chamador combina a posicao e uma geracao,
+	de modo que um identificador antigo nao alcanca uma requisicao nova que
+	reutilize a mesma posicao.
+
+*************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/t2fs.h"
+#include "../include/asyncio.h"
+
+#define QUEUE_MASK		(ASYNCIO_MAX_REQUESTS - 1)
+#define MAX_GENERATION	(0x7FFFFFFF / ASYNCIO_MAX_REQUESTS)
+
+enum { REQ_FREE, REQ_RESERVED, REQ_QUEUED, REQ_DONE };
+
+struct asyncRequest {
+	int state;
+	int generation;
+	int isWrite;
+	FILE2 handle;
+	char* buffer;
+	int size;
+	int result;
+};
+
+struct queueCell {
+	unsigned int sequence;
+	int request;
+};
+
+static struct asyncRequest requests[ASYNCIO_MAX_REQUESTS];
+static struct queueCell queue[ASYNCIO_MAX_REQUESTS];
+static unsigned int enqueuePos = 0;
+static unsigned int dequeuePos = 0;
+
+static int pending = 0;			/* Requisicoes submetidas e ainda nao concluidas */
+static int workerRunning = 0;	/* Alterado apenas com "lock" preso */
+static int stopping = 0;		/* closeAsync esperando a thread terminar ("lock") */
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+
+
+static void initQueue(void) {
+	for (unsigned int i = 0; i < ASYNCIO_MAX_REQUESTS; i++)
+		__atomic_store_n(&queue[i].sequence, i, __ATOMIC_RELAXED);
+	enqueuePos = 0;
+	dequeuePos = 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Coloca a requisicao na fila (varios produtores)
+
+Retorno:
+		 0: Sucesso
+		-1: Fila cheia
+-----------------------------------------------------------------------------*/
+static int enqueue(int request) {
+	unsigned int pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+	struct queueCell* cell;
+
+	for (;;) {
+		cell = &queue[pos & QUEUE_MASK];
+		int diff = (int)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+			return -1;
+		else
+			pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+	}
+
+	cell->request = request;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retira a proxima requisicao da fila (apenas a thread de E/S)
+
+Retorno:
+		 #: Indice da requisicao
+		-1: Fila vazia
+-----------------------------------------------------------------------------*/
+static int dequeue(void) {
+	struct queueCell* cell = &queue[dequeuePos & QUEUE_MASK];
+	if ((int)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (dequeuePos + 1)) < 0)
+		return -1;
+
+	int request = cell->request;
+	__atomic_store_n(&cell->sequence, dequeuePos + ASYNCIO_MAX_REQUESTS, __ATOMIC_RELEASE);
+	dequeuePos++;
+
+	return request;
+}
+
+static int queueEmpty(void) {
+	struct queueCell* cell = &queue[dequeuePos & QUEUE_MASK];
+	return (int)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (dequeuePos + 1)) < 0;
+}
+
+static void complete(int request, int result) {
+	requests[request].result = result;
+	__atomic_store_n(&requests[request].state, REQ_DONE, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Executa as requisicoes batch[first] ate batch[last - 1], todas do
+		mesmo tipo e handle, com uma unica chamada de readv2/writev2 sobre
+		os buffers das proprias requisicoes. Se o writev2 falhar, as escritas
+		sao refeitas uma a uma com write2.
+-----------------------------------------------------------------------------*/
+static void runMerged(int* batch, int first, int last) {
+	IOVEC2 iov[ASYNCIO_MAX_REQUESTS];
+	struct asyncRequest* req = &requests[batch[first]];
+
+	for (int i = first; i < last; i++) {
+		iov[i - first].buffer = requests[batch[i]].buffer;
+		iov[i - first].size = requests[batch[i]].size;
+	}
+
+	if (req->isWrite) {
+		int ret = writev2(req->handle, iov, last - first);
+		for (int i = first; i < last; i++) {
+			// writev2 nao grava nada se falhar (ex.: disco cheio): cada requisicao
+			// eh refeita sozinha, com o resultado que teria em write2
+			if (ret < 0 && last - first > 1)
+				complete(batch[i], write2(req->handle, requests[batch[i]].buffer, requests[batch[i]].size));
+			else
+				complete(batch[i], ret < 0 ? ret : requests[batch[i]].size);
+		}
+		return;
+	}
+
+	// Leitura: os bytes lidos ficam nas requisicoes, na ordem
+	int ret = readv2(req->handle, iov, last - first);
+	int offset = 0;
+	for (int i = first; i < last; i++) {
+		if (ret < 0) {
+			complete(batch[i], ret);
+			continue;
+		}
+		int bytes = requests[batch[i]].size < ret - offset ? requests[batch[i]].size : ret - offset;
+		offset += bytes;
+		complete(batch[i], bytes);
+	}
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Atende as requisicoes que estao na fila, juntando as consecutivas do
+		mesmo tipo sobre o mesmo handle
+-----------------------------------------------------------------------------*/
+static void runBatch(void) {
+	int batch[ASYNCIO_MAX_REQUESTS];
+	int n = 0;
+	int request;
+
+	while (n < ASYNCIO_MAX_REQUESTS && (request = dequeue()) >= 0)
+		batch[n++] = request;
+
+	int i = 0;
+	while (i < n) {
+		struct asyncRequest* req = &requests[batch[i]];
+		int total = req->size;
+		int j = i + 1;
+
+		while (j < n && requests[batch[j]].isWrite == req->isWrite && requests[batch[j]].handle == req->handle &&
+			total + requests[batch[j]].size <= ASYNCIO_MERGE_MAX) {
+			total += requests[batch[j]].size;
+			j++;
+		}
+
+		runMerged(batch, i, j);
+		i = j;
+	}
+
+	pthread_mutex_lock(&lock);
+	pthread_cond_broadcast(&doneCond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void* workerMain(void* arg) {
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (queueEmpty() && !stopping)
+			pthread_cond_wait(&workCond, &lock);
+		int stop = stopping && queueEmpty();
+		pthread_mutex_unlock(&lock);
+
+		if (stop)
+			break;
+
+		runBatch();
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Cria a thread de E/S, se ela nao existir. Se closeAsync estiver
+		terminando a thread, espera o fim antes de criar outra. O chamador
+		prende "lock".
+
+Retorno:
+		 0: Sucesso
+		-1: Erro ao criar a thread
+-----------------------------------------------------------------------------*/
+static int startWorker(void) {
+	while (stopping)
+		pthread_cond_wait(&doneCond, &lock);
+
+	if (workerRunning)
+		return 0;
+
+	initQueue();
+	if (pthread_create(&worker, NULL, workerMain, NULL))
+		return -1;
+	__atomic_store_n(&workerRunning, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int isWorker(void) {
+	return __atomic_load_n(&workerRunning, __ATOMIC_ACQUIRE) && pthread_equal(pthread_self(), worker);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Reserva uma posicao livre de "requests"
+
+Retorno:
+		 #: Indice da posicao
+		-1: Todas as posicoes estao em uso
+-----------------------------------------------------------------------------*/
+static int reserveRequest(void) {
+	for (int i = 0; i < ASYNCIO_MAX_REQUESTS; i++) {
+		int expected = REQ_FREE;
+		if (__atomic_compare_exchange_n(&requests[i].state, &expected, REQ_RESERVED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return i;
+	}
+	return -1;
+}
+
+static int submit(int isWrite, FILE2 handle, char* buffer, int size) {
+	if (buffer == NULL || size < 0)
+		return -1;
+
+	int request = reserveRequest();
+	if (request < 0)
+		return -18;
+
+	struct asyncRequest* req = &requests[request];
+	req->generation = req->generation % MAX_GENERATION + 1;
+	req->isWrite = isWrite;
+	__atomic_store_n(&req->handle, handle, __ATOMIC_RELAXED);	// Lido por drainAsyncHandle
+	req->buffer = buffer;
+	req->size = size;
+	req->result = 0;
+	__atomic_store_n(&req->state, REQ_QUEUED, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&lock);
+	int ret = startWorker();
+	if (ret == 0) {
+		__atomic_add_fetch(&pending, 1, __ATOMIC_ACQ_REL);
+		// Ha uma celula por posicao de "requests": a fila cheia indica um erro interno
+		if ((ret = enqueue(request)))
+			__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL);
+		else
+			pthread_cond_signal(&workCond);
+	}
+	if (ret) {
+		__atomic_store_n(&req->state, REQ_FREE, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&doneCond);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (ret)
+		return -18;
+
+	return req->generation * ASYNCIO_MAX_REQUESTS + request;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna a requisicao do identificador "id" ou NULL se ele for invalido
+		(inexistente ou ja liberado por wait2)
+-----------------------------------------------------------------------------*/
+static struct asyncRequest* findRequest(int id) {
+	if (id < ASYNCIO_MAX_REQUESTS)
+		return NULL;
+
+	struct asyncRequest* req = &requests[id % ASYNCIO_MAX_REQUESTS];
+	int state = __atomic_load_n(&req->state, __ATOMIC_ACQUIRE);
+	if (req->generation != id / ASYNCIO_MAX_REQUESTS || (state != REQ_QUEUED && state != REQ_DONE))
+		return NULL;
+
+	return req;
+}
+
+int read2_async(FILE2 handle, char* buffer, int size) {
+	return submit(0, handle, buffer, size);
+}
+
+int write2_async(FILE2 handle, char* buffer, int size) {
+	return submit(1, handle, buffer, size);
+}
+
+int poll2(int request) {
+	struct asyncRequest* req = findRequest(request);
+	if (req == NULL)
+		return -19;
+
+	return __atomic_load_n(&req->state, __ATOMIC_ACQUIRE) == REQ_DONE;
+}
+
+int wait2(int request) {
+	struct asyncRequest* req = findRequest(request);
+	if (req == NULL)
+		return -19;
+
+	if (__atomic_load_n(&req->state, __ATOMIC_ACQUIRE) != REQ_DONE) {
+		pthread_mutex_lock(&lock);
+		while (__atomic_load_n(&req->state, __ATOMIC_ACQUIRE) != REQ_DONE)
+			pthread_cond_wait(&doneCond, &lock);
+		pthread_mutex_unlock(&lock);
+	}
+
+	int result = req->result;
+	__atomic_store_n(&req->state, REQ_FREE, __ATOMIC_RELEASE);
+
+	return result;
+}
+
+void drainAsync(void) {
+	if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0 || isWorker())
+		return;
+
+	pthread_mutex_lock(&lock);
+	while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0)
+		pthread_cond_wait(&doneCond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Informa se ha requisicao na fila (ainda nao concluida) sobre "handle"
+-----------------------------------------------------------------------------*/
+static int handlePending(int handle) {
+	for (int i = 0; i < ASYNCIO_MAX_REQUESTS; i++)
+		if (__atomic_load_n(&requests[i].state, __ATOMIC_ACQUIRE) == REQ_QUEUED && __atomic_load_n(&requests[i].handle, __ATOMIC_RELAXED) == handle)
+			return 1;
+	return 0;
+}
+
+void drainAsyncHandle(int handle) {
+	if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0 || isWorker())
+		return;
+
+	pthread_mutex_lock(&lock);
+	while (handlePending(handle))
+		pthread_cond_wait(&doneCond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void closeAsync(void) {
+	if (!__atomic_load_n(&workerRunning, __ATOMIC_ACQUIRE) || isWorker())
+		return;
+
+	drainAsync();
+
+	pthread_mutex_lock(&lock);
+	if (!workerRunning || stopping) {
+		// Outra thread ja terminou (ou esta terminando) a thread de E/S
+		while (stopping)
+			pthread_cond_wait(&doneCond, &lock);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	stopping = 1;
+	pthread_cond_signal(&workCond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(worker, NULL);
+
+	pthread_mutex_lock(&lock);
+	__atomic_store_n(&workerRunning, 0, __ATOMIC_RELEASE);
+	stopping = 0;
+	pthread_cond_broadcast(&doneCond);
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,384 @@
+/*************************************************************************
+
+	Implementacao dos bitmaps de blocos e inodes do T2FS (bitmap2.h)
+
+	Substitui o bitmap2.o fornecido. Os dois bitmaps de uma particao ficam
+	residentes em memoria (BITMAP2), do openBitmap2 ao closeBitmap2, e
+	setBitmap2 apenas marca o setor alterado, que eh gravado em
+	flushBitmap2/closeBitmap2. Cada particao montada tem os seus bitmaps.
+
+	Os bits sao guardados em palavras de 64 bits (bit 0 = bit menos
+	significativo do primeiro byte, como no disco) e a busca por um bit livre
+	testa 64 bits por vez (__builtin_ctzll). Regioes totalmente ocupadas sao
+	puladas com AVX2 (4 palavras) ou SSE2 (2 palavras), quando disponiveis.
+
+	Cada bitmap mantem a dica "nextFree": nenhum bit abaixo dela esta livre,
+	portanto allocBitmap2 continua devolvendo o menor indice livre.
+
+	A quantidade de bits em 1 ("ones") eh contada ao carregar o bitmap e
+	atualizada a cada bit alterado, de modo que countBitmap2 so percorre os
+	bits entre "maxBits" e o fim do bitmap.
+
+	allocExtentBitmap2 reserva uma sequencia de bits livres contiguos em uma
+	unica passada: primeiro tenta a posicao "goal", depois a primeira
+	sequencia com o tamanho pedido e, se nao houver, a maior encontrada.
+
+*************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "../include/apidisk.h"
+#include "../include/bitmap2.h"
+
+#define WORD_BITS	64
+#define ALL_SET		(~(uint64_t)0)
+
+struct bitmap {
+	uint64_t* words;
+	unsigned char* dirty;	/* Um indicador por setor do bitmap */
+	int firstSector;		/* Setor (absoluto) onde o bitmap comeca */
+	int sectors;
+	int nBits;
+	int nextFree;			/* Nenhum bit livre abaixo deste indice */
+	int ones;				/* Bits em 1 em [0, nBits) */
+};
+
+struct bitmap2 {
+	struct bitmap maps[2];	/* BITMAP_INODE e BITMAP_DADOS */
+	struct disk_image* disk;	/* Imagem da particao (NULL: t2fs_disk.dat) */
+};
+
+
+static struct bitmap* getBitmap(BITMAP2* bitmaps, int handle) {
+	if (bitmaps == NULL)
+		return NULL;
+	return &bitmaps->maps[handle ? BITMAP_DADOS : BITMAP_INODE];
+}
+
+static int bitmapError(int handle) {
+	return handle ? -3 : -2;
+}
+
+static void freeBitmap(struct bitmap* bm) {
+	free(bm->words);
+	free(bm->dirty);
+	memset(bm, 0, sizeof(*bm));
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Quantidade de bits em 1 no intervalo [start, end)
+-----------------------------------------------------------------------------*/
+static int countOnes(const struct bitmap* bm, int start, int end) {
+	int ones = 0;
+	for (int bit = start; bit < end; ) {
+		int i = bit / WORD_BITS;
+		int last = (i + 1) * WORD_BITS < end ? (i + 1) * WORD_BITS : end;
+		uint64_t mask = (ALL_SET << (bit % WORD_BITS)) & (ALL_SET >> ((i + 1) * WORD_BITS - last));
+		ones += __builtin_popcountll(bm->words[i] & mask);
+		bit = last;
+	}
+
+	return ones;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le "sectors" setores do bitmap a partir de "firstSector"
+-----------------------------------------------------------------------------*/
+static int loadBitmap(struct disk_image* disk, struct bitmap* bm, int firstSector, int sectors, int nBits) {
+	size_t bytes = (size_t)sectors * SECTOR_SIZE;
+
+	bm->words = (uint64_t*)malloc(bytes);
+	bm->dirty = (unsigned char*)calloc(sectors, sizeof(unsigned char));
+	if (bm->words == NULL || bm->dirty == NULL) {
+		freeBitmap(bm);
+		return -1;
+	}
+
+	if (read_sectors_ex(disk, firstSector, sectors, (unsigned char*)bm->words)) {
+		freeBitmap(bm);
+		return -1;
+	}
+
+	bm->firstSector = firstSector;
+	bm->sectors = sectors;
+	bm->nBits = nBits < (int)(bytes * 8) ? nBits : (int)(bytes * 8);
+	bm->nextFree = 0;
+	bm->ones = countOnes(bm, 0, bm->nBits);
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Grava os setores alterados do bitmap, agrupando setores consecutivos
+-----------------------------------------------------------------------------*/
+static int flushBitmap(struct disk_image* disk, struct bitmap* bm) {
+	int s = 0;
+	while (s < bm->sectors) {
+		if (!bm->dirty[s]) {
+			s++;
+			continue;
+		}
+
+		int first = s;
+		while (s < bm->sectors && bm->dirty[s])
+			s++;
+
+		if (write_sectors_ex(disk, bm->firstSector + first, s - first, (unsigned char*)bm->words + (size_t)first * SECTOR_SIZE))
+			return -1;
+
+		memset(&bm->dirty[first], 0, s - first);
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna o indice da primeira palavra, a partir de "i", diferente de
+		"fill" (ALL_SET ao procurar zeros, 0 ao procurar uns), ou "n"
+-----------------------------------------------------------------------------*/
+static int skipFilledWords(const uint64_t* words, int i, int n, uint64_t fill) {
+#if defined(__AVX2__)
+	const __m256i f = _mm256_set1_epi64x((long long)fill);
+	while (i + 4 <= n) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)&words[i]);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, f)) != -1)
+			break;
+		i += 4;
+	}
+#elif defined(__SSE2__)
+	const __m128i f = _mm_set1_epi32((int)(uint32_t)fill);
+	while (i + 2 <= n) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&words[i]);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, f)) != 0xFFFF)
+			break;
+		i += 2;
+	}
+#endif
+	while (i < n && words[i] == fill)
+		i++;
+
+	return i;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Procura o primeiro bit com valor "bitValue" no intervalo [start, end)
+
+Retorno:
+		 #: Indice do bit
+		-1: Nao achou
+-----------------------------------------------------------------------------*/
+static int findBit(const struct bitmap* bm, int bitValue, int start, int end) {
+	if (start >= end)
+		return -1;
+
+	uint64_t fill = bitValue ? 0 : ALL_SET;
+	int lastWord = (end + WORD_BITS - 1) / WORD_BITS;
+	int i = start / WORD_BITS;
+
+	// Bits procurados ficam em 1 depois do xor; descarta os anteriores a "start"
+	uint64_t word = (bm->words[i] ^ fill) & (ALL_SET << (start % WORD_BITS));
+
+	for (;;) {
+		if (word) {
+			int bit = i * WORD_BITS + __builtin_ctzll(word);
+			return bit < end ? bit : -1;
+		}
+
+		i = skipFilledWords(bm->words, i + 1, lastWord, fill);
+		if (i >= lastWord)
+			return -1;
+
+		word = bm->words[i] ^ fill;
+	}
+}
+
+static void putBit(struct bitmap* bm, int bitNumber, int bitValue) {
+	uint64_t mask = (uint64_t)1 << (bitNumber % WORD_BITS);
+
+	if (!(bm->words[bitNumber / WORD_BITS] & mask) != !bitValue)
+		bm->ones += bitValue ? 1 : -1;
+
+	if (bitValue)
+		bm->words[bitNumber / WORD_BITS] |= mask;
+	else
+		bm->words[bitNumber / WORD_BITS] &= ~mask;
+
+	bm->dirty[bitNumber / (SECTOR_SIZE * 8)] = 1;
+}
+
+BITMAP2* openBitmap2(struct disk_image* disk, int superbloco_sector) {
+	unsigned char buffer[SECTOR_SIZE];
+	if (read_sectors_ex(disk, superbloco_sector, 1, buffer))
+		return NULL;
+
+	// Campos do superbloco (ver struct t2fs_superbloco em t2fs.h)
+	uint16_t* fields = (uint16_t*)buffer;
+	int superblockSize = fields[3];
+	int freeBlocksBitmapSize = fields[4];
+	int freeInodeBitmapSize = fields[5];
+	int inodeAreaSize = fields[6];
+	int blockSize = fields[7];
+	uint32_t diskSize = *(uint32_t*)&buffer[16];
+
+	int dadosSector = superbloco_sector + superblockSize * blockSize;
+	int inodeSector = dadosSector + freeBlocksBitmapSize * blockSize;
+	int nBitInode = inodeAreaSize * blockSize * SECTOR_SIZE / 32;
+
+	BITMAP2* bitmaps = (BITMAP2*)calloc(1, sizeof(BITMAP2));
+	if (bitmaps == NULL)
+		return NULL;
+	bitmaps->disk = disk;
+
+	if (loadBitmap(disk, &bitmaps->maps[BITMAP_DADOS], dadosSector, freeBlocksBitmapSize * blockSize, (int)diskSize)) {
+		free(bitmaps);
+		return NULL;
+	}
+	if (loadBitmap(disk, &bitmaps->maps[BITMAP_INODE], inodeSector, freeInodeBitmapSize * blockSize, nBitInode)) {
+		freeBitmap(&bitmaps->maps[BITMAP_DADOS]);
+		free(bitmaps);
+		return NULL;
+	}
+
+	return bitmaps;
+}
+
+int closeBitmap2(BITMAP2* bitmaps) {
+	if (bitmaps == NULL)
+		return 0;
+
+	int ret = flushBitmap2(bitmaps);
+
+	freeBitmap(&bitmaps->maps[BITMAP_INODE]);
+	freeBitmap(&bitmaps->maps[BITMAP_DADOS]);
+	free(bitmaps);
+
+	return ret;
+}
+
+int flushBitmap2(BITMAP2* bitmaps) {
+	if (bitmaps == NULL)
+		return 0;
+
+	if (flushBitmap(bitmaps->disk, &bitmaps->maps[BITMAP_INODE]) || flushBitmap(bitmaps->disk, &bitmaps->maps[BITMAP_DADOS]))
+		return -1;
+
+	return 0;
+}
+
+int getBitmap2(BITMAP2* bitmaps, int handle, int bitNumber) {
+	struct bitmap* bm = getBitmap(bitmaps, handle);
+	if (bm == NULL || bm->words == NULL || bitNumber < 0 || bitNumber >= bm->nBits)
+		return bitmapError(handle);
+
+	return (int)((bm->words[bitNumber / WORD_BITS] >> (bitNumber % WORD_BITS)) & 1);
+}
+
+int setBitmap2(BITMAP2* bitmaps, int handle, int bitNumber, int bitValue) {
+	struct bitmap* bm = getBitmap(bitmaps, handle);
+	if (bm == NULL || bm->words == NULL || bitNumber < 0 || bitNumber >= bm->nBits)
+		return bitmapError(handle);
+
+	putBit(bm, bitNumber, bitValue);
+
+	if (!bitValue && bitNumber < bm->nextFree)
+		bm->nextFree = bitNumber;
+
+	return 0;
+}
+
+/* Nao achou: -1 (findBit); o bit 0 eh um indice valido */
+int searchBitmap2(BITMAP2* bitmaps, int handle, int bitValue) {
+	struct bitmap* bm = getBitmap(bitmaps, handle);
+	if (bm == NULL || bm->words == NULL)
+		return bitmapError(handle);
+
+	return findBit(bm, bitValue, bitValue ? 0 : bm->nextFree, bm->nBits);
+}
+
+int allocBitmap2(BITMAP2* bitmaps, int handle, int maxBits) {
+	struct bitmap* bm = getBitmap(bitmaps, handle);
+	if (bm == NULL || bm->words == NULL)
+		return bitmapError(handle);
+
+	int end = (maxBits > 0 && maxBits < bm->nBits) ? maxBits : bm->nBits;
+	int bit = findBit(bm, 0, bm->nextFree, end);
+	if (bit < 0)
+		return -1;
+
+	putBit(bm, bit, 1);
+	bm->nextFree = bit + 1;
+
+	return bit;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Tamanho da sequencia de bits livres que comeca em "start" (livre),
+		limitada a "count" bits e ao indice "end"
+-----------------------------------------------------------------------------*/
+static int freeRunLength(const struct bitmap* bm, int start, int count, int end) {
+	int limit = (count < end - start) ? start + count : end;
+	int used = findBit(bm, 1, start, limit);
+
+	return (used < 0 ? limit : used) - start;
+}
+
+int allocExtentBitmap2(BITMAP2* bitmaps, int handle, int goal, int count, int maxBits, int* allocated) {
+	struct bitmap* bm = getBitmap(bitmaps, handle);
+	if (bm == NULL || bm->words == NULL || count <= 0)
+		return bitmapError(handle);
+
+	int end = (maxBits > 0 && maxBits < bm->nBits) ? maxBits : bm->nBits;
+	int start = -1;
+	int length = 0;
+
+	// Continuacao da sequencia anterior (ex.: bloco seguinte ao fim do arquivo)
+	if (goal >= 0 && goal < end && !((bm->words[goal / WORD_BITS] >> (goal % WORD_BITS)) & 1)) {
+		start = goal;
+		length = freeRunLength(bm, goal, count, end);
+	}
+
+	// Primeira sequencia com "count" bits livres; senao, a maior encontrada
+	if (length < count) {
+		int bit = findBit(bm, 0, bm->nextFree, end);
+		while (bit >= 0) {
+			int run = freeRunLength(bm, bit, count, end);
+			if (run > length) {
+				start = bit;
+				length = run;
+				if (run == count)
+					break;
+			}
+			bit = findBit(bm, 0, bit + run, end);
+		}
+	}
+
+	if (start < 0)
+		return -1;
+
+	for (int i = start; i < start + length; i++)
+		putBit(bm, i, 1);
+
+	if (start == bm->nextFree)
+		bm->nextFree = start + length;
+
+	if (allocated)
+		*allocated = length;
+
+	return start;
+}
+
+int countBitmap2(BITMAP2* bitmaps, int handle, int bitValue, int maxBits) {
+	struct bitmap* bm = getBitmap(bitmaps, handle);
+	if (bm == NULL || bm->words == NULL)
+		return bitmapError(handle);
+
+	// "ones" cobre o bitmap inteiro: desconta os bits a partir de "end"
+	int end = (maxBits > 0 && maxBits < bm->nBits) ? maxBits : bm->nBits;
+	int ones = bm->ones - countOnes(bm, end, bm->nBits);
+
+	return bitValue ? ones : end - ones;
+}
@@ -0,0 +1,501 @@
+/*************************************************************************
+
+	Cache de blocos (write-back) com substituicao LRU - ver blockcache.h
+
+	Cada entrada guarda um bloco inteiro. As entradas ficam encadeadas em uma
+	tabela hash (indice do bloco) e em uma lista duplamente encadeada em ordem
+	de uso: o inicio da lista eh o bloco usado mais recentemente e o final eh
+	o candidato a substituicao.
+
+	Cada particao montada tem a sua cache (struct blockcache). As funcoes
+	publicas sao protegidas por um mutex da cache (lock), de modo que ela
+	pode ser usada por varias threads. As leituras e gravacoes no disco
+	feitas pela cache acontecem com o mutex preso; caches diferentes fazem
+	E/S em paralelo.
+
+*************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/apidisk.h"
+#include "../include/blockcache.h"
+
+#define NO_ENTRY	-1
+
+struct cacheEntry {
+	unsigned int block;
+	int valid;
+	int dirty;
+	int prefetched;		/* Lido por prefetchBlockCache e ainda nao acessado */
+	int hashNext;		/* Proxima entrada no mesmo bucket */
+	int lruPrev;		/* Entrada usada mais recentemente */
+	int lruNext;		/* Entrada usada menos recentemente */
+	unsigned char* data;
+};
+
+/* Entrada suja (ou a ser lida) e o seu bloco, ordenadas por bloco no flush */
+struct flushRef {
+	unsigned int block;
+	int entry;
+};
+
+struct blockcache {
+	struct cacheEntry* entries;
+	unsigned char* data;
+	int* buckets;
+	struct flushRef* flushOrder;
+	struct sector_iovec* flushIov;
+	struct sector_run* flushRuns;	/* Faixas de blocos consecutivos de um lote */
+	int numEntries;
+	unsigned int hashMask;
+	int lruHead;
+	int lruTail;
+
+	struct disk_image* disk;		/* Imagem da particao (NULL: t2fs_disk.dat) */
+	unsigned int partitionStart;
+	int sectorsPerBlock;
+	unsigned int blockBytes;
+
+	struct blockcache_stats stats;
+
+	int registered;			/* A area "data" eh a registrada na imagem */
+	struct blockcache* nextOpen;
+
+	pthread_mutex_t lock;
+};
+
+/* Caches abertas. Em cada imagem, apenas a area de uma cache fica
+   registrada no backend (register_disk_buffer_ex) */
+static struct blockcache* openCaches = NULL;
+static pthread_mutex_t registerLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int prefetchEntries(struct blockcache* cache, const unsigned int* blocks, int count);
+static int flushEntries(struct blockcache* cache);
+static void freeBlockCache(struct blockcache* cache);
+
+static unsigned int hashBlock(struct blockcache* cache, unsigned int block) {
+	return (block * 2654435761u) & cache->hashMask;
+}
+
+static void lruUnlink(struct blockcache* cache, int e) {
+	struct cacheEntry* entries = cache->entries;
+
+	if (entries[e].lruPrev != NO_ENTRY)
+		entries[entries[e].lruPrev].lruNext = entries[e].lruNext;
+	else
+		cache->lruHead = entries[e].lruNext;
+
+	if (entries[e].lruNext != NO_ENTRY)
+		entries[entries[e].lruNext].lruPrev = entries[e].lruPrev;
+	else
+		cache->lruTail = entries[e].lruPrev;
+}
+
+static void lruPushFront(struct blockcache* cache, int e) {
+	struct cacheEntry* entries = cache->entries;
+
+	entries[e].lruPrev = NO_ENTRY;
+	entries[e].lruNext = cache->lruHead;
+	if (cache->lruHead != NO_ENTRY)
+		entries[cache->lruHead].lruPrev = e;
+	cache->lruHead = e;
+	if (cache->lruTail == NO_ENTRY)
+		cache->lruTail = e;
+}
+
+static void hashRemove(struct blockcache* cache, int e) {
+	int* link = &cache->buckets[hashBlock(cache, cache->entries[e].block)];
+	while (*link != e)
+		link = &cache->entries[*link].hashNext;
+	*link = cache->entries[e].hashNext;
+}
+
+static int hashFind(struct blockcache* cache, unsigned int block) {
+	for (int e = cache->buckets[hashBlock(cache, block)]; e != NO_ENTRY; e = cache->entries[e].hashNext)
+		if (cache->entries[e].block == block)
+			return e;
+	return NO_ENTRY;
+}
+
+static int writeBack(struct blockcache* cache, int e) {
+	struct cacheEntry* entry = &cache->entries[e];
+	if (!entry->dirty)
+		return 0;
+
+	if (write_sectors_ex(cache->disk, cache->partitionStart + entry->block * cache->sectorsPerBlock, cache->sectorsPerBlock, entry->data))
+		return -1;
+
+	entry->dirty = 0;
+	cache->stats.writebacks++;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Libera a entrada menos recentemente usada (as livres ficam no final da
+		lista), gravando-a se estiver suja
+
+Retorno:
+		 #: Indice da entrada, ja fora da tabela hash
+		-1: Erro na gravacao do disco
+-----------------------------------------------------------------------------*/
+static int evictEntry(struct blockcache* cache) {
+	int e = cache->lruTail;
+	struct cacheEntry* entry = &cache->entries[e];
+	if (entry->valid) {
+		if (writeBack(cache, e))
+			return -1;
+		hashRemove(cache, e);
+		entry->valid = 0;
+		cache->stats.evictions++;
+		if (entry->prefetched)
+			cache->stats.prefetchUnused++;
+	}
+
+	return e;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Associa a entrada "e" (livre) ao bloco e a torna a mais recentemente usada
+-----------------------------------------------------------------------------*/
+static void insertEntry(struct blockcache* cache, int e, unsigned int block, int prefetched) {
+	struct cacheEntry* entry = &cache->entries[e];
+	entry->block = block;
+	entry->valid = 1;
+	entry->dirty = 0;
+	entry->prefetched = prefetched;
+	entry->hashNext = cache->buckets[hashBlock(cache, block)];
+	cache->buckets[hashBlock(cache, block)] = e;
+
+	lruUnlink(cache, e);
+	lruPushFront(cache, e);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna a entrada do bloco, carregando-o do disco se "load" e ele nao
+		estiver na cache. A entrada passa a ser a mais recentemente usada.
+
+Retorno:
+		 #: Indice da entrada
+		-1: Erro na leitura/gravacao do disco
+-----------------------------------------------------------------------------*/
+static int getEntry(struct blockcache* cache, unsigned int block, int load) {
+	int e = hashFind(cache, block);
+	if (e != NO_ENTRY) {
+		cache->stats.hits++;
+		// Primeiro acesso a um bloco antecipado: mantem a posicao na lista, para
+		// que uma leitura sequencial nao substitua os antecipados ainda nao lidos
+		if (cache->entries[e].prefetched) {
+			cache->stats.prefetchHits++;
+			cache->entries[e].prefetched = 0;
+			return e;
+		}
+		lruUnlink(cache, e);
+		lruPushFront(cache, e);
+		return e;
+	}
+
+	cache->stats.misses++;
+
+	if ((e = evictEntry(cache)) < 0)
+		return -1;
+
+	if (load && read_sectors_ex(cache->disk, cache->partitionStart + block * cache->sectorsPerBlock, cache->sectorsPerBlock, cache->entries[e].data))
+		return -1;
+
+	insertEntry(cache, e, block, 0);
+
+	return e;
+}
+
+static void freeBlockCache(struct blockcache* cache) {
+	free(cache->entries);
+	free(cache->data);
+	free(cache->buckets);
+	free(cache->flushOrder);
+	free(cache->flushIov);
+	free(cache->flushRuns);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+struct blockcache* openBlockCache(struct disk_image* disk, unsigned int firstSector, int blockSectors, int capacity) {
+	if (blockSectors <= 0)
+		return NULL;
+
+	if (capacity <= 0)
+		capacity = BLOCKCACHE_DEFAULT_SIZE;
+
+	unsigned int numBuckets = 1;
+	while (numBuckets < 2 * (unsigned int)capacity)
+		numBuckets <<= 1;
+
+	struct blockcache* cache = (struct blockcache*)calloc(1, sizeof(struct blockcache));
+	if (cache == NULL)
+		return NULL;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	cache->disk = disk;
+	cache->partitionStart = firstSector;
+	cache->sectorsPerBlock = blockSectors;
+	cache->blockBytes = blockSectors * SECTOR_SIZE;
+
+	cache->entries = (struct cacheEntry*)calloc(capacity, sizeof(struct cacheEntry));
+	cache->data = (unsigned char*)malloc((size_t)capacity * cache->blockBytes);
+	cache->buckets = (int*)malloc(numBuckets * sizeof(int));
+	cache->flushOrder = (struct flushRef*)malloc(capacity * sizeof(struct flushRef));
+	cache->flushIov = (struct sector_iovec*)malloc(capacity * sizeof(struct sector_iovec));
+	cache->flushRuns = (struct sector_run*)malloc(capacity * sizeof(struct sector_run));
+	if (cache->entries == NULL || cache->data == NULL || cache->buckets == NULL || cache->flushOrder == NULL || cache->flushIov == NULL || cache->flushRuns == NULL) {
+		freeBlockCache(cache);
+		return NULL;
+	}
+
+	cache->numEntries = capacity;
+	cache->hashMask = numBuckets - 1;
+	for (unsigned int i = 0; i < numBuckets; i++)
+		cache->buckets[i] = NO_ENTRY;
+
+	cache->lruHead = cache->lruTail = NO_ENTRY;
+	for (int e = 0; e < cache->numEntries; e++) {
+		cache->entries[e].data = &cache->data[(size_t)e * cache->blockBytes];
+		cache->entries[e].hashNext = NO_ENTRY;
+		lruPushFront(cache, e);
+	}
+
+	// Permite ao backend usar a cache como area de E/S registrada, se nenhuma
+	// outra da mesma imagem estiver
+	pthread_mutex_lock(&registerLock);
+	cache->registered = 1;
+	for (struct blockcache* other = openCaches; other != NULL; other = other->nextOpen)
+		if (other->disk == disk && other->registered)
+			cache->registered = 0;
+	if (cache->registered)
+		register_disk_buffer_ex(disk, cache->data, (size_t)capacity * cache->blockBytes);
+	cache->nextOpen = openCaches;
+	openCaches = cache;
+	pthread_mutex_unlock(&registerLock);
+
+	return cache;
+}
+
+int closeBlockCache(struct blockcache* cache) {
+	if (cache == NULL)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	int ret = flushEntries(cache);
+	pthread_mutex_unlock(&cache->lock);
+
+	pthread_mutex_lock(&registerLock);
+	struct blockcache** link = &openCaches;
+	while (*link != cache)
+		link = &(*link)->nextOpen;
+	*link = cache->nextOpen;
+	if (cache->registered)
+		register_disk_buffer_ex(cache->disk, NULL, 0);
+	pthread_mutex_unlock(&registerLock);
+
+	freeBlockCache(cache);
+
+	return ret;
+}
+
+int readBlockCache(struct blockcache* cache, unsigned int block, unsigned int offset, unsigned int size, unsigned char* buffer) {
+	if (cache == NULL || offset + size > cache->blockBytes)
+		return -1;
+
+	pthread_mutex_lock(&cache->lock);
+	int e = getEntry(cache, block, 1);
+	if (e >= 0)
+		memcpy(buffer, cache->entries[e].data + offset, size);
+	pthread_mutex_unlock(&cache->lock);
+
+	return e < 0 ? -1 : 0;
+}
+
+int writeBlockCache(struct blockcache* cache, unsigned int block, unsigned int offset, unsigned int size, unsigned char* buffer) {
+	if (cache == NULL || offset + size > cache->blockBytes)
+		return -1;
+
+	pthread_mutex_lock(&cache->lock);
+	int e = getEntry(cache, block, size != cache->blockBytes);
+	if (e >= 0) {
+		memcpy(cache->entries[e].data + offset, buffer, size);
+		cache->entries[e].dirty = 1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return e < 0 ? -1 : 0;
+}
+
+int prefetchBlockCache(struct blockcache* cache, unsigned int block, int count) {
+	if (cache == NULL || count <= 0)
+		return -1;
+
+	if (count > cache->numEntries / 2)
+		count = cache->numEntries / 2;
+
+	unsigned int* blocks = (unsigned int*)malloc(count * sizeof(unsigned int));
+	if (blocks == NULL)
+		return -1;
+	for (int i = 0; i < count; i++)
+		blocks[i] = block + i;
+
+	int ret = prefetchBlockList(cache, blocks, count);
+	free(blocks);
+
+	return ret;
+}
+
+int prefetchBlockList(struct blockcache* cache, const unsigned int* blocks, int count) {
+	if (cache == NULL || count <= 0)
+		return -1;
+
+	pthread_mutex_lock(&cache->lock);
+	int ret = prefetchEntries(cache, blocks, count);
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+static int prefetchEntries(struct blockcache* cache, const unsigned int* blocks, int count) {
+	struct flushRef* order = cache->flushOrder;
+	struct sector_iovec* iov = cache->flushIov;
+	struct sector_run* runs = cache->flushRuns;
+
+	// Nao substitui mais da metade da cache com blocos ainda nao usados
+	if (count > cache->numEntries / 2)
+		count = cache->numEntries / 2;
+
+	// Seleciona as sequencias de blocos ausentes e as entradas que as recebem
+	int loaded = 0;
+	int nruns = 0;
+	int evictError = 0;
+	for (int i = 0; i < count; i++) {
+		if (hashFind(cache, blocks[i]) != NO_ENTRY)
+			continue;
+
+		int e = evictEntry(cache);
+		if (e < 0) {
+			evictError = 1;
+			break;
+		}
+
+		// Bloco seguinte ao ultimo selecionado: estende a faixa atual
+		if (nruns > 0 && order[loaded - 1].block + 1 == blocks[i])
+			runs[nruns - 1].iovcnt++;
+		else {
+			runs[nruns].sector = cache->partitionStart + blocks[i] * cache->sectorsPerBlock;
+			runs[nruns].iov = &iov[loaded];
+			runs[nruns].iovcnt = 1;
+			nruns++;
+		}
+
+		order[loaded].block = blocks[i];
+		order[loaded].entry = e;
+		iov[loaded].buffer = cache->entries[e].data;
+		iov[loaded].count = cache->sectorsPerBlock;
+		// Fora da lista LRU ate a leitura terminar, para nao ser escolhida de novo
+		lruUnlink(cache, e);
+		loaded++;
+	}
+
+	if (loaded == 0)
+		return evictError ? -1 : 0;
+
+	// Todas as sequencias em um unico lote, direto nas entradas
+	int err = read_sectors_batch_ex(cache->disk, runs, nruns);
+	for (int k = 0; k < loaded; k++) {
+		lruPushFront(cache, order[k].entry);
+		if (!err)
+			insertEntry(cache, order[k].entry, order[k].block, 1);
+	}
+	if (err)
+		return -1;
+
+	cache->stats.prefetched += loaded;
+
+	return loaded;
+}
+
+static int compareBlocks(const void* a, const void* b) {
+	unsigned int blockA = ((const struct flushRef*)a)->block;
+	unsigned int blockB = ((const struct flushRef*)b)->block;
+	return (blockA > blockB) - (blockA < blockB);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Grava os blocos sujos em ordem de bloco; cada sequencia de blocos
+		consecutivos forma uma faixa e todas as faixas sao gravadas em um
+		unico lote (write_sectors_batch_ex)
+-----------------------------------------------------------------------------*/
+static int flushEntries(struct blockcache* cache) {
+	struct cacheEntry* entries = cache->entries;
+	struct flushRef* order = cache->flushOrder;
+	struct sector_iovec* iov = cache->flushIov;
+	struct sector_run* runs = cache->flushRuns;
+
+	int dirty = 0;
+	for (int e = 0; e < cache->numEntries; e++) {
+		if (entries[e].valid && entries[e].dirty) {
+			order[dirty].block = entries[e].block;
+			order[dirty++].entry = e;
+		}
+	}
+
+	qsort(order, dirty, sizeof(struct flushRef), compareBlocks);
+
+	int nruns = 0;
+	int i = 0;
+	while (i < dirty) {
+		runs[nruns].sector = cache->partitionStart + order[i].block * cache->sectorsPerBlock;
+		runs[nruns].iov = &iov[i];
+		int run = 0;
+		do {
+			iov[i + run].buffer = entries[order[i + run].entry].data;
+			iov[i + run].count = cache->sectorsPerBlock;
+			run++;
+		} while (i + run < dirty && order[i + run].block == order[i].block + run);
+		runs[nruns++].iovcnt = run;
+
+		i += run;
+	}
+
+	if (dirty == 0)
+		return 0;
+
+	if (write_sectors_batch_ex(cache->disk, runs, nruns))
+		return -1;
+
+	for (int k = 0; k < dirty; k++)
+		entries[order[k].entry].dirty = 0;
+	cache->stats.writebacks += dirty;
+
+	return 0;
+}
+
+int flushBlockCache(struct blockcache* cache) {
+	if (cache == NULL)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	int ret = flushEntries(cache);
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+void blockCacheStats(struct blockcache* cache, struct blockcache_stats* out) {
+	if (cache == NULL) {
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	*out = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,169 @@
+/*************************************************************************
+
+	Indice em memoria das entradas do diretorio raiz - ver dirindex.h
+
+	Tabela hash com encadeamento: cada bucket aponta para a primeira entrada
+	da sua lista e as entradas removidas vao para uma lista de livres. Quando
+	o numero de entradas alcanca o de buckets, a tabela dobra de tamanho.
+
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "../include/dirindex.h"
+
+#define NO_ENTRY	-1
+
+struct dirindex_entry {
+	struct t2fs_record record;
+	int dirEntry;		/* Indice da entrada no diretorio */
+	int next;			/* Proxima entrada no mesmo bucket (ou na lista de livres) */
+};
+
+
+unsigned int hashDirName(char* name) {
+	unsigned int hash = 2166136261u;
+	for (; *name; name++)
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	return hash;
+}
+
+static unsigned int hashName(struct dirindex* index, char* name) {
+	return hashDirName(name) & (index->capacity - 1);
+}
+
+static int findEntry(struct dirindex* index, char* name) {
+	for (int e = index->buckets[hashName(index, name)]; e != NO_ENTRY; e = index->entries[e].next)
+		if (!strcmp(index->entries[e].record.name, name))
+			return e;
+	return NO_ENTRY;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Dobra a tabela e redistribui as entradas nos novos buckets
+-----------------------------------------------------------------------------*/
+static int growDirIndex(struct dirindex* index) {
+	int newCapacity = index->capacity * 2;
+
+	struct dirindex_entry* newEntries = (struct dirindex_entry*)realloc(index->entries, newCapacity * sizeof(struct dirindex_entry));
+	if (newEntries == NULL)
+		return -1;
+	index->entries = newEntries;
+
+	int* newBuckets = (int*)realloc(index->buckets, newCapacity * sizeof(int));
+	if (newBuckets == NULL)
+		return -1;
+	index->buckets = newBuckets;
+
+	index->capacity = newCapacity;
+	for (int b = 0; b < index->capacity; b++)
+		index->buckets[b] = NO_ENTRY;
+
+	// A tabela so cresce quando nao ha entradas livres: todas as usadas sao validas
+	for (int e = 0; e < index->used; e++) {
+		unsigned int b = hashName(index, index->entries[e].record.name);
+		index->entries[e].next = index->buckets[b];
+		index->buckets[b] = e;
+	}
+
+	return 0;
+}
+
+int openDirIndex(struct dirindex* index, int expected) {
+	closeDirIndex(index);
+
+	int size = 1;
+	while (size < (expected > 0 ? expected : DIRINDEX_DEFAULT_SIZE))
+		size <<= 1;
+
+	index->entries = (struct dirindex_entry*)malloc(size * sizeof(struct dirindex_entry));
+	index->buckets = (int*)malloc(size * sizeof(int));
+	if (index->entries == NULL || index->buckets == NULL) {
+		closeDirIndex(index);
+		return -1;
+	}
+
+	index->capacity = size;
+	for (int b = 0; b < index->capacity; b++)
+		index->buckets[b] = NO_ENTRY;
+
+	return 0;
+}
+
+void closeDirIndex(struct dirindex* index) {
+	free(index->entries);
+	free(index->buckets);
+	index->entries = NULL;
+	index->buckets = NULL;
+	index->capacity = 0;
+	index->used = 0;
+	index->freeList = NO_ENTRY;
+}
+
+int isDirIndexOpen(struct dirindex* index) {
+	return index->entries != NULL;
+}
+
+int insertDirIndex(struct dirindex* index, struct t2fs_record* record, int dirEntry) {
+	if (index->entries == NULL)
+		return -1;
+
+	int e = findEntry(index, record->name);
+	if (e != NO_ENTRY) {
+		index->entries[e].record = *record;
+		index->entries[e].dirEntry = dirEntry;
+		return 0;
+	}
+
+	if (index->freeList != NO_ENTRY) {
+		e = index->freeList;
+		index->freeList = index->entries[e].next;
+	}
+	else {
+		if (index->used == index->capacity && growDirIndex(index))
+			return -1;
+		e = index->used++;
+	}
+
+	index->entries[e].record = *record;
+	index->entries[e].dirEntry = dirEntry;
+
+	unsigned int b = hashName(index, record->name);
+	index->entries[e].next = index->buckets[b];
+	index->buckets[b] = e;
+
+	return 0;
+}
+
+int findDirIndex(struct dirindex* index, char* name, struct t2fs_record* record) {
+	if (index->entries == NULL)
+		return -1;
+
+	int e = findEntry(index, name);
+	if (e == NO_ENTRY)
+		return -1;
+
+	if (record)
+		*record = index->entries[e].record;
+
+	return index->entries[e].dirEntry;
+}
+
+int removeDirIndex(struct dirindex* index, char* name) {
+	if (index->entries == NULL)
+		return -1;
+
+	int* link = &index->buckets[hashName(index, name)];
+	while (*link != NO_ENTRY && strcmp(index->entries[*link].record.name, name))
+		link = &index->entries[*link].next;
+
+	if (*link == NO_ENTRY)
+		return -1;
+
+	int e = *link;
+	*link = index->entries[e].next;
+	index->entries[e].next = index->freeList;
+	index->freeList = e;
+
+	return 0;
+}
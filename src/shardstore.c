@@ -0,0 +1,488 @@
+/*************************************************************************
+
+	Armazenamento de objetos distribuido em particoes - ver shardstore.h
+
+	Cada particao (shard) tem uma fila de requisicoes protegida por um mutex
+	e uma thread de E/S que as executa em ordem com as funcoes _ex do T2FS.
+	Com openstore_ex cada shard eh uma imagem de disco propria, montada com
+	mountimage_ex: as threads de E/S nao dividem o descritor do disco.
+	A particao eh montada sem o modo thread-safe: so a sua thread de E/S a
+	usa. A thread chamadora monta as requisicoes de uma operacao (um lote),
+	coloca cada uma na fila da sua particao e espera o lote terminar.
+
+	Uma requisicao descreve os pedacos do objeto que ficam em um arquivo:
+	"chunk" bytes a cada "stride" bytes de "buffer", ate "size". Para um
+	objeto inteiro chunk == stride == size; para o pedaco K de um objeto
+	dividido em P arquivos, buffer comeca no pedaco K, chunk eh o tamanho do
+	pedaco e stride eh P pedacos.
+
+*************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/t2fs.h"
+#include "../include/shardstore.h"
+#include "../include/dirindex.h"
+
+#define STORE_MAGIC		"T2ST"
+
+enum { OP_WRITE, OP_READ, OP_DELETE };
+
+/* Descritor de um objeto dividido, gravado em "nome.s" na particao home */
+struct storeheader {
+	char magic[4];
+	DWORD size;			/* Bytes do objeto */
+	DWORD stripe;		/* Bytes por pedaco */
+	DWORD pieces;		/* Arquivos de pedacos (nome.0 ate nome.P-1) */
+};
+
+/* Requisicoes de uma operacao; a thread chamadora espera "pending" chegar a zero */
+struct storeBatch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pending;
+};
+
+struct storeRequest {
+	int op;
+	int shard;
+	char name[STORE_MAX_NAME + 3];
+	char* buffer;
+	int size;
+	int chunk;
+	int stride;
+	int result;			/* OP_READ: bytes lidos; demais: 0 (ou erro) */
+	struct storeBatch* batch;
+	struct storeRequest* next;
+};
+
+struct shard {
+	MOUNT2 mount;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct storeRequest* head;
+	struct storeRequest* tail;
+	int stopping;
+};
+
+static struct shard shards[STORE_MAX_SHARDS];
+static int shardCount = 0;
+static int stripeBytes = 0;
+
+
+/*-----------------------------------------------------------------------------
+Funcao:	Executa a requisicao na montagem "mount" (thread de E/S da particao)
+
+Retorno:
+		 #: OP_READ: bytes lidos; demais: 0
+		<0: Erro da funcao do T2FS (-5 se a escrita foi parcial)
+-----------------------------------------------------------------------------*/
+static int runRequest(MOUNT2 mount, struct storeRequest* req) {
+	if (req->op == OP_DELETE)
+		return delete2_ex(mount, req->name);
+
+	FILE2 handle = req->op == OP_WRITE ? create2_ex(mount, req->name) : open2_ex(mount, req->name);
+	if (handle < 0)
+		return handle;
+
+	int total = 0;
+	for (int offset = 0; offset < req->size; offset += req->stride) {
+		int len = req->size - offset < req->chunk ? req->size - offset : req->chunk;
+		int ret = req->op == OP_WRITE ? write2(handle, req->buffer + offset, len) : read2(handle, req->buffer + offset, len);
+		if (ret < 0 || (req->op == OP_WRITE && ret != len)) {
+			total = ret < 0 ? ret : -5;
+			break;
+		}
+		total += ret;
+		if (ret < len)
+			break;
+	}
+
+	close2(handle);
+	return req->op == OP_WRITE && total > 0 ? 0 : total;
+}
+
+static void* shardMain(void* arg) {
+	struct shard* s = (struct shard*)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (s->head == NULL && !s->stopping)
+			pthread_cond_wait(&s->cond, &s->lock);
+		struct storeRequest* req = s->head;
+		if (req != NULL && (s->head = req->next) == NULL)
+			s->tail = NULL;
+		pthread_mutex_unlock(&s->lock);
+
+		if (req == NULL)
+			break;
+
+		req->result = runRequest(s->mount, req);
+
+		struct storeBatch* batch = req->batch;
+		pthread_mutex_lock(&batch->lock);
+		if (--batch->pending == 0)
+			pthread_cond_signal(&batch->cond);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Coloca as "count" requisicoes nas filas das suas particoes e espera
+		todas terminarem. Os resultados ficam em reqs[i].result.
+-----------------------------------------------------------------------------*/
+static void runBatch(struct storeRequest* reqs, int count) {
+	struct storeBatch batch;
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+	batch.pending = count;
+
+	for (int i = 0; i < count; i++) {
+		struct shard* s = &shards[reqs[i].shard];
+		reqs[i].batch = &batch;
+		reqs[i].next = NULL;
+
+		pthread_mutex_lock(&s->lock);
+		if (s->tail != NULL)
+			s->tail->next = &reqs[i];
+		else
+			s->head = &reqs[i];
+		s->tail = &reqs[i];
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending > 0)
+		pthread_cond_wait(&batch.cond, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
+
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+}
+
+static void setRequest(struct storeRequest* req, int op, int shard, char* name, char* suffix, char* buffer, int size) {
+	req->op = op;
+	req->shard = shard;
+	strcpy(req->name, name);
+	strcat(req->name, suffix);
+	req->buffer = buffer;
+	req->size = size;
+	req->chunk = size > 0 ? size : 1;
+	req->stride = req->chunk;
+	req->result = 0;
+}
+
+/* Requisicao do pedaco "piece" de um objeto de "size" bytes dividido em "pieces" arquivos */
+static void setPieceRequest(struct storeRequest* req, int op, int home, char* name, char* buffer, int size, int stripe, int piece, int pieces) {
+	char suffix[3] = { '.', (char)('0' + piece), '\0' };
+	setRequest(req, op, (home + piece) % shardCount, name, suffix, buffer + piece * stripe, size - piece * stripe);
+	req->chunk = stripe;
+	req->stride = stripe * pieces;
+}
+
+/* Bytes do pedaco "piece" gravados no seu arquivo */
+static int pieceBytes(int size, int stripe, int piece, int pieces) {
+	int bytes = 0;
+	for (int offset = piece * stripe; offset < size; offset += stripe * pieces)
+		bytes += size - offset < stripe ? size - offset : stripe;
+	return bytes;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Particao home do objeto: hash do nome (hashDirName)
+-----------------------------------------------------------------------------*/
+static int homeShard(char* name) {
+	return (int)(hashDirName(name) % (unsigned int)shardCount);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Valida o nome do objeto: letras, digitos, '-' e '_' (o '.' separa
+		os sufixos dos arquivos de pedacos)
+
+Retorno:
+		  0: Sucesso
+		-11: Nome incorreto
+-----------------------------------------------------------------------------*/
+static int validateName(char* name) {
+	if (name == NULL)
+		return -11;
+
+	int len = 0;
+	for (; name[len]; len++) {
+		char c = name[len];
+		if (len == STORE_MAX_NAME || !(c == '-' || c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')))
+			return -11;
+	}
+	return len ? 0 : -11;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le o descritor do objeto dividido "name"
+
+Retorno:
+		  0: Sucesso
+		-10: Objeto dividido nao existe
+		-21: Descritor invalido
+-----------------------------------------------------------------------------*/
+static int readHeader(char* name, int home, struct storeheader* header) {
+	struct storeRequest req;
+	setRequest(&req, OP_READ, home, name, ".s", (char*)header, sizeof(*header));
+	runBatch(&req, 1);
+
+	if (req.result < 0)
+		return req.result;
+	if (req.result != sizeof(*header) || memcmp(header->magic, STORE_MAGIC, 4) || header->stripe == 0 ||
+		header->stripe % SECTOR_SIZE || header->pieces == 0 || header->pieces > (DWORD)shardCount)
+		return -21;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Apaga o objeto "name", inteiro ou dividido. O descritor eh apagado
+		antes dos pedacos: um descritor nunca aponta para pedacos apagados.
+
+Retorno:
+		  0: Sucesso
+		-10: Objeto nao existe
+-----------------------------------------------------------------------------*/
+static int removeObject(char* name) {
+	int home = homeShard(name);
+	struct storeRequest reqs[STORE_MAX_SHARDS];
+
+	setRequest(&reqs[0], OP_DELETE, home, name, "", NULL, 0);
+	runBatch(reqs, 1);
+	int ret = reqs[0].result;
+	if (ret && ret != -10)
+		return ret;
+
+	struct storeheader header;
+	int err = readHeader(name, home, &header);
+	if (err == -10)
+		return ret;
+	if (err && err != -21)
+		return err;
+
+	setRequest(&reqs[0], OP_DELETE, home, name, ".s", NULL, 0);
+	runBatch(reqs, 1);
+	if (reqs[0].result)
+		return reqs[0].result;
+
+	// Descritor invalido: os pedacos sao desconhecidos e ficam no disco
+	if (err)
+		return 0;
+
+	int pieces = (int)header.pieces;
+	for (int k = 0; k < pieces; k++)
+		setPieceRequest(&reqs[k], OP_DELETE, home, name, NULL, 0, 0, k, pieces);
+	runBatch(reqs, pieces);
+
+	for (int k = 0; k < pieces; k++)
+		if (reqs[k].result && reqs[k].result != -10)
+			return reqs[k].result;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Abre o conjunto: monta cada shard (a particao partitions[n] do disco
+		padrao ou, com "images", a particao "partition" da imagem images[n])
+		e cria a sua thread de E/S
+
+Retorno: os mesmos de openstore2
+-----------------------------------------------------------------------------*/
+static int openShards(int* partitions, char** images, int partition, int count, STOREOPT2* options) {
+	if (shardCount)
+		return -20;
+	if (count <= 0 || count > STORE_MAX_SHARDS)
+		return -1;
+
+	int stripe = options != NULL && options->stripeBytes ? options->stripeBytes : STORE_STRIPE_DEFAULT;
+	if (stripe < 0 || stripe % SECTOR_SIZE)
+		return -1;
+
+	MOUNTOPT2 mountOptions = { 0 };
+	mountOptions.cacheBlocks = options != NULL ? options->cacheBlocks : 0;
+
+	int ret = 0;
+	int n;
+	for (n = 0; n < count; n++) {
+		struct shard* s = &shards[n];
+		memset(s, 0, sizeof(*s));
+		if (images != NULL)
+			s->mount = mountimage_ex(images[n], partition, &mountOptions);
+		else
+			s->mount = mount_ex(partitions[n], &mountOptions);
+		if (s->mount < 0) {
+			ret = s->mount;
+			break;
+		}
+
+		pthread_mutex_init(&s->lock, NULL);
+		pthread_cond_init(&s->cond, NULL);
+		if (pthread_create(&s->thread, NULL, shardMain, s)) {
+			pthread_cond_destroy(&s->cond);
+			pthread_mutex_destroy(&s->lock);
+			umount_ex(s->mount);
+			ret = -18;
+			break;
+		}
+	}
+
+	shardCount = n;
+	stripeBytes = stripe;
+	if (ret)
+		closestore2();
+
+	return ret;
+}
+
+int openstore2(int* partitions, int count, STOREOPT2* options) {
+	if (partitions == NULL)
+		return -1;
+	return openShards(partitions, NULL, 0, count, options);
+}
+
+int openstore_ex(char** images, int partition, int count, STOREOPT2* options) {
+	if (images == NULL)
+		return -1;
+	for (int n = 0; n < count && n < STORE_MAX_SHARDS; n++)
+		if (images[n] == NULL)
+			return -1;
+	return openShards(NULL, images, partition, count, options);
+}
+
+int closestore2(void) {
+	if (!shardCount)
+		return -15;
+
+	int ret = 0;
+	for (int n = 0; n < shardCount; n++) {
+		struct shard* s = &shards[n];
+		pthread_mutex_lock(&s->lock);
+		s->stopping = 1;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->thread, NULL);
+
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+
+		int err = umount_ex(s->mount);
+		if (err && !ret)
+			ret = err;
+	}
+	shardCount = 0;
+
+	return ret;
+}
+
+int putobj2(char* name, char* buffer, int size, int striped) {
+	if (!shardCount)
+		return -15;
+	if (size < 0 || (buffer == NULL && size > 0))
+		return -1;
+
+	int ret = validateName(name);
+	if (ret)
+		return ret;
+
+	if ((ret = removeObject(name)) && ret != -10)
+		return ret;
+	ret = 0;
+
+	int home = homeShard(name);
+	struct storeRequest reqs[STORE_MAX_SHARDS];
+
+	if (!striped) {
+		setRequest(&reqs[0], OP_WRITE, home, name, "", buffer, size);
+		runBatch(reqs, 1);
+		return reqs[0].result;
+	}
+
+	// Pedacos em paralelo; o descritor so eh gravado depois que todos terminaram
+	int chunks = (size + stripeBytes - 1) / stripeBytes;
+	int pieces = chunks < shardCount ? (chunks ? chunks : 1) : shardCount;
+	for (int k = 0; k < pieces; k++)
+		setPieceRequest(&reqs[k], OP_WRITE, home, name, buffer, size, stripeBytes, k, pieces);
+	runBatch(reqs, pieces);
+
+	for (int k = 0; k < pieces && !ret; k++)
+		ret = reqs[k].result;
+
+	if (!ret) {
+		struct storeheader header;
+		memcpy(header.magic, STORE_MAGIC, 4);
+		header.size = (DWORD)size;
+		header.stripe = (DWORD)stripeBytes;
+		header.pieces = (DWORD)pieces;
+
+		setRequest(&reqs[0], OP_WRITE, home, name, ".s", (char*)&header, sizeof(header));
+		runBatch(reqs, 1);
+		if (!(ret = reqs[0].result))
+			return 0;
+	}
+
+	// Falha: apaga os pedacos ja gravados
+	for (int k = 0; k < pieces; k++)
+		setPieceRequest(&reqs[k], OP_DELETE, home, name, NULL, 0, 0, k, pieces);
+	runBatch(reqs, pieces);
+
+	return ret;
+}
+
+int getobj2(char* name, char* buffer, int size) {
+	if (!shardCount)
+		return -15;
+	if (size < 0 || (buffer == NULL && size > 0))
+		return -1;
+
+	int ret = validateName(name);
+	if (ret)
+		return ret;
+
+	int home = homeShard(name);
+	struct storeRequest reqs[STORE_MAX_SHARDS];
+
+	setRequest(&reqs[0], OP_READ, home, name, "", buffer, size);
+	runBatch(reqs, 1);
+	if (reqs[0].result != -10)
+		return reqs[0].result;
+
+	struct storeheader header;
+	if ((ret = readHeader(name, home, &header)))
+		return ret;
+
+	int bytes = header.size < (DWORD)size ? (int)header.size : size;
+	int stripe = (int)header.stripe;
+	int pieces = (int)header.pieces;
+	int count = 0;
+	for (int k = 0; k < pieces && k * stripe < bytes; k++)
+		setPieceRequest(&reqs[count++], OP_READ, home, name, buffer, bytes, stripe, k, pieces);
+	runBatch(reqs, count);
+
+	for (int k = 0; k < count; k++) {
+		if (reqs[k].result == -10 || (reqs[k].result >= 0 && reqs[k].result != pieceBytes(bytes, stripe, k, pieces)))
+			return -21;
+		if (reqs[k].result < 0)
+			return reqs[k].result;
+	}
+
+	return bytes;
+}
+
+int delobj2(char* name) {
+	if (!shardCount)
+		return -15;
+
+	int ret = validateName(name);
+	if (ret)
+		return ret;
+
+	return removeObject(name);
+}
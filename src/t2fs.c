@@ -14,7 +14,14 @@ Alunos:
 	Thayna Minuzzo
 */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <pthread.h>
 #include "../include/t2fs.h"
+#include "../include/blockcache.h"
+#include "../include/dirindex.h"
+#include "../include/asyncio.h"
 
 /*-----------------------------------------------------------------------------
 -> Habilitar o debug: linha abaixo descomentada.
@@ -25,17 +32,250 @@ Alunos:
 /*-----------------------------------------------------------------------------
 Variaveis globais
 -----------------------------------------------------------------------------*/
-#define MAX_OPENED_FILES	10
 #define MAX_FILENAME		50
+#define FORMAT_ZERO_SECTORS	64	/* setores zerados por escrita no format2 */
+#define T2FS_VERSION		0x7E32	/* Diretorio raiz como vetor de t2fs_record */
+#define T2FS_VERSION_HASHDIR	0x7E33	/* Diretorio raiz com hash extensivel (ver hashDirInsert) */
 
-int partitionMounted = -1;
-int isDirMounted = 0;
-int lastListed = 0;
-int creatingSln = 0;
-
-int fileCounter = 0;
-struct t2fs_record openedFiles[MAX_OPENED_FILES + 1] = { { 0 } };
-DWORD filePointer[MAX_OPENED_FILES + 1] = { 0 };
+/* Contexto de uma particao montada: MBR e superbloco validados uma unica vez no mount */
+struct t2fs_mountinfo {
+	struct t2fs_superbloco superbloco;
+	DWORD setor_inicial;	/* Primeiro setor da particao */
+	DWORD setor_final;		/* Ultimo setor da particao */
+	DWORD inodeAreaSector;	/* Primeiro setor da area de inodes (absoluto) */
+	DWORD inodeAreaBlock;	/* Indice do primeiro bloco da area de inodes */
+	DWORD firstDataBlock;	/* Indice do primeiro bloco da area de dados */
+	int hashedDir;			/* Diretorio raiz no formato T2FS_VERSION_HASHDIR */
+};
+
+/* Diretorio raiz com hash extensivel (T2FS_VERSION_HASHDIR).
+   Bloco logico 0 do inode 0: profundidade global e tabela de 2^globalDepth
+   indices de blocos logicos (buckets). Demais blocos: buckets, cujo primeiro
+   registro (slot 0) eh o cabecalho t2fs_hashbucket e os seguintes guardam
+   as entradas. Um bucket cheio na profundidade maxima ganha blocos de
+   overflow encadeados. */
+struct t2fs_hashdir {
+	DWORD globalDepth;
+	DWORD reserved[3];
+	DWORD table[1];			/* 2^globalDepth entradas */
+};
+
+struct t2fs_hashbucket {
+	DWORD localDepth;
+	DWORD count;			/* Entradas ocupadas: slots 1 ate count */
+	DWORD overflow;			/* Proximo bloco logico da cadeia (0: nenhum) */
+	DWORD reserved[13];
+};
+
+/* Tabela de inodes em memoria (in-core) de cada particao montada.
+   Os inodes dos arquivos abertos ficam presos na tabela (refCount > 0) e a
+   tabela dobra de tamanho quando todas as entradas estao presas;
+   writeInode apenas atualiza a copia em memoria, que eh gravada na cache de
+   blocos no close2, sync2, umount ou quando a entrada for substituida.
+   Alocacao adiada: os blocos logicos a partir de inode.blocksFileSize ate o
+   fim do arquivo (bytesFileSize) ainda nao tem blocos na particao e ficam
+   em "delayed", que so existe enquanto o inode esta preso (refCount > 0) e
+   eh protegido pelo lock do inode (inodeLocks); flushDelayed aloca os
+   blocos de uma vez, contiguos, e grava os dados. Os blocos (de dados e de
+   indirecao) que eles vao ocupar ficam reservados em reservedBlocks da
+   montagem, de modo que a falta de espaco eh detectada no write2. Os
+   alocadores de blocos deixam livres os blocos reservados; apenas
+   flushDelayed, com a reserva do inode em reserveCredit, consome a reserva
+   a medida que aloca os blocos.
+   As entradas validas ficam em listas por numero do inode (inodeBuckets,
+   um bucket por entrada da tabela), de modo que a busca de um inode nao
+   percorre a tabela; apenas a escolha da entrada a substituir, em uma
+   falta, percorre. */
+#define INODE_TABLE_SIZE	32		/* Tamanho inicial (potencia de 2) */
+#define NO_INCORE			-1		/* Fim das listas de inodeBuckets */
+
+struct t2fs_incore {
+	int valid;
+	int dirty;
+	int refCount;			/* Handles abertos que usam o inode */
+	DWORD inodeNumber;
+	DWORD lastUse;			/* Relogio do ultimo acesso (substituicao LRU) */
+	struct t2fs_inode inode;
+	unsigned char* delayed;	/* Blocos escritos e ainda nao alocados (NULL: nenhum) */
+	DWORD delayedBlocks;	/* Blocos com dados em "delayed" */
+	DWORD delayedSize;		/* Blocos alocados em memoria para "delayed" */
+	DWORD delayedReserved;	/* Blocos da particao reservados para "delayed" */
+	int hashNext;			/* Proxima entrada no mesmo bucket (NO_INCORE: fim) */
+};
+
+/* Mapa de blocos de cada arquivo aberto (logico -> fisico): copia de um bloco
+   de indirecao inteiro, com os enderecos dos blocos logicos first ate
+   first + count - 1. Eh preenchido de uma vez na primeira consulta a um bloco
+   desse intervalo, de modo que o bloco de indirecao nao eh relido a cada
+   bloco de dados. Blocos acrescentados ao arquivo ficam fora do intervalo
+   (count eh limitado ao tamanho do arquivo); a liberacao dos blocos de um
+   inode invalida todos os mapas da particao (invalidateBlockMaps incrementa
+   blockMapEpoch), sem tocar nos mapas dos outros handles. */
+struct t2fs_blockmap {
+	DWORD inodeNumber;
+	unsigned int epoch;		/* Valor de blockMapEpoch quando o mapa foi preenchido */
+	DWORD first;
+	DWORD count;			/* 0: mapa vazio */
+	DWORD size;				/* Ponteiros alocados em addrs */
+	DWORD* addrs;			/* Um bloco de ponteiros */
+};
+
+/* Leitura antecipada (read-ahead) de cada arquivo aberto. Uma leitura que
+   comeca no bloco seguinte ao ultimo lido (ou continua nele) eh sequencial:
+   a janela dobra, ate readAheadMax blocos, e os blocos seguintes do arquivo
+   sao carregados na cache de blocos com uma requisicao por sequencia
+   contigua no disco. Um acesso fora de sequencia zera a janela. */
+#define READAHEAD_MIN_WINDOW	4
+#define READAHEAD_DEFAULT_MAX	32
+
+struct t2fs_readahead {
+	DWORD nextBlock;		/* Bloco logico seguinte ao ultimo lido */
+	DWORD window;			/* Blocos lidos antecipadamente (0: acesso aleatorio) */
+	DWORD end;				/* Blocos logicos abaixo deste ja foram antecipados */
+};
+
+/* Buffers do chamador de uma leitura ou escrita (readv2/writev2; read2 e
+   write2 usam um unico buffer). Os bytes do arquivo sao copiados direto
+   entre a cache de blocos e os buffers, na ordem, e um trecho de bloco
+   pode ser dividido entre buffers vizinhos. */
+struct t2fs_iocursor {
+	IOVEC2* iov;
+	int count;
+	int size;				/* Soma dos tamanhos dos buffers */
+	int index;				/* Buffer atual */
+	int offset;				/* Bytes ja usados do buffer atual */
+};
+
+/* Tabela de arquivos abertos, unica para todas as particoes montadas: cada
+   entrada guarda a montagem do arquivo, de onde read2, write2 e close2
+   obtem a particao. As posicoes ficam em segmentos de HANDLE_SEGMENT_SIZE
+   entradas, alocados quando a tabela cresce e nunca movidos nem liberados,
+   de modo que a entrada de um handle eh achada sem lock. As posicoes
+   livres formam uma pilha sem bloqueio (lock-free) em handleFreeList, com
+   um contador de trocas junto ao topo contra o problema ABA; quando ela
+   esta vazia, uma posicao nova eh obtida incrementando handleHighWater.
+   O handle combina a posicao e a geracao da entrada, que muda a cada
+   abertura, de modo que um handle ja fechado nao alcanca o arquivo aberto
+   depois na mesma posicao. A posicao NO_HANDLE nunca eh usada.
+   Os handles abertos ficam tambem em listas por inode (handleBuckets da
+   montagem), para que delete2 encontre os handles do arquivo sem percorrer
+   a tabela. */
+#define HANDLE_SEGMENT_SIZE		64
+#define HANDLE_SEGMENTS			256
+#define HANDLE_TABLE_MAX		(HANDLE_SEGMENT_SIZE * HANDLE_SEGMENTS)
+#define HANDLE_MAX_GENERATION	(0x7FFFFFFF / HANDLE_TABLE_MAX)
+#define HANDLE_BUCKETS			64
+#define NO_HANDLE				0	/* Fim das listas e da pilha de livres */
+
+struct t2fs_mount;
+
+struct t2fs_openfile {
+	pthread_mutex_t lock;	/* Estado do handle (ver modo thread-safe abaixo) */
+	int open;
+	int generation;
+	struct t2fs_mount* mount;	/* Lida sem o lock (ver handleMount) */
+	struct t2fs_record record;
+	DWORD inodeNumber;		/* Copia de record.inodeNumber lida sem o lock */
+	DWORD filePointer;
+	struct t2fs_blockmap map;
+	struct t2fs_readahead readAhead;
+	unsigned int* readAheadBlocks;	/* Blocos da particao de uma leitura antecipada */
+	int readAheadSize;		/* Posicoes alocadas em readAheadBlocks */
+	int nextFree;			/* Posicao abaixo desta na pilha de livres */
+	int prevByInode;		/* Vizinhas na lista de handleBuckets (0: nenhuma) */
+	int nextByInode;
+};
+
+struct t2fs_openfile* handleSegments[HANDLE_SEGMENTS] = { NULL };
+unsigned long long handleFreeList = 0;	/* Trocas << 32 | posicao do topo (0: pilha vazia) */
+int handleHighWater = NO_HANDLE + 1;	/* Posicoes abaixo desta ja foram usadas */
+
+/* Modo thread-safe (MOUNTOPT2.threadSafe), escolhido em cada montagem.
+   Locks de uma montagem, na ordem em que podem ser adquiridos:
+     fsLock          exclusivo em format2_ex, mount, umount e sync2 (sempre,
+                     mesmo sem threadSafe); compartilhado nas demais funcoes
+     dirLock         registros e indice do diretorio raiz e posicao da
+                     listagem: compartilhado em open2, exclusivo nas funcoes
+                     que alteram o diretorio e em opendir2/readdir2/closedir2
+     handleBucketLocks[] listas de handles por inode (handleBuckets)
+     handle->lock    estado do handle (aberto, ponteiro, mapa de blocos e
+                     read-ahead); a ocupacao das posicoes nao usa locks;
+                     pread2/pwrite2 o prendem apenas para validar o handle
+     inodeLocks[]    conteudo do arquivo, escolhido pelo numero do inode:
+                     compartilhado em read2 e pread2 (leitores em paralelo),
+                     exclusivo em write2, pwrite2 e na liberacao dos blocos
+     allocLock       bitmaps (apenas em volta das funcoes de bitmap)
+     inodeTableLock  tabela de inodes em memoria
+   allocLock e inodeTableLock nunca sao presos juntos; dentro deles so eh
+   adquirido o mutex da cache de blocos. Uma funcao publica chamada por outra
+   (copy2 -> open2, sln2 -> delete2) nao adquire de novo fsLock nem dirLock
+   e continua na montagem da funcao externa: a profundidade de cada um eh
+   guardada por thread. Funcoes em montagens diferentes nao compartilham
+   locks. */
+#define INODE_LOCKS		64
+
+/* Particoes montadas. A montagem da particao p de t2fs_disk.dat fica em
+   mounts[p] e o seu identificador (MOUNT2) eh o proprio p; as particoes de
+   outras imagens (mountimage_ex) ocupam as entradas a partir de MAX_MOUNTS,
+   reservadas com diskMountsLock, e cada uma abre a sua imagem (disk), com
+   descritor e backend proprios. Os locks das entradas sao criados
+   uma unica vez (initMounts) e nunca destruidos, de modo que uma funcao
+   pode esperar pela montagem enquanto outra thread a desmonta: ela encontra
+   partition == -1 e retorna -15. As funcoes sem o identificador (create2,
+   open2, ...) usam defaultMount, a particao montada por mount/mount2;
+   identificadores invalidos usam noMount, que nunca eh montada. */
+#define MAX_MOUNTS		8		/* Entradas da tabela de particoes do MBR */
+#define MAX_DISK_MOUNTS	8		/* Particoes de outras imagens montadas ao mesmo tempo */
+
+struct t2fs_mount {
+	MOUNT2 id;				/* Posicao em mounts */
+	int partition;			/* -1: nao montada */
+	struct disk_image* disk;	/* Imagem da particao (NULL: t2fs_disk.dat) */
+	int threadSafe;
+	struct t2fs_mountinfo info;
+	struct blockcache* cache;
+	BITMAP2* bitmaps;
+	struct dirindex dirIndex;
+	int isDirMounted;
+	int lastListed;
+	int readAheadMax;		/* Maior janela, limitada a metade da cache de blocos */
+	int readAheadLimit;		/* Maximo de blocos antecipados por leitura */
+	int delayAllocMax;		/* Blocos de um arquivo mantidos em "delayed" (<= 0: aloca na escrita) */
+	DWORD reservedBlocks;	/* Blocos livres reservados para os dados adiados (allocLock) */
+
+	struct t2fs_incore* inodeTable;
+	int* inodeBuckets;		/* Primeira entrada de cada bucket (inodeTableSize buckets) */
+	int inodeTableSize;
+	DWORD inodeClock;
+	unsigned long long inodeHits;
+	unsigned long long inodeMisses;
+
+	unsigned int blockMapEpoch;
+	unsigned long long blockMapHits;
+	unsigned long long blockMapMisses;
+
+	int handleBuckets[HANDLE_BUCKETS];	/* Primeira posicao de cada lista (0: vazia) */
+
+	pthread_rwlock_t fsLock;
+	pthread_rwlock_t dirLock;
+	pthread_mutex_t handleBucketLocks[HANDLE_BUCKETS];
+	pthread_rwlock_t inodeLocks[INODE_LOCKS];
+	pthread_mutex_t allocLock;
+	pthread_mutex_t inodeTableLock;
+};
+
+struct t2fs_mount mounts[MAX_MOUNTS + MAX_DISK_MOUNTS];
+struct t2fs_mount noMount;
+MOUNT2 defaultMount = -1;
+pthread_once_t mountsOnce = PTHREAD_ONCE_INIT;
+pthread_mutex_t diskMountsLock = PTHREAD_MUTEX_INITIALIZER;	/* Reserva das entradas de outras imagens */
+
+__thread struct t2fs_mount* mnt = NULL;	/* Montagem da funcao publica em andamento */
+__thread int fsDepth = 0;		/* Funcoes publicas em andamento nesta thread */
+__thread int fsLocked = 0;		/* mnt->fsLock preso por esta thread */
+__thread int dirDepth = 0;
+__thread int dirLocked = 0;
+__thread DWORD reserveCredit = 0;	/* Blocos de reservedBlocks que esta thread pode alocar (flushDelayed) */
 
 /*-----------------------------------------------------------------------------
 Funcao:	Informa a identificacao dos desenvolvedores do T2FS.
@@ -58,18 +298,109 @@ static int validateFilename(int len, char* filename);
 static int isPartition(int partition);
 static void partitionSectors(int partition, DWORD* setor_inicial, DWORD* setor_final);
 static int allocBlockOrInode(int isBlock, int partition);
+static int allocBlocks(DWORD goal, int count, int* allocated, int zeroFill);
 static int readSuperblock(int partition, struct t2fs_superbloco* superbloco);
+static int loadPartitionInfo(int partition, struct t2fs_mountinfo* info);
+static int partitionInfo(int partition, struct t2fs_mountinfo* info);
+static int readBlock(DWORD blockAddr, unsigned char* buffer);
+static int writeBlock(DWORD blockAddr, unsigned char* buffer);
 static int writeInode(int index, struct t2fs_inode inode, int partition);
 static int readInode(int index, struct t2fs_inode* inode, int partition);
+static int loadInode(int index, struct t2fs_inode* inode, int partition);
+static int storeInode(int index, struct t2fs_inode inode, int partition);
+static struct t2fs_incore* getIncoreInode(int index, int load);
+static int acquireInode(int index);
+static int releaseInode(int index);
+static int syncInodes(void);
+static void dropInode(int index);
+static unsigned char* delayedData(DWORD inodeNumber, DWORD* blocks);
+static int writeDelayed(DWORD inodeNumber, DWORD offset, struct t2fs_iocursor* io, DWORD size, DWORD blockSizeBytes);
+static int reserveDelayed(DWORD inodeNumber, DWORD allocatedBlocks, DWORD delayedBlocks);
+static void releaseReserved(DWORD blocks);
+static int availableBlocks(DWORD numMax);
+static void consumeReserved(DWORD blocks);
+static DWORD indirectBlocks(DWORD blocks);
+static int flushDelayed(DWORD inodeNumber);
+static int flushAllDelayed(void);
+static void discardDelayed(DWORD inodeNumber);
+static struct t2fs_incore* findIncoreInode(int index);
+static void hashIncoreInode(struct t2fs_incore* entry);
+static void unhashIncoreInode(struct t2fs_incore* entry);
+static struct t2fs_incore* growInodeTable(void);
+static int readDirRecords(struct t2fs_record* records, int max);
+static int compareInodeRefs(const void* a, const void* b);
 static int readBlockFromInode(int index, struct t2fs_inode inode, int sectors_per_block, int partition, unsigned char* buffer);
+static int blockAddrFromInode(int index, struct t2fs_inode* inode, int sectors_per_block);
+static int mapBlock(struct t2fs_blockmap* map, DWORD inodeNumber, int index, struct t2fs_inode* inode);
+static void invalidateBlockMaps(void);
+static void readAheadFile(struct t2fs_openfile* file, DWORD firstBlk, DWORD lastBlk, struct t2fs_inode* inode);
+static void fillReadAhead(struct t2fs_openfile* file, DWORD from, DWORD lastBlk, struct t2fs_inode* inode);
 static int readDirEntry(int index, struct t2fs_record* record);
 static int findFileByName(char* filename, struct t2fs_record* record);
+static int buildDirIndex(void);
 static int addBlockOnInode(struct t2fs_inode* inode, int sectors_per_block, DWORD blockID);
 static int createNewFile(char* filename, struct t2fs_record* record, int type);
 static int writeDirEntry(struct t2fs_record record);
 static int disallocBlockOrInode(int isBlock, int partition, int index);
 static int clearInodeBlocks(struct t2fs_inode* inode, int sectors_per_block);
 static int removeDirEntry(int index, struct t2fs_record record);
+static int readDirBlock(DWORD logical, unsigned char* buffer);
+static int writeDirBlock(DWORD logical, unsigned char* buffer);
+static int appendDirBlock(struct t2fs_inode* dirInode);
+static DWORD hashDirMaxDepth(void);
+static int hashDirLookup(char* filename, struct t2fs_record* record);
+static int hashDirInsert(struct t2fs_record record);
+static int hashDirRemove(int position);
+static int hashDirNext(int position, struct t2fs_record* record);
+static int readBlockPart(DWORD blockAddr, DWORD offset, DWORD size, unsigned char* buffer);
+static int formatPartition(int partition, int sectors_per_block, int flags);
+static int mountPartition(int partition, MOUNTOPT2* options);
+static int umountPartition(void);
+static FILE2 createFile(char* filename);
+static int deleteFile(char* filename);
+static FILE2 openFile(char* filename);
+static int closeFile(FILE2 handle);
+static int readFile(struct t2fs_openfile* file, DWORD inodeNumber, DWORD position, struct t2fs_iocursor* io);
+static int writeFile(struct t2fs_blockmap* map, DWORD inodeNumber, DWORD position, struct t2fs_iocursor* io);
+static int writeFileAt(DWORD inodeNumber, DWORD position, struct t2fs_iocursor* io);
+static int writeBlocks(struct t2fs_blockmap* map, DWORD inodeNumber, struct t2fs_inode* inode, DWORD position, struct t2fs_iocursor* io, int size);
+static int ioInit(struct t2fs_iocursor* io, IOVEC2* iov, int count);
+static char* ioNext(struct t2fs_iocursor* io, DWORD max, DWORD* size);
+static void ioGather(struct t2fs_iocursor* io, unsigned char* dest, DWORD size);
+static void ioScatter(struct t2fs_iocursor* io, unsigned char* src, DWORD size);
+static int copyFile(char* src, char* dst);
+static int readNextEntry(DIRENT2* dentry);
+static int readEntries(DIRENT2* out, int max);
+static int softLink(char* linkname, char* filename);
+static int hardLink(char* linkname, char* filename);
+static FILE2 allocHandle(struct t2fs_record record);
+static struct t2fs_openfile* handleSlot(int index, int create);
+static struct t2fs_openfile* findHandle(FILE2 handle);
+static int popFreeHandle(void);
+static void pushFreeHandle(int index);
+static void linkHandle(int index, struct t2fs_openfile* file);
+static void unlinkHandle(int index, struct t2fs_openfile* file);
+static void closeAllFiles(void);
+static int lockFileHandle(FILE2 handle, int exclusive, struct t2fs_openfile** file);
+static void unlockFileHandle(struct t2fs_openfile* file);
+static int lockHandleInode(FILE2 handle, int exclusive, DWORD* inodeNumber);
+static void initMounts(void);
+static struct t2fs_mount* mountById(MOUNT2 mount);
+static struct t2fs_mount* partitionMount(int partition);
+static int claimDiskMount(char* image, struct t2fs_mount** mount);
+static void releaseDiskMount(struct t2fs_mount* mount);
+static MOUNT2 getDefaultMount(void);
+static struct t2fs_mount* handleMount(FILE2 handle);
+static void drainHandle(struct t2fs_mount* mount, FILE2 handle);
+static void lockFs(struct t2fs_mount* mount, int exclusive);
+static void unlockFs(void);
+static void lockDir(int exclusive);
+static void unlockDir(void);
+static void lockMutex(pthread_mutex_t* mutex);
+static void unlockMutex(pthread_mutex_t* mutex);
+static void lockRw(pthread_rwlock_t* lock, int exclusive);
+static void unlockRw(pthread_rwlock_t* lock);
+static pthread_rwlock_t* inodeLock(DWORD inodeNumber);
 
 
 
@@ -87,6 +418,52 @@ Retorno:
 		-5: Erro na escrita no disco
 -----------------------------------------------------------------------------*/
 int format2(int partition, int sectors_per_block) {
+	return format2_ex(partition, sectors_per_block, 0);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Formata a particao com as opcoes indicadas em "flags" (FORMAT2_xxx).
+		Com FORMAT2_HASHDIR o diretorio raiz eh criado com hash extensivel:
+		bloco 0 com a tabela de buckets e bloco 1 com o primeiro bucket.
+
+Retorno: os mesmos de format2
+-----------------------------------------------------------------------------*/
+int format2_ex(int partition, int sectors_per_block, int flags) {
+	drainAsync();
+	lockFs(partitionMount(partition), 1);
+
+	int ret = formatPartition(partition, sectors_per_block, flags);
+
+	unlockFs();
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Formata a particao "partition" do arquivo de disco "image", como
+		format2_ex. A imagem fica aberta apenas durante a formatacao.
+
+Retorno:
+		  0: Sucesso
+		 -2: Erro na abertura da imagem
+		-22: Limite de imagens abertas excedido
+		demais: os mesmos de format2
+-----------------------------------------------------------------------------*/
+int formatimage_ex(char* image, int partition, int sectors_per_block, int flags) {
+	drainAsync();
+	struct t2fs_mount* mount = NULL;
+	int ret = claimDiskMount(image, &mount);
+	if (ret)
+		return ret;
+
+	lockFs(mount, 1);
+	ret = formatPartition(partition, sectors_per_block, flags);
+	unlockFs();
+
+	releaseDiskMount(mount);
+	return ret;
+}
+
+static int formatPartition(int partition, int sectors_per_block, int flags) {
 	if (partition < 0 || sectors_per_block <= 0) {
 		DEBUG("#ERRO format2: parametros invalidos\n");
 		return -1;
@@ -97,9 +474,9 @@ int format2(int partition, int sectors_per_block) {
 	if ((ret = isPartition(partition)))
 		return ret;
 
-	// Testar se a particao ta montada, se tiver, desmontar ela
-	if (partition == partitionMounted)
-		umount();
+	// Testar se a particao ta montada, se tiver, desmontar ela (mnt eh a montagem da particao)
+	if (mnt->partition != -1)
+		umountPartition();
 
 	DWORD setor_inicial = 0;
 	DWORD setor_final = 0; 
@@ -128,7 +505,7 @@ int format2(int partition, int sectors_per_block) {
 	// cria novo superbloco e limpa bitmap de blocos e inodes
 	struct t2fs_superbloco newSuperbloco = {
 		.id = {'T', '2', 'F', 'S'},
-		.version = 0x7E32,
+		.version = (flags & FORMAT2_HASHDIR) ? T2FS_VERSION_HASHDIR : T2FS_VERSION,
 		.superblockSize = 1,
 		.freeBlocksBitmapSize = freeBlocksBitmapSize, /** Numero de blocos do bitmap de blocos de dados */
 		.freeInodeBitmapSize = freeInodeBitmapSize,   /** Numero de blocos do bitmap de i-nodes */
@@ -146,29 +523,42 @@ int format2(int partition, int sectors_per_block) {
 	unsigned char* superblocoArea = (unsigned char*)calloc((size_t)(SECTOR_SIZE * sectors_per_block), sizeof(unsigned char));
 	memcpy(superblocoArea, &newSuperbloco, sizeof(struct t2fs_superbloco));
 
-	for (DWORD i = 0; i < sectors_per_block; i++)
-		if (write_sector(setor_inicial + i, &superblocoArea[i * SECTOR_SIZE])) {
-			DEBUG("#ERRO format2: erro na escrita do superbloco\n");
-			return -5;
-		}
+	if (write_sectors_ex(mnt->disk, setor_inicial, sectors_per_block, superblocoArea)) {
+		DEBUG("#ERRO format2: erro na escrita do superbloco\n");
+		return -5;
+	}
 
 	free(superblocoArea);
 
-	// Alocar e zerar area de memoria
-	unsigned char* emptySector = (unsigned char*)calloc(SECTOR_SIZE, sizeof(unsigned char));
+	// Alocar e zerar area de memoria (varios setores por escrita)
+	DWORD zeroSectors = MIN(FORMAT_ZERO_SECTORS, qtde_setores);
+	unsigned char* emptyArea = (unsigned char*)calloc(zeroSectors * SECTOR_SIZE, sizeof(unsigned char));
 
 	// Zera o restante da particao
-	for (DWORD i = 0; i < qtde_setores - sectors_per_block; i++)
-		if (write_sector(setor_inicial + sectors_per_block + i, emptySector)) {
+	for (DWORD i = sectors_per_block; i < qtde_setores; i += zeroSectors)
+		if (write_sectors_ex(mnt->disk, setor_inicial + i, MIN(zeroSectors, qtde_setores - i), emptyArea)) {
 			DEBUG("#ERRO format2: erro ao apagar dados da particao\n");
 			return -5;
 		}
 
-	free(emptySector);
+	free(emptyArea);
+
+	// Bitmaps (zerados) da particao formatada, usados apenas ate o fim do format2
+	BITMAP2* bitmaps = openBitmap2(mnt->disk, setor_inicial);
+	if (bitmaps == NULL) {
+		DEBUG("#ERRO format2: erro ao abrir os bitmaps\n");
+		return -7;
+	}
+
 	// Criar o Diretorio raiz
 
 	// Alocar 1 inode pra salvar o diretorio raiz
-	int inodeIndex = allocBlockOrInode(0, partition);
+	int inodeIndex = allocBitmap2(bitmaps, BITMAP_INODE, inodeAreaSize * sectors_per_block * (SECTOR_SIZE / sizeof(struct t2fs_inode)));
+	if (inodeIndex < 0) {
+		DEBUG("#ERRO format2: erro ao alocar o inode do diretorio\n");
+		closeBitmap2(bitmaps);
+		return -7;
+	}
 	
 	// Gera a estrutura do inode e escreve no disco
 	struct t2fs_inode inodeRoot = {
@@ -180,46 +570,334 @@ int format2(int partition, int sectors_per_block) {
 		.RefCounter = 0
 	};
 
-	if ((ret = writeInode(inodeIndex, inodeRoot, partition)))
+	// Diretorio com hash: os dois primeiros blocos de dados (ja zerados) formam
+	// a tabela, com profundidade 0 e um unico bucket, e o bucket vazio
+	if (flags & FORMAT2_HASHDIR) {
+		DWORD firstDataBlock = 1 + freeBlocksBitmapSize + freeInodeBitmapSize + inodeAreaSize;
+		DWORD blockSizeBytes = SECTOR_SIZE * sectors_per_block;
+
+		if (setBitmap2(bitmaps, BITMAP_DADOS, 0, 1) || setBitmap2(bitmaps, BITMAP_DADOS, 1, 1)) {
+			DEBUG("#ERRO format2: erro ao alterar bitmap\n");
+			closeBitmap2(bitmaps);
+			return -7;
+		}
+
+		unsigned char* header = (unsigned char*)calloc(blockSizeBytes, sizeof(unsigned char));
+		((struct t2fs_hashdir*)header)->table[0] = 1;
+		if (write_sectors_ex(mnt->disk, setor_inicial + firstDataBlock * sectors_per_block, sectors_per_block, header)) {
+			DEBUG("#ERRO format2: erro na escrita do diretorio\n");
+			free(header);
+			closeBitmap2(bitmaps);
+			return -5;
+		}
+		free(header);
+
+		inodeRoot.blocksFileSize = 2;
+		inodeRoot.bytesFileSize = 2 * blockSizeBytes;
+		inodeRoot.dataPtr[0] = firstDataBlock;
+		inodeRoot.dataPtr[1] = firstDataBlock + 1;
+	}
+
+	if ((ret = writeInode(inodeIndex, inodeRoot, partition))) {
+		closeBitmap2(bitmaps);
 		return ret;
+	}
+
+	if (closeBitmap2(bitmaps)) {
+		DEBUG("#ERRO format2: erro ao gravar os bitmaps\n");
+		return -5;
+	}
 
 	return 0;
 }
 
 /*-----------------------------------------------------------------------------
-Funcao:	Monta a particao indicada por "partition" no diretorio raiz
+Funcao:	Monta a particao indicada por "partition" no diretorio raiz.
+		O MBR e o superbloco sao lidos e validados apenas aqui; as demais
+		funcoes usam o contexto guardado na montagem ate o umount/format2.
+-----------------------------------------------------------------------------*/
+int mount(int partition) {
+	return mount2(partition, NULL);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Monta a particao com as opcoes indicadas (NULL: valores padrao) e a
+		torna a particao das funcoes sem identificador de montagem. A
+		particao montada antes por mount/mount2, se for outra, eh desmontada.
 
 Retorno:
-		 0: Sucesso
-		-2: Erro na leitura do setor zero do disco
-		-3: Numero da particao invalido
-		-6: Checksum invalido
+		  0: Sucesso
+		 -2: Erro na leitura do setor zero do disco
+		 -3: Numero da particao invalido
+		 -6: Checksum invalido
+		 -7: Erro ao carregar os bitmaps
+		-17: Erro na alocacao de memoria
 -----------------------------------------------------------------------------*/
-int mount(int partition) {
+int mount2(int partition, MOUNTOPT2* options) {
+	closeAsync();
+	lockFs(partitionMount(partition), 1);
+
+	int ret = mountPartition(partition, options);
+
+	unlockFs();
+	if (ret)
+		return ret;
+
+	MOUNT2 previous = __atomic_exchange_n(&defaultMount, partition, __ATOMIC_ACQ_REL);
+	if (previous != -1 && previous != partition)
+		umount_ex(previous);
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Monta a particao sem alterar as demais montagens. O identificador
+		retornado eh usado nas funcoes _ex.
+
+Retorno:
+		  #: Identificador da montagem (o numero da particao)
+		-20: Particao ja montada
+		demais: os mesmos de mount2
+-----------------------------------------------------------------------------*/
+MOUNT2 mount_ex(int partition, MOUNTOPT2* options) {
+	drainAsync();
+	lockFs(partitionMount(partition), 1);
+
+	int ret = -20;
+	if (mnt->partition == -1)
+		ret = mountPartition(partition, options);
+	else
+		DEBUG("#ERRO mount_ex: particao ja montada\n");
+
+	unlockFs();
+	return ret ? ret : partition;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Monta a particao "partition" do arquivo de disco "image", como
+		mount_ex. A imagem eh aberta com o seu proprio descritor (e anel do
+		io_uring), de modo que montagens de imagens diferentes nao dividem
+		o acesso ao disco; ela eh fechada no umount_ex.
+
+Retorno:
+		  #: Identificador da montagem (MAX_MOUNTS ou maior)
+		 -2: Erro na abertura da imagem
+		-22: Limite de imagens montadas excedido
+		demais: os mesmos de mount2
+-----------------------------------------------------------------------------*/
+MOUNT2 mountimage_ex(char* image, int partition, MOUNTOPT2* options) {
+	drainAsync();
+	struct t2fs_mount* mount = NULL;
+	MOUNT2 ret = claimDiskMount(image, &mount);
+	if (ret)
+		return ret;
+
+	lockFs(mount, 1);
+	ret = mountPartition(partition, options);
+	unlockFs();
+
+	if (ret) {
+		releaseDiskMount(mount);
+		return ret;
+	}
+	return mount->id;
+}
+
+static int mountPartition(int partition, MOUNTOPT2* options) {
+	if (mnt == &noMount) {
+		DEBUG("#ERRO mount2: particao invalida\n");
+		return -3;
+	}
 
 	int ret = 0;
-	if((ret = readSuperblock(partition, NULL)))
+	struct t2fs_mountinfo info;
+	if ((ret = loadPartitionInfo(partition, &info)))
+		return ret;
+
+	// Particao ja montada: grava os inodes e blocos da montagem anterior
+	if (mnt->partition != -1 && (ret = umountPartition()))
 		return ret;
 
-	partitionMounted = partition;
+	int cacheBlocks = options ? options->cacheBlocks : 0;
+	if (cacheBlocks <= 0)
+		cacheBlocks = BLOCKCACHE_DEFAULT_SIZE;
+
+	// Os blocos antecipados nao devem substituir os que serao lidos em seguida
+	mnt->readAheadLimit = cacheBlocks / 2;
+	mnt->readAheadMax = (options && options->readAheadMax) ? options->readAheadMax : READAHEAD_DEFAULT_MAX;
+	mnt->readAheadMax = MIN(mnt->readAheadMax, mnt->readAheadLimit);
+	mnt->delayAllocMax = (options && options->delayAllocMax) ? options->delayAllocMax : cacheBlocks / 2;
+	mnt->reservedBlocks = 0;
+
+	if ((mnt->cache = openBlockCache(mnt->disk, info.setor_inicial, info.superbloco.blockSize, cacheBlocks)) == NULL) {
+		DEBUG("#ERRO mount2: erro ao criar a cache de blocos\n");
+		return -17;
+	}
 
-	for (FILE2 i = 0; i < MAX_OPENED_FILES; i++)
-		close2(i);
+	// Com os bitmaps ja carregados, as funcoes de alocacao nao leem o disco
+	// fora da cache de blocos
+	if ((mnt->bitmaps = openBitmap2(mnt->disk, info.setor_inicial)) == NULL) {
+		DEBUG("#ERRO mount2: erro ao abrir os bitmaps\n");
+		closeBlockCache(mnt->cache);
+		mnt->cache = NULL;
+		return -7;
+	}
 
+	mnt->info = info;
+	mnt->isDirMounted = 0;
+	mnt->lastListed = 0;
+	mnt->inodeHits = 0;
+	mnt->inodeMisses = 0;
+	mnt->blockMapHits = 0;
+	mnt->blockMapMisses = 0;
+	mnt->threadSafe = options ? options->threadSafe : 0;
+	mnt->partition = partition;
 
 	return 0;
 }
 
 /*-----------------------------------------------------------------------------
-Funcao:	Desmonta a particao atualmente montada, liberando o ponto de montagem.
+Funcao:	Desmonta a particao montada por mount/mount2, liberando o ponto de
+		montagem. Forca a gravacao em disco dos setores escritos (flush_disk_ex).
+
+Retorno:
+		 0: Sucesso
+		-5: Erro na escrita no disco
 -----------------------------------------------------------------------------*/
 int umount(void) {
+	closeAsync();
+	lockFs(mountById(__atomic_exchange_n(&defaultMount, -1, __ATOMIC_ACQ_REL)), 1);
+
+	int ret = umountPartition();
+
+	unlockFs();
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Desmonta a montagem "mount" (retornada por mount_ex), fechando apenas
+		os seus handles
+
+Retorno:
+		  0: Sucesso
+		 -5: Erro na escrita no disco
+		-15: Particao nao montada
+-----------------------------------------------------------------------------*/
+int umount_ex(MOUNT2 mount) {
+	drainAsync();
+	lockFs(mountById(mount), 1);
+
+	int ret = -15;
+	if (mnt->partition != -1) {
+		ret = umountPartition();
+		// Particao de outra imagem: a imagem eh fechada e a entrada liberada
+		if (mnt->id >= MAX_MOUNTS)
+			releaseDiskMount(mnt);
+	}
+	else
+		DEBUG("#ERRO umount_ex: particao nao montada\n");
+
+	unlockFs();
+	return ret;
+}
+
+static int umountPartition(void) {
+	closeAllFiles();
+
+	int ret = syncInodes();
+	if (mnt->inodeTable) {
+		for (int i = 0; i < mnt->inodeTableSize; i++)
+			free(mnt->inodeTable[i].delayed);
+		memset(mnt->inodeTable, 0, mnt->inodeTableSize * sizeof(struct t2fs_incore));
+		for (int b = 0; b < mnt->inodeTableSize; b++)
+			mnt->inodeBuckets[b] = NO_INCORE;
+	}
+
+	closeDirIndex(&mnt->dirIndex);
+	ret |= closeBitmap2(mnt->bitmaps);
+	ret |= closeBlockCache(mnt->cache);
+	mnt->bitmaps = NULL;
+	mnt->cache = NULL;
+
+	// A montagem deixa de ser a padrao (se for) para as funcoes sem identificador
+	MOUNT2 id = mnt->id;
+	if (mnt->partition != -1)
+		__atomic_compare_exchange_n(&defaultMount, &id, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	mnt->partition = -1;
+
+	if (ret || flush_disk_ex(mnt->disk)) {
+		DEBUG("#ERRO umount: erro ao gravar o disco\n");
+		return -5;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Grava no disco os blocos modificados que estao na cache
+
+Retorno:
+		  0: Sucesso
+		 -5: Erro na escrita no disco
+		-15: Particao nao montada
+-----------------------------------------------------------------------------*/
+int sync2(void) {
+	return sync2_ex(getDefaultMount());
+}
 
-	for (FILE2 i = 0; i < MAX_OPENED_FILES; i++)
-		close2(i);
+int sync2_ex(MOUNT2 mount) {
+	drainAsync();
+	lockFs(mountById(mount), 1);
 
-	partitionMounted = -1;
+	int ret = 0;
+	if (mnt->partition == -1) {
+		DEBUG("#ERRO sync2: particao nao montada\n");
+		ret = -15;
+	}
+	else if (flushAllDelayed() || syncInodes() || flushBitmap2(mnt->bitmaps) || flushBlockCache(mnt->cache) || flush_disk_ex(mnt->disk)) {
+		DEBUG("#ERRO sync2: erro ao gravar o disco\n");
+		ret = -5;
+	}
+
+	unlockFs();
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Copia os contadores de desempenho da particao montada para "stats"
+-----------------------------------------------------------------------------*/
+int stats2(STATS2* stats) {
+	return stats2_ex(getDefaultMount(), stats);
+}
+
+int stats2_ex(MOUNT2 mount, STATS2* stats) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+
+	if (mnt->partition == -1) {
+		DEBUG("#ERRO stats2: particao nao montada\n");
+		unlockFs();
+		return -15;
+	}
 
+	struct blockcache_stats cache;
+	blockCacheStats(mnt->cache, &cache);
+
+	stats->cacheHits = cache.hits;
+	stats->cacheMisses = cache.misses;
+	stats->cacheWritebacks = cache.writebacks;
+	stats->cacheEvictions = cache.evictions;
+	lockMutex(&mnt->inodeTableLock);
+	stats->inodeHits = mnt->inodeHits;
+	stats->inodeMisses = mnt->inodeMisses;
+	unlockMutex(&mnt->inodeTableLock);
+	stats->blockMapHits = __atomic_load_n(&mnt->blockMapHits, __ATOMIC_RELAXED);
+	stats->blockMapMisses = __atomic_load_n(&mnt->blockMapMisses, __ATOMIC_RELAXED);
+	stats->readAheadBlocks = cache.prefetched;
+	stats->readAheadHits = cache.prefetchHits;
+	stats->readAheadMisses = cache.prefetchUnused;
+
+	unlockFs();
 	return 0;
 }
 
@@ -234,16 +912,27 @@ Retorno:
 		-11: Filename muito longo
 -----------------------------------------------------------------------------*/
 FILE2 create2(char* filename) {
-	if (partitionMounted == -1) {
+	return create2_ex(getDefaultMount(), filename);
+}
+
+FILE2 create2_ex(MOUNT2 mount, char* filename) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+	lockDir(1);
+
+	FILE2 ret = createFile(filename);
+
+	unlockDir();
+	unlockFs();
+	return ret;
+}
+
+static FILE2 createFile(char* filename) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO create2: particao ou diretorio nao montado\n");
 		return -15;
 	}
 
-	if(fileCounter >= MAX_OPENED_FILES) {
-		DEBUG("#ERRO create2: limite de arquivos excedido\n");
-		return -13;
-	}
-
 	char filenameCpy[MAX_FILENAME + 1];
 	strcpy(filenameCpy, filename);
 
@@ -266,34 +955,58 @@ FILE2 create2(char* filename) {
 		return ret;
 	}
 	else {
+		// Leitores do arquivo em outros handles esperam o fim da liberacao dos blocos
+		lockRw(inodeLock(record.inodeNumber), 1);
+
 		struct t2fs_inode inode;
-		readInode(record.inodeNumber, &inode, partitionMounted);
+		readInode(record.inodeNumber, &inode, mnt->partition);
 
 		struct t2fs_superbloco superbloco;
-		readSuperblock(partitionMounted, &superbloco);
+		readSuperblock(mnt->partition, &superbloco);
 		clearInodeBlocks(&inode, superbloco.blockSize);
+		invalidateBlockMaps();
+		discardDelayed(record.inodeNumber);
 		
-		writeInode(record.inodeNumber, inode, partitionMounted);
+		writeInode(record.inodeNumber, inode, mnt->partition);
+
+		unlockRw(inodeLock(record.inodeNumber));
 	}
 
-	FILE2 freeHandle = 0;
-	for (freeHandle = 0; freeHandle < MAX_OPENED_FILES; freeHandle++) {
-		if (openedFiles[freeHandle].TypeVal == TYPEVAL_INVALIDO) {
-			openedFiles[freeHandle] = record;
-			filePointer[freeHandle] = 0;
-			fileCounter++;
-			break;
-		}
+	if ((ret = acquireInode(record.inodeNumber))) {
+		DEBUG("#ERRO create2: erro ao carregar o inode\n");
+		return ret;
+	}
+
+	FILE2 handle = allocHandle(record);
+	if (handle < 0) {
+		DEBUG("#ERRO create2: limite de arquivos excedido\n");
+		releaseInode(record.inodeNumber);
 	}
 
-	return freeHandle;
+	return handle;
 }
 
 /*-----------------------------------------------------------------------------
 Funcao:	Funcao usada para remover (apagar) um arquivo do disco.
 -----------------------------------------------------------------------------*/
 int delete2(char* filename) {
-	if (partitionMounted == -1) {
+	return delete2_ex(getDefaultMount(), filename);
+}
+
+int delete2_ex(MOUNT2 mount, char* filename) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+	lockDir(1);
+
+	int ret = deleteFile(filename);
+
+	unlockDir();
+	unlockFs();
+	return ret;
+}
+
+static int deleteFile(char* filename) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO delete2: particao ou diretorio nao montado\n");
 		return -15;
 	}
@@ -315,31 +1028,59 @@ int delete2(char* filename) {
 	}
 	recordIndex--; //findFileByName retorna index + 1, portanto, eh preciso subtrair 1 do indice
 
-	// Fecha todos os handles desse arquivo
-	for (int i = 0; i < MAX_OPENED_FILES; i++) {
-		if (!strcmp(record.name, openedFiles[i].name)) {
-			fileCounter--;
-			openedFiles[i].TypeVal = TYPEVAL_INVALIDO;
-			filePointer[i] = 0;
+	// Fecha todos os handles desse arquivo: apenas a lista do inode eh percorrida e
+	// os nomes so sao comparados entre os handles do inode (hard links)
+	int bucket = record.inodeNumber % HANDLE_BUCKETS;
+	lockMutex(&mnt->handleBucketLocks[bucket]);
+	for (int i = mnt->handleBuckets[bucket]; i != 0; ) {
+		struct t2fs_openfile* file = handleSlot(i, 0);
+		int next = file->nextByInode;
+
+		if (file->inodeNumber == record.inodeNumber) {
+			lockMutex(&file->lock);
+			int match = !strcmp(record.name, file->record.name);
+			if (match) {
+				file->open = 0;
+				unlinkHandle(i, file);
+			}
+			unlockMutex(&file->lock);
+
+			if (match) {
+				releaseInode(record.inodeNumber);
+				pushFreeHandle(i);
+			}
 		}
+
+		i = next;
 	}
+	unlockMutex(&mnt->handleBucketLocks[bucket]);
+
+	lockRw(inodeLock(record.inodeNumber), 1);
 
 	struct t2fs_inode inode;
-	readInode(record.inodeNumber, &inode, partitionMounted);
+	readInode(record.inodeNumber, &inode, mnt->partition);
 	struct t2fs_superbloco superbloco;
-	readSuperblock(partitionMounted, &superbloco);
+	readSuperblock(mnt->partition, &superbloco);
+
+	// Os dados em memoria continuam no arquivo se ele tiver outro nome (hard link)
+	if (inode.RefCounter && flushDelayed(record.inodeNumber) == 0)
+		readInode(record.inodeNumber, &inode, mnt->partition);
 
 	if (inode.RefCounter) {
 		inode.RefCounter--;
-		writeInode(record.inodeNumber, inode, partitionMounted);
+		writeInode(record.inodeNumber, inode, mnt->partition);
 		removeDirEntry(recordIndex, record);
 	}
 	else {
 		clearInodeBlocks(&inode, superbloco.blockSize);
+		invalidateBlockMaps();
 		removeDirEntry(recordIndex, record);
-		disallocBlockOrInode(0, partitionMounted, record.inodeNumber);
+		disallocBlockOrInode(0, mnt->partition, record.inodeNumber);
+		dropInode(record.inodeNumber);
 	}
 
+	unlockRw(inodeLock(record.inodeNumber));
+
 	return 0;
 }
 
@@ -347,16 +1088,27 @@ int delete2(char* filename) {
 Funcao:	Funcao que abre um arquivo existente no disco.
 -----------------------------------------------------------------------------*/
 FILE2 open2(char* filename) {
-	if (partitionMounted == -1) {
+	return open2_ex(getDefaultMount(), filename);
+}
+
+FILE2 open2_ex(MOUNT2 mount, char* filename) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+	lockDir(0);
+
+	FILE2 ret = openFile(filename);
+
+	unlockDir();
+	unlockFs();
+	return ret;
+}
+
+static FILE2 openFile(char* filename) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO open2: particao ou diretorio nao montado\n");
 		return -15;
 	}
 
-	if (fileCounter >= MAX_OPENED_FILES) {
-		DEBUG("#ERRO open2: limite de arquivos excedido\n");
-		return -13;
-	}
-
 	char filenameCpy[MAX_FILENAME + 1];
 	strcpy(filenameCpy, filename);
 
@@ -374,12 +1126,12 @@ FILE2 open2(char* filename) {
 
 	if (record.TypeVal == TYPEVAL_LINK) {
 		struct t2fs_inode inode;
-		readInode(record.inodeNumber, &inode, partitionMounted);
+		readInode(record.inodeNumber, &inode, mnt->partition);
 		struct t2fs_superbloco superbloco;
-		readSuperblock(partitionMounted, &superbloco);
+		readSuperblock(mnt->partition, &superbloco);
 
 		unsigned char* tmpBuffer = (unsigned char*)calloc(superbloco.blockSize * SECTOR_SIZE, sizeof(unsigned char));
-		readBlockFromInode(0, inode, superbloco.blockSize, partitionMounted, tmpBuffer);
+		readBlockFromInode(0, inode, superbloco.blockSize, mnt->partition, tmpBuffer);
 
 		char linkname[MAX_FILENAME + 1] = { 0 };
 		memcpy(linkname, tmpBuffer, MAX_FILENAME + 1);
@@ -390,228 +1142,1115 @@ FILE2 open2(char* filename) {
 		}
 	}
 
-	FILE2 freeHandle = 0;
-	for (freeHandle = 0; freeHandle < MAX_OPENED_FILES; freeHandle++) {
-		if (openedFiles[freeHandle].TypeVal == TYPEVAL_INVALIDO) {
-			openedFiles[freeHandle] = record;
-			filePointer[freeHandle] = 0;
-			fileCounter++;
-			break;
-		}
+	if ((ret = acquireInode(record.inodeNumber))) {
+		DEBUG("#ERRO open2: erro ao carregar o inode\n");
+		return ret;
+	}
+
+	FILE2 handle = allocHandle(record);
+	if (handle < 0) {
+		DEBUG("#ERRO open2: limite de arquivos excedido\n");
+		releaseInode(record.inodeNumber);
 	}
 
-	return freeHandle;
+	return handle;
 }
 
 /*-----------------------------------------------------------------------------
-Funcao:	Funcao usada para fechar um arquivo.
+Funcao:	Ocupa uma posicao livre da tabela de arquivos abertos com o registro do
+		arquivo da montagem mnt, zerando o ponteiro, o mapa de blocos e o
+		read-ahead, e a coloca na lista do inode
+
+Retorno:
+		  #: Handle
+		-13: Limite de arquivos abertos excedido
+		-17: Erro na alocacao de memoria
 -----------------------------------------------------------------------------*/
-int close2(FILE2 handle) {
-	if (partitionMounted == -1) {
-		DEBUG("#ERRO close2: particao ou diretorio nao montado\n");
-		return -15;
+static FILE2 allocHandle(struct t2fs_record record) {
+	int index = popFreeHandle();
+	if (index == 0) {
+		index = __atomic_fetch_add(&handleHighWater, 1, __ATOMIC_RELAXED);
+		if (index >= HANDLE_TABLE_MAX)
+			return -13;
 	}
 
-	if (handle < 0 || handle >= MAX_OPENED_FILES) {
-		DEBUG("#ERRO close2: handle invalido\n");
-		return -14;
-	}
-	if (openedFiles[handle].TypeVal == TYPEVAL_INVALIDO)
-		return -14;
+	struct t2fs_openfile* file = handleSlot(index, 1);
+	if (file == NULL)
+		return -17;
+
+	int bucket = record.inodeNumber % HANDLE_BUCKETS;
+	lockMutex(&mnt->handleBucketLocks[bucket]);
+	lockMutex(&file->lock);
+
+	file->record = record;
+	__atomic_store_n(&file->inodeNumber, record.inodeNumber, __ATOMIC_RELAXED);
+	__atomic_store_n(&file->mount, mnt, __ATOMIC_RELEASE);
+	file->filePointer = 0;
+	file->map.count = 0;
+	memset(&file->readAhead, 0, sizeof(file->readAhead));
+	file->generation = file->generation % HANDLE_MAX_GENERATION + 1;
+	file->open = 1;
+	linkHandle(index, file);
+	FILE2 handle = file->generation * HANDLE_TABLE_MAX + index;
+
+	unlockMutex(&file->lock);
+	unlockMutex(&mnt->handleBucketLocks[bucket]);
+
+	return handle;
+}
 
-	fileCounter--;
-	openedFiles[handle].TypeVal = TYPEVAL_INVALIDO;
-	filePointer[handle] = 0;
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna a entrada da posicao "index" da tabela de arquivos abertos. Se
+		"create", o segmento da posicao eh alocado quando ainda nao existe.
 
-	return 0;
+Retorno:
+		 #: Entrada da posicao
+		 NULL: Posicao invalida, segmento inexistente ou erro de alocacao
+-----------------------------------------------------------------------------*/
+static struct t2fs_openfile* handleSlot(int index, int create) {
+	if (index < 0 || index >= HANDLE_TABLE_MAX)
+		return NULL;
+
+	struct t2fs_openfile** segment = &handleSegments[index / HANDLE_SEGMENT_SIZE];
+	struct t2fs_openfile* entries = __atomic_load_n(segment, __ATOMIC_ACQUIRE);
+	if (entries == NULL && create) {
+		struct t2fs_openfile* fresh = (struct t2fs_openfile*)calloc(HANDLE_SEGMENT_SIZE, sizeof(struct t2fs_openfile));
+		if (fresh == NULL)
+			return NULL;
+		for (int i = 0; i < HANDLE_SEGMENT_SIZE; i++)
+			pthread_mutex_init(&fresh[i].lock, NULL);
+
+		// Outra thread pode ter alocado o mesmo segmento ao mesmo tempo
+		if (__atomic_compare_exchange_n(segment, &entries, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			entries = fresh;
+		else {
+			for (int i = 0; i < HANDLE_SEGMENT_SIZE; i++)
+				pthread_mutex_destroy(&fresh[i].lock);
+			free(fresh);
+		}
+	}
+
+	return entries ? &entries[index % HANDLE_SEGMENT_SIZE] : NULL;
 }
 
 /*-----------------------------------------------------------------------------
-Funcao:	Funcao usada para realizar a leitura de uma certa quantidade
-		de bytes (size) de um arquivo.
+Funcao:	Retorna a entrada do handle, sem conferir se ele esta aberto (ver
+		lockFileHandle)
 -----------------------------------------------------------------------------*/
-int read2(FILE2 handle, char* buffer, int size) {
-	if (partitionMounted == -1) {
-		DEBUG("#ERRO read2: particao ou diretorio nao montado\n");
-		return -15;
-	}
+static struct t2fs_openfile* findHandle(FILE2 handle) {
+	if (handle < 0 || handle % HANDLE_TABLE_MAX == NO_HANDLE)
+		return NULL;
 
-	if (handle < 0 || (handle >= MAX_OPENED_FILES && !creatingSln)) {
-		DEBUG("#ERRO read2: handle invalido\n");
-		return -14;
-	}
+	return handleSlot(handle % HANDLE_TABLE_MAX, 0);
+}
 
-	if (openedFiles[handle].TypeVal == TYPEVAL_INVALIDO)
-		return -14;
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna a montagem do arquivo aberto em "handle", usada por read2,
+		write2 e close2. A montagem de uma posicao so muda quando ela eh
+		reaberta; lockFileHandle e closeFile conferem a geracao e a montagem.
 
-	if (size == 0)
-		return 0;
+Retorno:
+		 #: Montagem do arquivo
+		 noMount: Handle invalido
+-----------------------------------------------------------------------------*/
+static struct t2fs_mount* handleMount(FILE2 handle) {
+	pthread_once(&mountsOnce, initMounts);
 
-	struct t2fs_superbloco superbloco;
-	readSuperblock(partitionMounted, &superbloco);
-	struct t2fs_inode inode;
-	readInode(openedFiles[handle].inodeNumber, &inode, partitionMounted);
+	struct t2fs_openfile* file = findHandle(handle);
+	struct t2fs_mount* mount = file ? __atomic_load_n(&file->mount, __ATOMIC_ACQUIRE) : NULL;
 
-	DWORD bytesRead = MIN(inode.bytesFileSize - filePointer[handle], size);
+	return mount ? mount : &noMount;
+}
 
-	DWORD blockSizeBytes = SECTOR_SIZE * superbloco.blockSize;
-	DWORD bytesToRead = filePointer[handle] % blockSizeBytes + bytesRead;
+/*-----------------------------------------------------------------------------
+Funcao:	Retira a posicao do topo da pilha de posicoes livres
+
+Retorno:
+		 #: Posicao
+		 0: Pilha vazia
+-----------------------------------------------------------------------------*/
+static int popFreeHandle(void) {
+	unsigned long long top = __atomic_load_n(&handleFreeList, __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		int index = (int)(top & 0xFFFFFFFF);
+		if (index == 0)
+			return 0;
+
+		// A posicao pode ser retirada por outra thread antes da troca: o
+		// contador faz a troca falhar mesmo que ela volte ao topo
+		int next = __atomic_load_n(&handleSlot(index, 0)->nextFree, __ATOMIC_RELAXED);
+		unsigned long long newTop = (((top >> 32) + 1) << 32) | (unsigned int)next;
+		if (__atomic_compare_exchange_n(&handleFreeList, &top, newTop, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return index;
+	}
+}
 
-	DWORD indexBlk = filePointer[handle] / blockSizeBytes;
-	DWORD offsetBlk = filePointer[handle] % blockSizeBytes;
+static void pushFreeHandle(int index) {
+	struct t2fs_openfile* file = handleSlot(index, 0);
+	unsigned long long top = __atomic_load_n(&handleFreeList, __ATOMIC_RELAXED);
+	unsigned long long newTop;
 
-	DWORD blocksToRead = 1 + bytesToRead / blockSizeBytes;
+	do {
+		__atomic_store_n(&file->nextFree, (int)(top & 0xFFFFFFFF), __ATOMIC_RELAXED);
+		newTop = (((top >> 32) + 1) << 32) | (unsigned int)index;
+	} while (!__atomic_compare_exchange_n(&handleFreeList, &top, newTop, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-	unsigned char* tmpBuffer = (unsigned char*)calloc(blocksToRead * blockSizeBytes, sizeof(unsigned char));
-	for (int i = 0; i < blocksToRead; i++)
-		readBlockFromInode(indexBlk + i, inode, superbloco.blockSize, partitionMounted, &tmpBuffer[i * blockSizeBytes]);
+/*-----------------------------------------------------------------------------
+Funcao:	Coloca/retira o handle da lista do seu inode. O chamador prende
+		handleBucketLocks do inode.
+-----------------------------------------------------------------------------*/
+static void linkHandle(int index, struct t2fs_openfile* file) {
+	int* head = &mnt->handleBuckets[file->inodeNumber % HANDLE_BUCKETS];
+
+	file->prevByInode = 0;
+	file->nextByInode = *head;
+	if (*head)
+		handleSlot(*head, 0)->prevByInode = index;
+	*head = index;
+}
 
-	memcpy(buffer, &tmpBuffer[offsetBlk], bytesRead);
-	filePointer[handle] += bytesRead;
+static void unlinkHandle(int index, struct t2fs_openfile* file) {
+	if (file->prevByInode)
+		handleSlot(file->prevByInode, 0)->nextByInode = file->nextByInode;
+	else
+		mnt->handleBuckets[file->inodeNumber % HANDLE_BUCKETS] = file->nextByInode;
 
-	return bytesRead;
+	if (file->nextByInode)
+		handleSlot(file->nextByInode, 0)->prevByInode = file->prevByInode;
 }
 
 /*-----------------------------------------------------------------------------
-Funcao:	Funcao usada para realizar a escrita de uma certa quantidade
-		de bytes (size) de  um arquivo.
+Funcao:	Fecha todos os handles abertos da montagem mnt (umount, com fsLock
+		exclusivo). Apenas as listas por inode da montagem sao percorridas:
+		as posicoes das outras montagens podem estar em uso por outras threads.
 -----------------------------------------------------------------------------*/
-int write2(FILE2 handle, char* buffer, int size) {
-	if (partitionMounted == -1) {
-		DEBUG("#ERRO write2: particao ou diretorio nao montado\n");
-		return -15;
+static void closeAllFiles(void) {
+	for (int bucket = 0; bucket < HANDLE_BUCKETS; bucket++) {
+		int index;
+		while ((index = mnt->handleBuckets[bucket]) != NO_HANDLE) {
+			struct t2fs_openfile* file = handleSlot(index, 0);
+			if (closeFile(file->generation * HANDLE_TABLE_MAX + index) == -14)
+				break;
+		}
 	}
+}
 
-	if (handle < 0 || (handle >= MAX_OPENED_FILES && !creatingSln)) {
-		DEBUG("#ERRO write2: handle invalido\n");
-		return -14;
-	}
+/*-----------------------------------------------------------------------------
+Funcao:	Funcao usada para fechar um arquivo.
+-----------------------------------------------------------------------------*/
+int close2(FILE2 handle) {
+	struct t2fs_mount* mount = handleMount(handle);
+	drainHandle(mount, handle);
+	lockFs(mount, 0);
 
-	if (openedFiles[handle].TypeVal == TYPEVAL_INVALIDO)
-		return -14;
+	int ret = closeFile(handle);
 
-	if (size == 0)
-		return 0;
+	unlockFs();
+	return ret;
+}
 
-	struct t2fs_superbloco superbloco;
-	readSuperblock(partitionMounted, &superbloco);
+static int closeFile(FILE2 handle) {
+	struct t2fs_openfile* file = findHandle(handle);
+	if (file == NULL || mnt == &noMount) {
+		DEBUG("#ERRO close2: handle invalido\n");
+		return -14;
+	}
+
+	if (mnt->partition == -1) {
+		DEBUG("#ERRO close2: particao ou diretorio nao montado\n");
+		return -15;
+	}
+
+	// O inode so muda quando a posicao eh reaberta, o que invalida a geracao do handle
+	DWORD inodeNumber = __atomic_load_n(&file->inodeNumber, __ATOMIC_RELAXED);
+	int bucket = inodeNumber % HANDLE_BUCKETS;
+	lockMutex(&mnt->handleBucketLocks[bucket]);
+	lockMutex(&file->lock);
+
+	int valid = (file->open && file->generation == handle / HANDLE_TABLE_MAX && file->mount == mnt);
+	if (valid) {
+		file->open = 0;
+		unlinkHandle(handle % HANDLE_TABLE_MAX, file);
+	}
+
+	unlockMutex(&file->lock);
+	unlockMutex(&mnt->handleBucketLocks[bucket]);
+
+	if (!valid)
+		return -14;
+	pushFreeHandle(handle % HANDLE_TABLE_MAX);
+
+	// Alocacao adiada: os blocos do arquivo que estao em memoria sao alocados agora
+	lockRw(inodeLock(inodeNumber), 1);
+	int ret = flushDelayed(inodeNumber);
+	unlockRw(inodeLock(inodeNumber));
+
+	if (releaseInode(inodeNumber) || flushBlockCache(mnt->cache)) {
+		DEBUG("#ERRO close2: erro ao gravar a cache de blocos\n");
+		return -5;
+	}
+
+	if (ret)
+		DEBUG("#ERRO close2: erro ao alocar os blocos do arquivo (%d)\n", ret);
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Funcao usada para realizar a leitura de uma certa quantidade
+		de bytes (size) de um arquivo.
+-----------------------------------------------------------------------------*/
+int read2(FILE2 handle, char* buffer, int size) {
+	IOVEC2 iov = { buffer, size };
+	return readv2(handle, &iov, 1);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Funcao usada para ler os bytes seguintes do arquivo para os
+		"count" buffers de "iov", em ordem, em uma unica passagem pelo
+		mapa de blocos.
+-----------------------------------------------------------------------------*/
+int readv2(FILE2 handle, IOVEC2* iov, int count) {
+	struct t2fs_mount* mount = handleMount(handle);
+	drainHandle(mount, handle);
+	lockFs(mount, 0);
+
+	struct t2fs_openfile* file;
+	struct t2fs_iocursor io;
+	int ret = lockFileHandle(handle, 0, &file);
+	if (ret == 0) {
+		ret = ioInit(&io, iov, count) < 0 ? -1 : readFile(file, file->record.inodeNumber, file->filePointer, &io);
+		if (ret > 0)
+			file->filePointer += ret;
+		unlockFileHandle(file);
+	}
+
+	unlockFs();
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Funcao usada para ler "size" bytes do arquivo a partir do byte
+		"offset", sem usar nem alterar o contador de posicao do handle.
+-----------------------------------------------------------------------------*/
+int pread2(FILE2 handle, char* buffer, int size, DWORD offset) {
+	struct t2fs_mount* mount = handleMount(handle);
+	drainHandle(mount, handle);
+	lockFs(mount, 0);
+
+	DWORD inodeNumber;
+	IOVEC2 iov = { buffer, size };
+	struct t2fs_iocursor io;
+	int ret = lockHandleInode(handle, 0, &inodeNumber);
+	if (ret == 0) {
+		ret = ioInit(&io, &iov, 1) < 0 ? -1 : readFile(NULL, inodeNumber, offset, &io);
+		unlockRw(inodeLock(inodeNumber));
+	}
+
+	unlockFs();
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le ate io->size bytes do inode a partir do byte "position" para os
+		buffers de "io". Com "file" (read2), usa o mapa de blocos e a
+		leitura antecipada do handle; com NULL (pread2), usa um mapa proprio
+		e nao altera o handle. Nao altera o ponteiro do arquivo.
+
+Retorno:
+		 #: Numero de bytes lidos (0 a partir do fim do arquivo)
+		<0: Erro na leitura de um bloco
+-----------------------------------------------------------------------------*/
+static int readFile(struct t2fs_openfile* file, DWORD inodeNumber, DWORD position, struct t2fs_iocursor* io) {
+	if (io->size == 0)
+		return 0;
+
+	struct t2fs_superbloco superbloco;
+	readSuperblock(mnt->partition, &superbloco);
 	struct t2fs_inode inode;
-	readInode(openedFiles[handle].inodeNumber, &inode, partitionMounted);
-	DWORD setor_inicial = 0;
-	partitionSectors(partitionMounted, &setor_inicial, NULL);
+	readInode(inodeNumber, &inode, mnt->partition);
+	if (position >= inode.bytesFileSize)
+		return 0;
 
-	DWORD blocksFileSizeInBytes = inode.blocksFileSize * superbloco.blockSize * SECTOR_SIZE;
-	while (filePointer[handle] + size > blocksFileSizeInBytes) {
-		int indexBlk = allocBlockOrInode(1, partitionMounted);
-		if (indexBlk < 0) {
-			DEBUG("#ERRO write2: erro ao alocar novo bloco\n");
-			return indexBlk;
-		}
+	DWORD bytesRead = MIN(inode.bytesFileSize - position, (DWORD)io->size);
+	DWORD blockSizeBytes = SECTOR_SIZE * superbloco.blockSize;
+
+	DWORD indexBlk = position / blockSizeBytes;
+	DWORD offsetBlk = position % blockSizeBytes;
+
+	DWORD needToRead = bytesRead;
+
+	struct t2fs_blockmap local = { 0 };
+	struct t2fs_blockmap* map = file ? &file->map : &local;
+
+	DWORD lastBlk = (position + bytesRead - 1) / blockSizeBytes;
+	if (file != NULL)
+		readAheadFile(file, indexBlk, lastBlk, &inode);
+
+	// Fim do arquivo ainda sem blocos na particao (alocacao adiada)
+	DWORD delayedBlocks = 0;
+	unsigned char* delayed = NULL;
+	if (lastBlk >= inode.blocksFileSize)
+		delayed = delayedData(inodeNumber, &delayedBlocks);
+
+	for (int j = 0; needToRead > 0; j++) {
+		DWORD bytesCopied = MIN(blockSizeBytes - offsetBlk, needToRead);
+
+		if (file != NULL && file->readAhead.window && indexBlk + j == file->readAhead.end)
+			fillReadAhead(file, indexBlk + j, lastBlk, &inode);
+
+		// Blocos inteiros e partes de bloco sao copiados da cache direto para o buffer do chamador
 		int ret = 0;
-		if ((ret = addBlockOnInode(&inode, superbloco.blockSize, indexBlk))) {
-			DEBUG("#ERRO write2: erro ao adicionar bloco no inode\n");
+		DWORD delayedBlk = indexBlk + j - inode.blocksFileSize;
+		if (indexBlk + j >= inode.blocksFileSize) {
+			if (delayed != NULL && delayedBlk < delayedBlocks)
+				ioScatter(io, &delayed[delayedBlk * blockSizeBytes + offsetBlk], bytesCopied);
+			else
+				ret = -9;
+		}
+		else if ((ret = mapBlock(map, inodeNumber, indexBlk + j, &inode)) >= 0) {
+			DWORD blockAddr = ret;
+			DWORD piece;
+			for (DWORD done = 0; ret >= 0 && done < bytesCopied; done += piece) {
+				char* dest = ioNext(io, bytesCopied - done, &piece);
+				ret = readBlockPart(blockAddr, offsetBlk + done, piece, (unsigned char*)dest);
+			}
+		}
+		if (ret < 0) {
+			DEBUG("#ERRO read2: erro ao ler bloco do inode\n");
+			free(local.addrs);
 			return ret;
 		}
-		writeInode(openedFiles[handle].inodeNumber, inode, partitionMounted);
 
-		blocksFileSizeInBytes = inode.blocksFileSize * SECTOR_SIZE * superbloco.blockSize;
+		needToRead -= bytesCopied;
+		offsetBlk = 0;
 	}
 
+	free(local.addrs);
+	return bytesRead;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Funcao usada para realizar a escrita de uma certa quantidade
+		de bytes (size) de  um arquivo.
+-----------------------------------------------------------------------------*/
+int write2(FILE2 handle, char* buffer, int size) {
+	IOVEC2 iov = { buffer, size };
+	return writev2(handle, &iov, 1);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Funcao usada para escrever no arquivo, a partir do contador de
+		posicao, o conteudo dos "count" buffers de "iov", em ordem, como uma
+		unica escrita.
+-----------------------------------------------------------------------------*/
+int writev2(FILE2 handle, IOVEC2* iov, int count) {
+	struct t2fs_mount* mount = handleMount(handle);
+	drainHandle(mount, handle);
+	lockFs(mount, 0);
+
+	struct t2fs_openfile* file;
+	struct t2fs_iocursor io;
+	int ret = lockFileHandle(handle, 1, &file);
+	if (ret == 0) {
+		ret = ioInit(&io, iov, count) < 0 ? -1 : writeFile(&file->map, file->record.inodeNumber, file->filePointer, &io);
+		if (ret > 0)
+			file->filePointer += ret;
+		unlockFileHandle(file);
+	}
+
+	unlockFs();
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Funcao usada para escrever "size" bytes no arquivo a partir do byte
+		"offset", sem usar nem alterar o contador de posicao do handle.
+-----------------------------------------------------------------------------*/
+int pwrite2(FILE2 handle, char* buffer, int size, DWORD offset) {
+	struct t2fs_mount* mount = handleMount(handle);
+	drainHandle(mount, handle);
+	lockFs(mount, 0);
+
+	DWORD inodeNumber;
+	IOVEC2 iov = { buffer, size };
+	struct t2fs_iocursor io;
+	int ret = lockHandleInode(handle, 1, &inodeNumber);
+	if (ret == 0) {
+		ret = ioInit(&io, &iov, 1) < 0 ? -1 : writeFileAt(inodeNumber, offset, &io);
+		unlockRw(inodeLock(inodeNumber));
+	}
+
+	unlockFs();
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Escreve os io->size bytes dos buffers de "io" no inode a partir do
+		byte "position", com o mapa de blocos "map" (do handle, em write2).
+		Nao altera o ponteiro do arquivo; o tamanho do arquivo passa a ser
+		pelo menos position + io->size. "position" nao passa do tamanho do
+		arquivo.
+
+Retorno:
+		 #: Numero de bytes escritos
+		<0: Erro na alocacao ou na escrita dos blocos
+-----------------------------------------------------------------------------*/
+static int writeFile(struct t2fs_blockmap* map, DWORD inodeNumber, DWORD position, struct t2fs_iocursor* io) {
+	int size = io->size;
+	if (size == 0)
+		return 0;
+
+	struct t2fs_superbloco superbloco;
+	readSuperblock(mnt->partition, &superbloco);
+	struct t2fs_inode inode;
+	readInode(inodeNumber, &inode, mnt->partition);
 	DWORD blockSizeBytes = SECTOR_SIZE * superbloco.blockSize;
-	DWORD bytesToWrite = filePointer[handle] % blockSizeBytes + size;
+	DWORD blocksNeeded = (position + size + blockSizeBytes - 1) / blockSizeBytes;
+	DWORD allocatedBytes = inode.blocksFileSize * blockSizeBytes;
+
+	// Alocacao adiada: o que passa do ultimo bloco alocado fica em memoria ate delayAllocMax blocos;
+	// uma escrita maior (ou sem blocos livres para reservar) aloca antes os blocos em memoria e o
+	// restante eh alocado agora
+	int immediate = size;
+	int ret = 0;
+	if (mnt->delayAllocMax > 0 && blocksNeeded > inode.blocksFileSize) {
+		if (blocksNeeded - inode.blocksFileSize <= (DWORD)mnt->delayAllocMax &&
+			reserveDelayed(inodeNumber, inode.blocksFileSize, blocksNeeded - inode.blocksFileSize) == 0)
+			immediate = position < allocatedBytes ? allocatedBytes - position : 0;
+		else if ((ret = flushDelayed(inodeNumber)))
+			return ret;
+		else
+			readInode(inodeNumber, &inode, mnt->partition);
+	}
 
-	DWORD indexBlk = filePointer[handle] / blockSizeBytes;
-	DWORD offsetBlk = filePointer[handle] % blockSizeBytes;
+	if (immediate > 0 && (ret = writeBlocks(map, inodeNumber, &inode, position, io, immediate)))
+		return ret;
 
-	DWORD blocksToWrite = 1 + bytesToWrite / blockSizeBytes;
+	if (immediate < size &&
+		(ret = writeDelayed(inodeNumber, position + immediate - allocatedBytes, io, size - immediate, blockSizeBytes))) {
+		DEBUG("#ERRO write2: erro na alocacao de memoria\n");
+		return ret;
+	}
+
+	inode.bytesFileSize = MAX(inode.bytesFileSize, position + size);
+	writeInode(inodeNumber, inode, mnt->partition);
+
+	return size;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Escrita posicional (pwrite2): escreve como writeFile, com um mapa de
+		blocos proprio. Se "position" passar do fim do arquivo, o intervalo
+		entre o fim e "position" eh antes preenchido com zeros (o T2FS nao
+		tem blocos vazios no meio do arquivo).
+
+Retorno:
+		 #: Numero de bytes escritos
+		<0: Erro na alocacao de memoria ou na escrita
+-----------------------------------------------------------------------------*/
+static int writeFileAt(DWORD inodeNumber, DWORD position, struct t2fs_iocursor* io) {
+	if (io->size == 0)
+		return 0;
+
+	struct t2fs_blockmap map = { 0 };
+	struct t2fs_inode inode;
+	readInode(inodeNumber, &inode, mnt->partition);
+
+	int ret = 0;
+	if (position > inode.bytesFileSize) {
+		DWORD blockSizeBytes = SECTOR_SIZE * mnt->info.superbloco.blockSize;
+		char* zeros = (char*)calloc(blockSizeBytes, sizeof(char));
+		if (zeros == NULL)
+			ret = -17;
+
+		// Um bloco por vez, alinhado: os blocos inteiros nao sao lidos antes
+		for (DWORD pos = inode.bytesFileSize; ret >= 0 && pos < position; pos += ret) {
+			IOVEC2 iov = { zeros, MIN(position - pos, blockSizeBytes - pos % blockSizeBytes) };
+			struct t2fs_iocursor zeroIo;
+			ioInit(&zeroIo, &iov, 1);
+			ret = writeFile(&map, inodeNumber, pos, &zeroIo);
+		}
+		free(zeros);
+	}
+
+	if (ret >= 0)
+		ret = writeFile(&map, inodeNumber, position, io);
+
+	free(map.addrs);
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Escreve os "size" bytes seguintes dos buffers de "io" nos blocos do
+		arquivo a partir do byte "position", alocando os blocos que faltam.
+		Nao altera o ponteiro do arquivo nem o tamanho em bytes do inode.
+
+Retorno:
+		 0: Sucesso
+		<0: Erro na alocacao ou na leitura de um bloco (o inode eh gravado
+			com os blocos ja alocados)
+-----------------------------------------------------------------------------*/
+static int writeBlocks(struct t2fs_blockmap* map, DWORD inodeNumber, struct t2fs_inode* inode, DWORD position, struct t2fs_iocursor* io, int size) {
+	int sectors_per_block = mnt->info.superbloco.blockSize;
+	DWORD blockSizeBytes = SECTOR_SIZE * sectors_per_block;
+	DWORD blocksNeeded = (position + size + blockSizeBytes - 1) / blockSizeBytes;
+	DWORD firstNewBlock = inode->blocksFileSize;
+
+	// Aloca os blocos que faltam em sequencias contiguas, continuando a partir do ultimo bloco do arquivo
+	while (inode->blocksFileSize < blocksNeeded) {
+		int goal = 0;
+		if (inode->blocksFileSize > 0)
+			goal = MAX(mapBlock(map, inodeNumber, inode->blocksFileSize - 1, inode) + 1, 0);
+
+		int allocated = 0;
+		// Os blocos novos nao sao zerados no disco: sao escritos inteiros logo abaixo
+		int firstBlk = allocBlocks(goal, blocksNeeded - inode->blocksFileSize, &allocated, 0);
+		if (firstBlk < 0) {
+			DEBUG("#ERRO write2: erro ao alocar novo bloco\n");
+			writeInode(inodeNumber, *inode, mnt->partition);
+			return firstBlk;
+		}
+
+		for (int k = 0; k < allocated; k++) {
+			int ret = 0;
+			if ((ret = addBlockOnInode(inode, sectors_per_block, firstBlk + k))) {
+				DEBUG("#ERRO write2: erro ao adicionar bloco no inode\n");
+				for (; k < allocated; k++)
+					disallocBlockOrInode(1, mnt->partition, firstBlk + k);
+				writeInode(inodeNumber, *inode, mnt->partition);
+				return ret;
+			}
+		}
+	}
+
+	DWORD bytesToWrite = position % blockSizeBytes + size;
+
+	DWORD indexBlk = position / blockSizeBytes;
+	DWORD offsetBlk = position % blockSizeBytes;
+
+	DWORD blocksToWrite = (bytesToWrite + blockSizeBytes - 1) / blockSizeBytes;
 
 	unsigned char* tmpBuffer = (unsigned char*)calloc(blockSizeBytes, sizeof(unsigned char));
 
 	DWORD needToWrite = size;
 
 	for (int j = 0; j < blocksToWrite; j++) {
-		DWORD writeIndex = readBlockFromInode(indexBlk + j, inode, superbloco.blockSize, partitionMounted, tmpBuffer);
-		writeIndex = setor_inicial + writeIndex * superbloco.blockSize;
-
 		DWORD bytesWritten = MIN(blockSizeBytes - offsetBlk, needToWrite);
-		memcpy(&tmpBuffer[offsetBlk], &buffer[j * blockSizeBytes], bytesWritten);
 
-		//DWORD writeIndex = setor_inicial + indexBlk * superbloco.blockSize;
-		for (int i = 0; i < superbloco.blockSize; i++)
-			write_sector(writeIndex + i, &tmpBuffer[i * SECTOR_SIZE]);
+		// Bloco inteiro sobrescrito ou bloco recem-alocado: o conteudo anterior nao eh lido
+		int blockAddr = mapBlock(map, inodeNumber, indexBlk + j, inode);
+		if (blockAddr >= 0 && bytesWritten != blockSizeBytes && indexBlk + j < firstNewBlock && readBlock(blockAddr, tmpBuffer))
+			blockAddr = -5;
+
+		if (blockAddr < 0) {
+			DEBUG("#ERRO write2: erro ao ler bloco do inode\n");
+			free(tmpBuffer);
+			return blockAddr;
+		}
+		DWORD writeIndex = blockAddr;
+
+		if (bytesWritten == blockSizeBytes) {
+			// Bloco inteiro dentro de um buffer do chamador eh gravado direto dele
+			DWORD piece;
+			unsigned char* data = (unsigned char*)ioNext(io, blockSizeBytes, &piece);
+			if (piece < blockSizeBytes) {
+				memcpy(tmpBuffer, data, piece);
+				ioGather(io, &tmpBuffer[piece], blockSizeBytes - piece);
+				data = tmpBuffer;
+			}
+			writeBlock(writeIndex, data);
+		}
+		else {
+			// Apenas o bloco final parcial de um bloco novo precisa ser completado com zeros
+			if (indexBlk + j >= firstNewBlock)
+				memset(tmpBuffer, 0, blockSizeBytes);
+			ioGather(io, &tmpBuffer[offsetBlk], bytesWritten);
+			writeBlock(writeIndex, tmpBuffer);
+		}
 
 		needToWrite -= bytesWritten;
 		offsetBlk = 0;
 	}
 
-	filePointer[handle] += size;
-	inode.bytesFileSize = MAX(inode.bytesFileSize, filePointer[handle]);
-	writeInode(openedFiles[handle].inodeNumber, inode, partitionMounted);
+	free(tmpBuffer);
 
-	return size;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Prepara o cursor "io" para os "count" buffers de "iov", a partir do
+		inicio do primeiro
+
+Retorno:
+		 #: Soma dos tamanhos dos buffers (io->size)
+		-1: Lista, quantidade ou tamanho de buffer invalido, ou soma maior que
+			o maior int
+-----------------------------------------------------------------------------*/
+static int ioInit(struct t2fs_iocursor* io, IOVEC2* iov, int count) {
+	if (count < 0 || (iov == NULL && count > 0))
+		return -1;
+
+	long long total = 0;
+	for (int i = 0; i < count; i++) {
+		if (iov[i].size < 0 || (iov[i].buffer == NULL && iov[i].size > 0))
+			return -1;
+		total += iov[i].size;
+	}
+	if (total > 0x7FFFFFFF)
+		return -1;
+
+	io->iov = iov;
+	io->count = count;
+	io->size = (int)total;
+	io->index = 0;
+	io->offset = 0;
+
+	return io->size;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna o proximo trecho contiguo, de ate "max" bytes, dos buffers de
+		"io" e avanca o cursor. O tamanho do trecho vai para "size" (0 se os
+		buffers terminaram).
+-----------------------------------------------------------------------------*/
+static char* ioNext(struct t2fs_iocursor* io, DWORD max, DWORD* size) {
+	while (io->index < io->count && io->offset == io->iov[io->index].size) {
+		io->index++;
+		io->offset = 0;
+	}
+
+	if (io->index == io->count) {
+		*size = 0;
+		return NULL;
+	}
+
+	char* data = &io->iov[io->index].buffer[io->offset];
+	*size = MIN((DWORD)(io->iov[io->index].size - io->offset), max);
+	io->offset += *size;
+
+	return data;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Copia os "size" bytes seguintes dos buffers de "io" para "dest"
+-----------------------------------------------------------------------------*/
+static void ioGather(struct t2fs_iocursor* io, unsigned char* dest, DWORD size) {
+	DWORD piece = 0;
+	for (DWORD done = 0; done < size; done += piece) {
+		char* data = ioNext(io, size - done, &piece);
+		if (piece == 0)
+			break;
+		memcpy(&dest[done], data, piece);
+	}
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Copia "size" bytes de "src" para os buffers seguintes de "io"
+-----------------------------------------------------------------------------*/
+static void ioScatter(struct t2fs_iocursor* io, unsigned char* src, DWORD size) {
+	DWORD piece = 0;
+	for (DWORD done = 0; done < size; done += piece) {
+		char* data = ioNext(io, size - done, &piece);
+		if (piece == 0)
+			break;
+		memcpy(data, &src[done], piece);
+	}
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Copia o conteudo do arquivo "src" para o arquivo "dst" (criado ou
+		truncado). Os blocos da origem sao lidos inteiros, direto do inode, em
+		trechos de COPY2_CHUNK_BLOCKS blocos, e cada trecho eh gravado com um
+		unico write2 alinhado ao bloco (sem leitura do conteudo anterior).
+
+Retorno:
+		 #: Numero de bytes copiados
+		 -1: Origem e destino sao o mesmo arquivo
+		-17: Erro na alocacao de memoria
+-----------------------------------------------------------------------------*/
+int copy2(char* src, char* dst) {
+	return copy2_ex(getDefaultMount(), src, dst);
+}
+
+int copy2_ex(MOUNT2 mount, char* src, char* dst) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+
+	int ret = copyFile(src, dst);
+
+	unlockFs();
+	return ret;
+}
+
+static int copyFile(char* src, char* dst) {
+	if (mnt->partition == -1) {
+		DEBUG("#ERRO copy2: particao ou diretorio nao montado\n");
+		return -15;
+	}
+
+	FILE2 hSrc = open2_ex(mnt->id, src);
+	if (hSrc < 0) {
+		DEBUG("#ERRO copy2: erro ao abrir a origem (%d)\n", hSrc);
+		return hSrc;
+	}
+
+	// create2 truncaria a origem se o destino for o mesmo arquivo (ou um hard link dele)
+	char dstCpy[MAX_FILENAME + 1] = { 0 };
+	strncpy(dstCpy, dst, MAX_FILENAME);
+	struct t2fs_record dstRecord;
+	lockDir(0);
+	int sameFile = (findFileByName(dstCpy, &dstRecord) > 0 && dstRecord.inodeNumber == __atomic_load_n(&findHandle(hSrc)->inodeNumber, __ATOMIC_RELAXED));
+	unlockDir();
+	if (sameFile) {
+		DEBUG("#ERRO copy2: origem e destino sao o mesmo arquivo\n");
+		close2(hSrc);
+		return -1;
+	}
+
+	FILE2 hDst = create2_ex(mnt->id, dst);
+	if (hDst < 0) {
+		DEBUG("#ERRO copy2: erro ao criar o destino (%d)\n", hDst);
+		close2(hSrc);
+		return hDst;
+	}
+
+	struct t2fs_superbloco superbloco;
+	readSuperblock(mnt->partition, &superbloco);
+	struct t2fs_inode inode = { 0 };
+	struct t2fs_openfile* file;
+	int ret = 0;
+	// Os blocos da origem sao lidos direto do inode: os dados ainda em memoria sao alocados antes
+	if (lockFileHandle(hSrc, 1, &file) == 0) {
+		ret = flushDelayed(file->record.inodeNumber);
+		readInode(file->record.inodeNumber, &inode, mnt->partition);
+		unlockFileHandle(file);
+	}
+	if (ret) {
+		DEBUG("#ERRO copy2: erro ao alocar os blocos da origem (%d)\n", ret);
+		close2(hSrc);
+		close2(hDst);
+		return ret;
+	}
+
+	DWORD blockSizeBytes = SECTOR_SIZE * superbloco.blockSize;
+	unsigned char* chunk = (unsigned char*)malloc(COPY2_CHUNK_BLOCKS * blockSizeBytes);
+	if (chunk == NULL) {
+		close2(hSrc);
+		close2(hDst);
+		return -17;
+	}
+
+	DWORD copied = 0;
+	DWORD block = 0;
+	while (copied < inode.bytesFileSize) {
+		DWORD size = MIN(inode.bytesFileSize - copied, COPY2_CHUNK_BLOCKS * blockSizeBytes);
+		DWORD blocks = (size + blockSizeBytes - 1) / blockSizeBytes;
+
+		// A origem fica presa (compartilhada) apenas durante a leitura do trecho
+		if ((ret = lockFileHandle(hSrc, 0, &file)) == 0) {
+			for (DWORD i = 0; i < blocks && ret >= 0; i++)
+				if ((ret = mapBlock(&file->map, file->record.inodeNumber, block + i, &inode)) >= 0)
+					ret = readBlock(ret, &chunk[i * blockSizeBytes]);
+			unlockFileHandle(file);
+		}
+		if (ret < 0) {
+			DEBUG("#ERRO copy2: erro ao ler bloco da origem\n");
+			break;
+		}
+
+		if ((ret = write2(hDst, (char*)chunk, size)) != (int)size) {
+			DEBUG("#ERRO copy2: erro ao gravar no destino (%d)\n", ret);
+			break;
+		}
+
+		copied += size;
+		block += blocks;
+	}
+
+	free(chunk);
+	close2(hSrc);
+	if (close2(hDst) && ret >= 0)
+		ret = -5;
+
+	return ret < 0 ? ret : (int)copied;
 }
 
 /*-----------------------------------------------------------------------------
 Funcao:	Funcao que abre um diretorio existente no disco.
 -----------------------------------------------------------------------------*/
 int opendir2(void) {
-	if (partitionMounted == -1) {
+	return opendir2_ex(getDefaultMount());
+}
+
+int opendir2_ex(MOUNT2 mount) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+
+	int ret = 0;
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO opendir2: particao nao montada\n");
-		return -15;
+		ret = -15;
+	}
+	else {
+		lockDir(1);
+		mnt->isDirMounted = 1;
+		mnt->lastListed = 0;
+		unlockDir();
 	}
 
-	isDirMounted = 1;
-	lastListed = 0;
-
-	return 0;
+	unlockFs();
+	return ret;
 }
 
 /*-----------------------------------------------------------------------------
 Funcao:	Funcao usada para ler as entradas de um diretorio.
 -----------------------------------------------------------------------------*/
 int readdir2(DIRENT2* dentry) {
-	if (partitionMounted == -1 || !isDirMounted) {
+	return readdir2_ex(getDefaultMount(), dentry);
+}
+
+int readdir2_ex(MOUNT2 mount, DIRENT2* dentry) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+	lockDir(1);
+
+	int ret = readNextEntry(dentry);
+
+	unlockDir();
+	unlockFs();
+	return ret;
+}
+
+static int readNextEntry(DIRENT2* dentry) {
+	if (mnt->partition == -1 || !mnt->isDirMounted) {
 		DEBUG("#ERRO close2: particao ou diretorio nao montado\n");
 		return -15;
 	}
 
-	struct t2fs_record record;
-	int ret = 0;
-	if ((ret = readDirEntry(lastListed++, &record)) < 0) {
-		lastListed = 0;
-		return ret;
+	struct t2fs_record record;
+	int ret = 0;
+	if (mnt->info.hashedDir) {
+		// lastListed guarda a posicao seguinte a ultima entrada listada
+		if ((ret = hashDirNext(mnt->lastListed, &record)) < 0) {
+			mnt->lastListed = 0;
+			return ret;
+		}
+		mnt->lastListed = ret + 1;
+	}
+	else if ((ret = readDirEntry(mnt->lastListed++, &record)) < 0) {
+		mnt->lastListed = 0;
+		return ret;
+	}
+
+	struct t2fs_inode inode;
+	if ((ret = readInode(record.inodeNumber, &inode, mnt->partition)))
+		return ret;
+
+	dentry->fileType = record.TypeVal;
+	dentry->fileSize = inode.bytesFileSize;
+	strcpy(dentry->name, record.name);
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le ate "max" entradas do diretorio, decodificando cada bloco do
+		diretorio uma unica vez. Os tamanhos sao obtidos em ordem de numero de
+		inode, lendo cada bloco da area de inodes apenas uma vez.
+-----------------------------------------------------------------------------*/
+int readdirv2(DIRENT2* out, int max) {
+	return readdirv2_ex(getDefaultMount(), out, max);
+}
+
+int readdirv2_ex(MOUNT2 mount, DIRENT2* out, int max) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+	lockDir(1);
+
+	int ret = readEntries(out, max);
+
+	unlockDir();
+	unlockFs();
+	return ret;
+}
+
+static int readEntries(DIRENT2* out, int max) {
+	if (mnt->partition == -1 || !mnt->isDirMounted) {
+		DEBUG("#ERRO readdirv2: particao ou diretorio nao montado\n");
+		return -15;
+	}
+
+	if (out == NULL || max <= 0) {
+		DEBUG("#ERRO readdirv2: parametros invalidos\n");
+		return -1;
+	}
+
+	struct t2fs_record* records = (struct t2fs_record*)malloc(max * sizeof(struct t2fs_record));
+	DWORD* refs = (DWORD*)malloc(max * 2 * sizeof(DWORD));
+	unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * mnt->info.superbloco.blockSize);
+	if (records == NULL || refs == NULL || buffer == NULL) {
+		free(records);
+		free(refs);
+		free(buffer);
+		return -17;
+	}
+
+	int count = readDirRecords(records, max);
+
+	// Pares (inode, posicao em "out") ordenados pelo numero do inode
+	for (int i = 0; i < count; i++) {
+		refs[2 * i] = records[i].inodeNumber;
+		refs[2 * i + 1] = i;
+		out[i].fileType = records[i].TypeVal;
+		strcpy(out[i].name, records[i].name);
+	}
+	qsort(refs, count, 2 * sizeof(DWORD), compareInodeRefs);
+
+	DWORD inodesPerBlock = SECTOR_SIZE * mnt->info.superbloco.blockSize / sizeof(struct t2fs_inode);
+	struct t2fs_inode* pInode = (struct t2fs_inode*)buffer;
+	DWORD loadedBlock = 0;
+
+	for (int i = 0; i < count; i++) {
+		DWORD inodeNumber = refs[2 * i];
+		DIRENT2* dentry = &out[refs[2 * i + 1]];
+
+		// A copia em memoria pode ter alteracoes ainda nao gravadas
+		lockMutex(&mnt->inodeTableLock);
+		struct t2fs_incore* entry = findIncoreInode(inodeNumber);
+		if (entry)
+			dentry->fileSize = entry->inode.bytesFileSize;
+		unlockMutex(&mnt->inodeTableLock);
+		if (entry)
+			continue;
+
+		DWORD block = mnt->info.inodeAreaBlock + inodeNumber / inodesPerBlock;
+		if (block != loadedBlock) {
+			if (readBlock(block, buffer)) {
+				count = -5;
+				break;
+			}
+			loadedBlock = block;
+		}
+		dentry->fileSize = pInode[inodeNumber % inodesPerBlock].bytesFileSize;
+	}
+
+	free(records);
+	free(refs);
+	free(buffer);
+
+	return count;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Copia ate "max" registros do diretorio, a partir de lastListed, lendo
+		cada bloco do diretorio uma unica vez, e avanca lastListed.
+		No fim do diretorio, lastListed volta a zero (como em readdir2).
+
+Retorno:
+		 #: Quantidade de registros copiados (0: fim do diretorio)
+-----------------------------------------------------------------------------*/
+static int readDirRecords(struct t2fs_record* records, int max) {
+	struct t2fs_inode inode;
+	if (readInode(0, &inode, mnt->partition))
+		return 0;
+
+	DWORD recordsPerBlock = SECTOR_SIZE * mnt->info.superbloco.blockSize / sizeof(struct t2fs_record);
+	unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * mnt->info.superbloco.blockSize);
+	struct t2fs_record* pRecord = (struct t2fs_record*)buffer;
+	int count = 0;
+
+	if (mnt->info.hashedDir) {
+		// Posicoes: bloco logico * recordsPerBlock + slot (ver hashDirNext)
+		struct t2fs_hashbucket* bucket = (struct t2fs_hashbucket*)buffer;
+		DWORD logical = MAX(mnt->lastListed / recordsPerBlock, 1);
+		DWORD slot = (logical * recordsPerBlock > mnt->lastListed) ? 1 : MAX(mnt->lastListed % recordsPerBlock, 1);
+
+		while (count < max && logical < inode.blocksFileSize) {
+			if (readDirBlock(logical, buffer))
+				break;
+			for (; slot <= bucket->count && count < max; slot++)
+				records[count++] = pRecord[slot];
+			if (slot > bucket->count) {
+				logical++;
+				slot = 1;
+			}
+		}
+		mnt->lastListed = logical * recordsPerBlock + slot;
+	}
+	else {
+		DWORD qtyFiles = inode.bytesFileSize / sizeof(struct t2fs_record);
+
+		while (count < max && (DWORD)mnt->lastListed < qtyFiles) {
+			if (readBlockFromInode(mnt->lastListed / recordsPerBlock, inode, mnt->info.superbloco.blockSize, mnt->partition, buffer) < 0)
+				break;
+			for (DWORD slot = mnt->lastListed % recordsPerBlock; slot < recordsPerBlock && count < max && (DWORD)mnt->lastListed < qtyFiles; slot++, mnt->lastListed++)
+				records[count++] = pRecord[slot];
+		}
 	}
 
-	struct t2fs_inode inode;
-	if ((ret = readInode(record.inodeNumber, &inode, partitionMounted)))
-		return ret;
+	free(buffer);
 
-	dentry->fileType = record.TypeVal;
-	dentry->fileSize = inode.bytesFileSize;
-	strcpy(dentry->name, record.name);
+	if (count == 0)
+		mnt->lastListed = 0;
 
-	return 0;
+	return count;
+}
+
+static int compareInodeRefs(const void* a, const void* b) {
+	DWORD x = *(const DWORD*)a;
+	DWORD y = *(const DWORD*)b;
+	return (x > y) - (x < y);
 }
 
 /*-----------------------------------------------------------------------------
 Funcao:	Funcao usada para fechar um diretorio.
 -----------------------------------------------------------------------------*/
 int closedir2(void) {
-	if (partitionMounted == -1) {
+	return closedir2_ex(getDefaultMount());
+}
+
+int closedir2_ex(MOUNT2 mount) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+
+	int ret = 0;
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO closedir2: particao nao montada\n");
-		return -15;
+		ret = -15;
+	}
+	else {
+		lockDir(1);
+		mnt->isDirMounted = 0;
+		unlockDir();
 	}
 
-	isDirMounted = 0;
-
-	return 0;
+	unlockFs();
+	return ret;
 }
 
 /*-----------------------------------------------------------------------------
 Funcao:	Funcao usada para criar um caminho alternativo (softlink)
 -----------------------------------------------------------------------------*/
 int sln2(char* linkname, char* filename) {
-	if (partitionMounted == -1) {
+	return sln2_ex(getDefaultMount(), linkname, filename);
+}
+
+int sln2_ex(MOUNT2 mount, char* linkname, char* filename) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+	lockDir(1);
+
+	int ret = softLink(linkname, filename);
+
+	unlockDir();
+	unlockFs();
+	return ret;
+}
+
+static int softLink(char* linkname, char* filename) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO sln2: particao ou diretorio nao montado\n");
 		return -15;
 	}
@@ -649,18 +2288,23 @@ int sln2(char* linkname, char* filename) {
 		return ret;
 	}
 
-	creatingSln = 1;
-	openedFiles[MAX_OPENED_FILES] = record;
-	filePointer[MAX_OPENED_FILES] = 0;
+	// O conteudo do link eh gravado com write2 em um handle do proprio link
+	FILE2 handle = -5;
+	if (acquireInode(record.inodeNumber) == 0 && (handle = allocHandle(record)) < 0)
+		releaseInode(record.inodeNumber);
 
-	if (write2(MAX_OPENED_FILES, filenameCpy, strlen(filenameCpy)) <= 0) {
-		DEBUG("#ERRO sln2: erro ao criar lik simbolico\n", ret);
-		delete2(linknameCpy);
-		creatingSln = 0;
+	ret = handle;
+	if (handle >= 0) {
+		ret = write2(handle, filenameCpy, strlen(filenameCpy));
+		if (closeFile(handle) && ret >= 0)
+			ret = -5;
+	}
 
-		return ret;
+	if (ret <= 0) {
+		DEBUG("#ERRO sln2: erro ao criar link simbolico (%d)\n", ret);
+		delete2_ex(mnt->id, linknameCpy);
+		return ret < 0 ? ret : -5;
 	}
-	creatingSln = 0;
 
 	return 0;
 }
@@ -669,7 +2313,23 @@ int sln2(char* linkname, char* filename) {
 Funcao:	Funcao usada para criar um caminho alternativo (hardlink)
 -----------------------------------------------------------------------------*/
 int hln2(char* linkname, char* filename) {
-	if (partitionMounted == -1) {
+	return hln2_ex(getDefaultMount(), linkname, filename);
+}
+
+int hln2_ex(MOUNT2 mount, char* linkname, char* filename) {
+	drainAsync();
+	lockFs(mountById(mount), 0);
+	lockDir(1);
+
+	int ret = hardLink(linkname, filename);
+
+	unlockDir();
+	unlockFs();
+	return ret;
+}
+
+static int hardLink(char* linkname, char* filename) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO hln2: particao ou diretorio nao montado\n");
 		return -15;
 	}
@@ -702,14 +2362,18 @@ int hln2(char* linkname, char* filename) {
 		return -10;
 	}
 
+	lockRw(inodeLock(record.inodeNumber), 1);
+
 	struct t2fs_inode inode;
-	readInode(record.inodeNumber, &inode, partitionMounted);
+	readInode(record.inodeNumber, &inode, mnt->partition);
 
 	strcpy(record.name, linknameCpy);
 	writeDirEntry(record);
 
 	inode.RefCounter++;
-	writeInode(record.inodeNumber, inode, partitionMounted);
+	writeInode(record.inodeNumber, inode, mnt->partition);
+
+	unlockRw(inodeLock(record.inodeNumber));
 
 	return 0;
 }
@@ -731,12 +2395,12 @@ Retorno:
 -----------------------------------------------------------------------------*/
 static int createNewFile(char* filename, struct t2fs_record* record, int type) {
 
-	if (partitionMounted == -1) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO createNewFile: particao nao montada\n");
 		return -3;
 	}
 
-	int indexInode = allocBlockOrInode(0, partitionMounted);
+	int indexInode = allocBlockOrInode(0, mnt->partition);
 	if(indexInode < 0) {
 		DEBUG("#ERRO createNewFile: erro no inode\n");
 		return indexInode;
@@ -759,7 +2423,7 @@ static int createNewFile(char* filename, struct t2fs_record* record, int type) {
 	};
 
 	int ret = 0;
-	if ((ret = writeInode(indexInode, newInode, partitionMounted)))
+	if ((ret = writeInode(indexInode, newInode, mnt->partition)))
 		return ret;
 
 	if ((ret = writeDirEntry(newRecord)))
@@ -779,20 +2443,29 @@ Retorno:
 		 0: Sucesso - Arquivo nao encontrado
 -----------------------------------------------------------------------------*/
 static int findFileByName(char* filename, struct t2fs_record* record) {
-	if (partitionMounted == -1) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO findFileByName: particao nao montada\n");
 		return -3;
 	}
 
+	if (mnt->info.hashedDir)
+		return hashDirLookup(filename, record);
+
+	// Indice em memoria (construido na primeira busca apos o mount)
+	if (isDirIndexOpen(&mnt->dirIndex) || !buildDirIndex()) {
+		int dirEntry = findDirIndex(&mnt->dirIndex, filename, record);
+		return dirEntry < 0 ? 0 : dirEntry + 1;
+	}
+
 	int ret = 0;
 	struct t2fs_superbloco superbloco;
-	if ((ret = readSuperblock(partitionMounted, &superbloco))) {
+	if ((ret = readSuperblock(mnt->partition, &superbloco))) {
 		DEBUG("#ERRO findFileByName: erro na leitura do superbloco\n");
 		return ret;
 	}
 
 	struct t2fs_inode inode;
-	if ((ret = readInode(0, &inode, partitionMounted))) {
+	if ((ret = readInode(0, &inode, mnt->partition))) {
 		DEBUG("#ERRO findFileByName: erro na leitura do inode 0\n");
 		return ret;
 	}
@@ -815,6 +2488,50 @@ static int findFileByName(char* filename, struct t2fs_record* record) {
 	return 0;
 }
 
+/*-----------------------------------------------------------------------------
+Funcao:	Constroi o indice em memoria do diretorio raiz, lendo cada bloco do
+		diretorio uma unica vez
+
+Retorno:
+		 0: Sucesso
+		-5: Erro na leitura do diretorio
+		-17: Erro na alocacao de memoria
+-----------------------------------------------------------------------------*/
+static int buildDirIndex(void) {
+	struct t2fs_inode inode;
+	int ret = 0;
+	if ((ret = readInode(0, &inode, mnt->partition)))
+		return ret;
+
+	DWORD blockSizeBytes = SECTOR_SIZE * mnt->info.superbloco.blockSize;
+	DWORD recordsPerBlock = blockSizeBytes / sizeof(struct t2fs_record);
+	DWORD qtyFiles = inode.bytesFileSize / sizeof(struct t2fs_record);
+
+	if (openDirIndex(&mnt->dirIndex, qtyFiles))
+		return -17;
+
+	unsigned char* buffer = (unsigned char*)malloc(blockSizeBytes);
+	struct t2fs_record* pRecord = (struct t2fs_record*)buffer;
+
+	for (DWORD i = 0; i < qtyFiles; i++) {
+		if (i % recordsPerBlock == 0 && readBlockFromInode(i / recordsPerBlock, inode, mnt->info.superbloco.blockSize, mnt->partition, buffer) < 0) {
+			ret = -5;
+			break;
+		}
+		if (insertDirIndex(&mnt->dirIndex, &pRecord[i % recordsPerBlock], i)) {
+			ret = -17;
+			break;
+		}
+	}
+
+	free(buffer);
+
+	if (ret)
+		closeDirIndex(&mnt->dirIndex);
+
+	return ret;
+}
+
 /*-----------------------------------------------------------------------------
 Funcao:	Remove uma entrada de diretorio do disco
 
@@ -822,18 +2539,18 @@ Retorno:
 		 0: Sucesso
 -----------------------------------------------------------------------------*/
 static int removeDirEntry(int index, struct t2fs_record record) {
-	if (partitionMounted == -1) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO removeDirEntry: particao nao montada\n");
 		return -3;
 	}
 
+	if (mnt->info.hashedDir)
+		return hashDirRemove(index);
+
 	struct t2fs_inode inode;
-	readInode(0, &inode, partitionMounted);
+	readInode(0, &inode, mnt->partition);
 	struct t2fs_superbloco superbloco;
-	readSuperblock(partitionMounted, &superbloco);
-	DWORD setor_inicial = 0;
-	partitionSectors(partitionMounted, &setor_inicial, NULL);
-
+	readSuperblock(mnt->partition, &superbloco);
 
 	if (((index + 1) * sizeof(struct t2fs_record)) > (inode.bytesFileSize)) {
 		//DEBUG("#ERRO readDirEntry: indice nao se encontra na entrada de diretorio\n");
@@ -850,31 +2567,36 @@ static int removeDirEntry(int index, struct t2fs_record record) {
 	////DEBUG("#INFO readDirEntry: indexBlock: %u  offsetBlock: %u\n", indexBlock, offsetBlock);
 
 	unsigned char* actualBuffer = (unsigned char*)malloc(SECTOR_SIZE * superbloco.blockSize);
-	int curretBlockAddr = readBlockFromInode(indexBlock, inode, superbloco.blockSize, partitionMounted, actualBuffer);
+	int curretBlockAddr = readBlockFromInode(indexBlock, inode, superbloco.blockSize, mnt->partition, actualBuffer);
 
 	unsigned char* lastBuffer = (unsigned char*)malloc(SECTOR_SIZE * superbloco.blockSize);
-	int lastBlockAddr = readBlockFromInode(lastBlkIndex, inode, superbloco.blockSize, partitionMounted, lastBuffer);
+	int lastBlockAddr = readBlockFromInode(lastBlkIndex, inode, superbloco.blockSize, mnt->partition, lastBuffer);
 
 	struct t2fs_record* pRecordActual = (struct t2fs_record*)actualBuffer;
 	struct t2fs_record* pRecordLast = (struct t2fs_record*)lastBuffer;
+
+	// A ultima entrada passa a ocupar a posicao da removida
+	removeDirIndex(&mnt->dirIndex, pRecordActual[offsetBlock].name);
+	if (index != lastDirEntry && isDirIndexOpen(&mnt->dirIndex) && insertDirIndex(&mnt->dirIndex, &pRecordLast[lastDirOffset], index))
+		closeDirIndex(&mnt->dirIndex);
+
 	pRecordActual[offsetBlock] = pRecordLast[lastDirOffset];
 
 	if (lastDirOffset == 0) {
-		disallocBlockOrInode(1, partitionMounted, lastBlockAddr);
+		disallocBlockOrInode(1, mnt->partition, lastBlockAddr);
 		inode.blocksFileSize--;
 	}
 
-	DWORD writeActualIndex = setor_inicial + curretBlockAddr * superbloco.blockSize;
+	DWORD writeActualIndex = curretBlockAddr;
 
-	for (int i = 0; i < superbloco.blockSize; i++)
-		write_sector(writeActualIndex + i, &actualBuffer[i * SECTOR_SIZE]);
+	writeBlock(writeActualIndex, actualBuffer);
 
 	free(lastBuffer);
 	free(actualBuffer);
 
 	inode.bytesFileSize -= sizeof(struct t2fs_record);
 
-	writeInode(0, inode, partitionMounted);
+	writeInode(0, inode, mnt->partition);
 
 	return 0;
 }
@@ -886,20 +2608,20 @@ Retorno:
 		 0: Sucesso
 -----------------------------------------------------------------------------*/
 static int readDirEntry(int index, struct t2fs_record* record) {
-	if (partitionMounted == -1) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO readDirEntry: particao nao montada\n");
 		return -3;
 	}
 
 	int ret = 0;
 	struct t2fs_superbloco superbloco;
-	if ((ret = readSuperblock(partitionMounted, &superbloco))) {
+	if ((ret = readSuperblock(mnt->partition, &superbloco))) {
 		DEBUG("#ERRO readDirEntry: erro na leitura do superbloco\n");
 		return ret;
 	}
 
 	struct t2fs_inode inode;
-	if ((ret = readInode(0, &inode, partitionMounted))) {
+	if ((ret = readInode(0, &inode, mnt->partition))) {
 		DEBUG("#ERRO readDirEntry: erro na leitura do inode 0\n");
 		return ret;
 	}
@@ -915,7 +2637,7 @@ static int readDirEntry(int index, struct t2fs_record* record) {
 	////DEBUG("#INFO readDirEntry: indexBlock: %u  offsetBlock: %u\n", indexBlock, offsetBlock);
 
 	unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * superbloco.blockSize);
-	readBlockFromInode(indexBlock, inode, superbloco.blockSize, partitionMounted, buffer);
+	readBlockFromInode(indexBlock, inode, superbloco.blockSize, mnt->partition, buffer);
 	
 	struct t2fs_record* pRecord = (struct t2fs_record*)buffer;
 	*record = pRecord[offsetBlock];
@@ -934,20 +2656,23 @@ Retorno:
 		 0: Sucesso
 -----------------------------------------------------------------------------*/
 static int writeDirEntry(struct t2fs_record record) {
-	if (partitionMounted == -1) {
+	if (mnt->partition == -1) {
 		DEBUG("#ERRO writeDirEntry: particao nao montada\n");
 		return -3;
 	}
 
+	if (mnt->info.hashedDir)
+		return hashDirInsert(record);
+
 	int ret = 0;
 	struct t2fs_superbloco superbloco;
-	if ((ret = readSuperblock(partitionMounted, &superbloco))) {
+	if ((ret = readSuperblock(mnt->partition, &superbloco))) {
 		DEBUG("#ERRO writeDirEntry: erro na leitura do superbloco\n");
 		return ret;
 	}
 
 	struct t2fs_inode inode;
-	if ((ret = readInode(0, &inode, partitionMounted))) {
+	if ((ret = readInode(0, &inode, mnt->partition))) {
 		DEBUG("#ERRO writeDirEntry: erro na leitura do inode 0\n");
 		return ret;
 	}
@@ -956,7 +2681,7 @@ static int writeDirEntry(struct t2fs_record record) {
 
 	if (!inode.blocksFileSize || !(inode.bytesFileSize % (inode.blocksFileSize * SECTOR_SIZE * superbloco.blockSize))) {
 		// Alocar novo bloco
-		int indexBlk = allocBlockOrInode(1, partitionMounted);
+		int indexBlk = allocBlockOrInode(1, mnt->partition);
 		if (indexBlk < 0) {
 			DEBUG("#ERRO writeDirEntry: erro ao alocar novo bloco\n");
 			return indexBlk;
@@ -978,24 +2703,26 @@ static int writeDirEntry(struct t2fs_record record) {
 	unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * superbloco.blockSize);
 
 	int index = 0;
-	if ((index = readBlockFromInode(inode.blocksFileSize - 1, inode, superbloco.blockSize, partitionMounted, buffer)) < 0) {
+	if ((index = readBlockFromInode(inode.blocksFileSize - 1, inode, superbloco.blockSize, mnt->partition, buffer)) < 0) {
 		DEBUG("#ERRO writeDirEntry: erro ao ler bloco do inode\n");
 		return index;
 	}
 
 	struct t2fs_record* tmpArray = (struct t2fs_record*)buffer;
 	tmpArray[indiceDir] = record;
+
+	// Se o indice nao puder ser atualizado, ele eh reconstruido na proxima busca
+	if (isDirIndexOpen(&mnt->dirIndex) && insertDirIndex(&mnt->dirIndex, &record, inode.bytesFileSize / sizeof(struct t2fs_record)))
+		closeDirIndex(&mnt->dirIndex);
+
 	inode.bytesFileSize += sizeof(struct t2fs_record);
 
 	//DEBUG("#INFO writeDirEntry: indiceDir: %u  sector to write: %u\n", indiceDir, ret);
-	DWORD setor_inicial = 0;
-	partitionSectors(partitionMounted, &setor_inicial, NULL);
-	DWORD writeIndex = setor_inicial + index * superbloco.blockSize;
+	DWORD writeIndex = index;
 
 	//DEBUG("#INFO: Indice: %u  writeIndex %u\n", index, writeIndex);
-	for (int i = 0; i < superbloco.blockSize; i++)
-		write_sector(writeIndex + i, &buffer[i * SECTOR_SIZE]);
-	if ((ret = writeInode(0, inode, partitionMounted))) {
+	writeBlock(writeIndex, buffer);
+	if ((ret = writeInode(0, inode, mnt->partition))) {
 		DEBUG("#ERRO writeDirEntry: erro na gravacao do inode 0\n");
 		return ret;
 	}
@@ -1004,6 +2731,313 @@ static int writeDirEntry(struct t2fs_record record) {
 
 	return 0;
 }
+/*-----------------------------------------------------------------------------
+Diretorio raiz com hash extensivel (T2FS_VERSION_HASHDIR)
+
+As posicoes das entradas (retornadas por findFileByName e usadas por
+removeDirEntry e readdir2) sao "bloco logico * registros por bloco + slot".
+-----------------------------------------------------------------------------*/
+#define HASHDIR_RECORDS		(SECTOR_SIZE * mnt->info.superbloco.blockSize / sizeof(struct t2fs_record))
+
+/*-----------------------------------------------------------------------------
+Funcao:	Profundidade maxima da tabela: quantas entradas cabem no bloco 0
+-----------------------------------------------------------------------------*/
+static DWORD hashDirMaxDepth(void) {
+	DWORD entries = (SECTOR_SIZE * mnt->info.superbloco.blockSize - offsetof(struct t2fs_hashdir, table)) / sizeof(DWORD);
+	DWORD depth = 0;
+	while ((2u << depth) <= entries)
+		depth++;
+	return depth;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le/escreve o bloco logico "logical" do diretorio raiz (inode 0)
+-----------------------------------------------------------------------------*/
+static int readDirBlock(DWORD logical, unsigned char* buffer) {
+	struct t2fs_inode inode;
+	int ret = 0;
+	if ((ret = readInode(0, &inode, mnt->partition)))
+		return ret;
+
+	int blockAddr = blockAddrFromInode(logical, &inode, mnt->info.superbloco.blockSize);
+	if (blockAddr < 0)
+		return blockAddr;
+
+	return readBlock(blockAddr, buffer);
+}
+
+static int writeDirBlock(DWORD logical, unsigned char* buffer) {
+	struct t2fs_inode inode;
+	int ret = 0;
+	if ((ret = readInode(0, &inode, mnt->partition)))
+		return ret;
+
+	int blockAddr = blockAddrFromInode(logical, &inode, mnt->info.superbloco.blockSize);
+	if (blockAddr < 0)
+		return blockAddr;
+
+	return writeBlock(blockAddr, buffer);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Acrescenta um bloco (zerado) ao diretorio raiz
+
+Retorno:
+		 #: Indice logico do novo bloco
+		<0: Erro na alocacao
+-----------------------------------------------------------------------------*/
+static int appendDirBlock(struct t2fs_inode* dirInode) {
+	int indexBlk = allocBlockOrInode(1, mnt->partition);
+	if (indexBlk < 0) {
+		DEBUG("#ERRO appendDirBlock: erro ao alocar novo bloco\n");
+		return indexBlk;
+	}
+
+	int ret = 0;
+	if ((ret = addBlockOnInode(dirInode, mnt->info.superbloco.blockSize, indexBlk))) {
+		DEBUG("#ERRO appendDirBlock: erro ao adicionar bloco no inode\n");
+		disallocBlockOrInode(1, mnt->partition, indexBlk);
+		return ret;
+	}
+
+	dirInode->bytesFileSize = dirInode->blocksFileSize * SECTOR_SIZE * mnt->info.superbloco.blockSize;
+	if ((ret = writeInode(0, *dirInode, mnt->partition)))
+		return ret;
+
+	return dirInode->blocksFileSize - 1;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Procura "filename" no bucket (e nos blocos de overflow) do seu hash
+
+Retorno:
+		 #: posicao da entrada + 1
+		 0: Nao encontrado
+		<0: Erro na leitura do diretorio
+-----------------------------------------------------------------------------*/
+static int hashDirLookup(char* filename, struct t2fs_record* record) {
+	unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * mnt->info.superbloco.blockSize);
+	struct t2fs_hashdir* header = (struct t2fs_hashdir*)buffer;
+	struct t2fs_hashbucket* bucket = (struct t2fs_hashbucket*)buffer;
+	struct t2fs_record* pRecord = (struct t2fs_record*)buffer;
+
+	int ret = 0;
+	if ((ret = readDirBlock(0, buffer))) {
+		free(buffer);
+		return ret;
+	}
+
+	DWORD logical = header->table[hashDirName(filename) & ((1u << header->globalDepth) - 1)];
+
+	while (logical) {
+		if ((ret = readDirBlock(logical, buffer))) {
+			free(buffer);
+			return ret;
+		}
+
+		for (DWORD slot = 1; slot <= bucket->count; slot++) {
+			if (!strcmp(filename, pRecord[slot].name)) {
+				*record = pRecord[slot];
+				free(buffer);
+				return logical * HASHDIR_RECORDS + slot + 1;
+			}
+		}
+
+		logical = bucket->overflow;
+	}
+
+	free(buffer);
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Inclui uma entrada no diretorio com hash.
+		Bucket com espaco: a entrada eh gravada nele. Bucket cheio: eh dividido
+		em dois (dobrando a tabela, se necessario) e a insercao eh repetida; na
+		profundidade maxima a entrada vai para um bloco de overflow.
+-----------------------------------------------------------------------------*/
+static int hashDirInsert(struct t2fs_record record) {
+	DWORD blockSizeBytes = SECTOR_SIZE * mnt->info.superbloco.blockSize;
+	DWORD maxDepth = hashDirMaxDepth();
+	unsigned int hash = hashDirName(record.name);
+
+	unsigned char* headerBuffer = (unsigned char*)malloc(blockSizeBytes);
+	unsigned char* bucketBuffer = (unsigned char*)malloc(blockSizeBytes);
+	unsigned char* newBuffer = (unsigned char*)malloc(blockSizeBytes);
+	struct t2fs_hashdir* header = (struct t2fs_hashdir*)headerBuffer;
+	struct t2fs_hashbucket* bucket = (struct t2fs_hashbucket*)bucketBuffer;
+	struct t2fs_hashbucket* newBucket = (struct t2fs_hashbucket*)newBuffer;
+	struct t2fs_record* bucketRecords = (struct t2fs_record*)bucketBuffer;
+	struct t2fs_record* newRecords = (struct t2fs_record*)newBuffer;
+
+	int ret = 0;
+	for (;;) {
+		if ((ret = readDirBlock(0, headerBuffer)))
+			break;
+
+		DWORD logical = header->table[hash & ((1u << header->globalDepth) - 1)];
+		if ((ret = readDirBlock(logical, bucketBuffer)))
+			break;
+
+		if (bucket->count < HASHDIR_RECORDS - 1) {
+			bucketRecords[++bucket->count] = record;
+			ret = writeDirBlock(logical, bucketBuffer);
+			break;
+		}
+
+		// Profundidade maxima: procura espaco na cadeia de overflow ou cria um bloco
+		if (bucket->localDepth >= maxDepth) {
+			while (bucket->overflow && bucket->count >= HASHDIR_RECORDS - 1) {
+				logical = bucket->overflow;
+				if ((ret = readDirBlock(logical, bucketBuffer)))
+					break;
+			}
+			if (ret)
+				break;
+
+			if (bucket->count < HASHDIR_RECORDS - 1) {
+				bucketRecords[++bucket->count] = record;
+				ret = writeDirBlock(logical, bucketBuffer);
+				break;
+			}
+
+			struct t2fs_inode dirInode;
+			readInode(0, &dirInode, mnt->partition);
+			int overflow = appendDirBlock(&dirInode);
+			if (overflow < 0) {
+				ret = overflow;
+				break;
+			}
+
+			bucket->overflow = overflow;
+			if ((ret = writeDirBlock(logical, bucketBuffer)))
+				break;
+
+			memset(newBuffer, 0, blockSizeBytes);
+			newBucket->localDepth = bucket->localDepth;
+			newBucket->count = 1;
+			newRecords[1] = record;
+			ret = writeDirBlock(overflow, newBuffer);
+			break;
+		}
+
+		// Dobra a tabela: a segunda metade aponta para os mesmos buckets
+		if (bucket->localDepth == header->globalDepth) {
+			DWORD size = 1u << header->globalDepth;
+			for (DWORD i = 0; i < size; i++)
+				header->table[size + i] = header->table[i];
+			header->globalDepth++;
+		}
+
+		// Divide o bucket pelo bit "localDepth" do hash
+		struct t2fs_inode dirInode;
+		readInode(0, &dirInode, mnt->partition);
+		int split = appendDirBlock(&dirInode);
+		if (split < 0) {
+			ret = split;
+			break;
+		}
+
+		DWORD bit = 1u << bucket->localDepth;
+		memset(newBuffer, 0, blockSizeBytes);
+		bucket->localDepth++;
+		newBucket->localDepth = bucket->localDepth;
+
+		DWORD kept = 0;
+		for (DWORD slot = 1; slot <= bucket->count; slot++) {
+			if (hashDirName(bucketRecords[slot].name) & bit)
+				newRecords[++newBucket->count] = bucketRecords[slot];
+			else
+				bucketRecords[++kept] = bucketRecords[slot];
+		}
+		memset(&bucketRecords[kept + 1], 0, (bucket->count - kept) * sizeof(struct t2fs_record));
+		bucket->count = kept;
+
+		for (DWORD i = 0; i < (1u << header->globalDepth); i++)
+			if (header->table[i] == logical && (i & bit))
+				header->table[i] = split;
+
+		if ((ret = writeDirBlock(logical, bucketBuffer)) || (ret = writeDirBlock(split, newBuffer)) || (ret = writeDirBlock(0, headerBuffer)))
+			break;
+	}
+
+	free(headerBuffer);
+	free(bucketBuffer);
+	free(newBuffer);
+
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Remove a entrada na posicao "position", movendo para o seu lugar a
+		ultima entrada do mesmo bloco
+-----------------------------------------------------------------------------*/
+static int hashDirRemove(int position) {
+	DWORD logical = position / HASHDIR_RECORDS;
+	DWORD slot = position % HASHDIR_RECORDS;
+
+	unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * mnt->info.superbloco.blockSize);
+	struct t2fs_hashbucket* bucket = (struct t2fs_hashbucket*)buffer;
+	struct t2fs_record* pRecord = (struct t2fs_record*)buffer;
+
+	int ret = 0;
+	if (logical == 0 || (ret = readDirBlock(logical, buffer))) {
+		free(buffer);
+		return ret ? ret : -8;
+	}
+
+	if (slot == 0 || slot > bucket->count) {
+		free(buffer);
+		return -8;
+	}
+
+	pRecord[slot] = pRecord[bucket->count];
+	memset(&pRecord[bucket->count], 0, sizeof(struct t2fs_record));
+	bucket->count--;
+
+	ret = writeDirBlock(logical, buffer);
+	free(buffer);
+
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna a primeira entrada ocupada a partir da posicao "position"
+		(percorre os buckets em ordem de bloco logico)
+
+Retorno:
+		 #: Posicao da entrada copiada para "record"
+		-8: Nao ha mais entradas
+-----------------------------------------------------------------------------*/
+static int hashDirNext(int position, struct t2fs_record* record) {
+	struct t2fs_inode inode;
+	int ret = 0;
+	if ((ret = readInode(0, &inode, mnt->partition)))
+		return ret;
+
+	unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * mnt->info.superbloco.blockSize);
+	struct t2fs_hashbucket* bucket = (struct t2fs_hashbucket*)buffer;
+	struct t2fs_record* pRecord = (struct t2fs_record*)buffer;
+
+	DWORD logical = MAX(position / HASHDIR_RECORDS, 1);
+	DWORD slot = (logical * HASHDIR_RECORDS > position) ? 1 : MAX(position % HASHDIR_RECORDS, 1);
+
+	for (; logical < inode.blocksFileSize; logical++, slot = 1) {
+		if ((ret = readDirBlock(logical, buffer))) {
+			free(buffer);
+			return ret;
+		}
+		if (slot <= bucket->count) {
+			*record = pRecord[slot];
+			free(buffer);
+			return logical * HASHDIR_RECORDS + slot;
+		}
+	}
+
+	free(buffer);
+	return -8;
+}
+
 
 
 /*-----------------------------------------------------------------------------
@@ -1018,78 +3052,187 @@ Retorno:
 		 #: Endereço do bloco lido
 -----------------------------------------------------------------------------*/
 static int readBlockFromInode(int index, struct t2fs_inode inode, int sectors_per_block, int partition, unsigned char* buffer) {
-	unsigned long long int maxIndirSimples = sectors_per_block * SECTOR_SIZE / sizeof(DWORD);
-
-	if (index >= inode.blocksFileSize || index < 0) {
+	int blockAddr = blockAddrFromInode(index, &inode, sectors_per_block);
+	if (blockAddr < 0) {
 		DEBUG("#ERRO readBlockFromInode: inode nao contem esse indice\n");
+		return blockAddr;
+	}
+
+	readBlock(blockAddr, buffer);
+
+	return blockAddr;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna o indice na particao do bloco "index" do inode, lendo (pela
+		cache de blocos) apenas os ponteiros necessarios dos blocos de indirecao
+
+Retorno:
+		 #: Indice do bloco na particao
+		-5: Erro na leitura de um bloco de indirecao
+		-9: Inode nao contem esse indice
+-----------------------------------------------------------------------------*/
+static int blockAddrFromInode(int index, struct t2fs_inode* inode, int sectors_per_block) {
+	DWORD maxIndirSimples = sectors_per_block * SECTOR_SIZE / sizeof(DWORD);
+
+	if (index < 0 || index >= inode->blocksFileSize)
 		return -9;
+
+	if (index < 2)
+		return inode->dataPtr[index];
+
+	DWORD pointer = 0;
+	DWORD offset = index - 2;
+
+	if (offset < maxIndirSimples) {
+		if (readBlockCache(mnt->cache, inode->singleIndPtr, offset * sizeof(DWORD), sizeof(DWORD), (unsigned char*)&pointer))
+			return -5;
+		return pointer;
+	}
+
+	offset -= maxIndirSimples;
+	if (offset < maxIndirSimples * maxIndirSimples) {
+		DWORD indir = 0;
+		if (readBlockCache(mnt->cache, inode->doubleIndPtr, offset / maxIndirSimples * sizeof(DWORD), sizeof(DWORD), (unsigned char*)&indir) ||
+			readBlockCache(mnt->cache, indir, offset % maxIndirSimples * sizeof(DWORD), sizeof(DWORD), (unsigned char*)&pointer))
+			return -5;
+		return pointer;
+	}
+
+	return -9;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna o indice na particao do bloco "index" do inode "inodeNumber",
+		consultando o mapa de blocos "map" (do handle, ou de uma chamada
+		posicional). Se o bloco estiver fora do intervalo mapeado, o bloco de
+		indirecao correspondente eh lido inteiro para o mapa.
+
+Retorno:
+		 #: Indice do bloco na particao
+		-5: Erro na leitura de um bloco de indirecao
+		-9: Inode nao contem esse indice
+-----------------------------------------------------------------------------*/
+static int mapBlock(struct t2fs_blockmap* map, DWORD inodeNumber, int index, struct t2fs_inode* inode) {
+	int sectors_per_block = mnt->info.superbloco.blockSize;
+	DWORD maxIndirSimples = sectors_per_block * SECTOR_SIZE / sizeof(DWORD);
+
+	// Ponteiros diretos estao no proprio inode
+	if (index < 2 || index >= inode->blocksFileSize)
+		return blockAddrFromInode(index, inode, sectors_per_block);
+
+	unsigned int epoch = __atomic_load_n(&mnt->blockMapEpoch, __ATOMIC_ACQUIRE);
+	if (map->count && map->epoch == epoch && map->inodeNumber == inodeNumber && index >= map->first && index < map->first + map->count) {
+		__atomic_add_fetch(&mnt->blockMapHits, 1, __ATOMIC_RELAXED);
+		return map->addrs[index - map->first];
+	}
+	__atomic_add_fetch(&mnt->blockMapMisses, 1, __ATOMIC_RELAXED);
+
+	// O tamanho do bloco depende da montagem do arquivo aberto antes na mesma posicao
+	if (map->size < maxIndirSimples) {
+		DWORD* addrs = (DWORD*)realloc(map->addrs, maxIndirSimples * sizeof(DWORD));
+		if (addrs == NULL)
+			return blockAddrFromInode(index, inode, sectors_per_block);
+		map->addrs = addrs;
+		map->size = maxIndirSimples;
 	}
 
-	DWORD setor_inicial = 0;
-	partitionSectors(partition, &setor_inicial, NULL);
+	DWORD offset = index - 2;
+	DWORD first = 2;
+	DWORD pointerBlock = inode->singleIndPtr;
 
-	if (index < 2) {
-		DWORD readIndex = setor_inicial + inode.dataPtr[index] * sectors_per_block;
-		for (int i = 0; i < sectors_per_block; i++)
-			read_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
-		return inode.dataPtr[index];
+	if (offset >= maxIndirSimples) {
+		offset -= maxIndirSimples;
+		first = 2 + maxIndirSimples + offset / maxIndirSimples * maxIndirSimples;
+		if (readBlockCache(mnt->cache, inode->doubleIndPtr, offset / maxIndirSimples * sizeof(DWORD), sizeof(DWORD), (unsigned char*)&pointerBlock))
+			return -5;
 	}
-	else if ((index - 2) < maxIndirSimples) {
-		index -= 2;
 
-		DWORD readIndex = setor_inicial + inode.singleIndPtr * sectors_per_block;
+	map->count = 0;
+	if (readBlock(pointerBlock, (unsigned char*)map->addrs))
+		return -5;
 
-		unsigned char* indSimp = (unsigned char*)malloc(SECTOR_SIZE * sectors_per_block);
-		for (int i = 0; i < sectors_per_block; i++)
-			read_sector(readIndex + i, &indSimp[i * SECTOR_SIZE]);
+	map->inodeNumber = inodeNumber;
+	map->epoch = epoch;
+	map->first = first;
+	map->count = MIN(maxIndirSimples, inode->blocksFileSize - first);
 
-		DWORD* pIndirSimples = (DWORD*)indSimp;
-		readIndex = setor_inicial + pIndirSimples[index] * sectors_per_block;
-
-		for (int i = 0; i < sectors_per_block; i++)
-			read_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
-
-		DWORD indexRet = pIndirSimples[index];
-		free(indSimp);
+	return map->addrs[index - first];
+}
 
-		return indexRet;
-	}
-	else if ((index - maxIndirSimples - 2) < (maxIndirSimples * maxIndirSimples)) {
-		index -= (2 + maxIndirSimples);
-		DWORD indexIndir1 = index / maxIndirSimples;
-		DWORD indexIndir2 = index % maxIndirSimples;
+/*-----------------------------------------------------------------------------
+Funcao:	Invalida os mapas de blocos de todos os handles (sao preenchidos de novo
+		na proxima consulta). Deve ser chamada quando os blocos de um inode
+		forem liberados (clearInodeBlocks)
+-----------------------------------------------------------------------------*/
+static void invalidateBlockMaps(void) {
+	__atomic_add_fetch(&mnt->blockMapEpoch, 1, __ATOMIC_RELEASE);
+}
 
-		DWORD readIndex = setor_inicial + inode.doubleIndPtr * sectors_per_block;
+/*-----------------------------------------------------------------------------
+Funcao:	Atualiza o padrao de acesso do handle para uma leitura dos blocos
+		logicos "firstBlk" ate "lastBlk" e, se ela for sequencial, carrega na
+		cache de blocos os blocos ainda nao antecipados dessa leitura e da
+		janela seguinte (um prefetchBlockCache por sequencia contigua)
+-----------------------------------------------------------------------------*/
+static void readAheadFile(struct t2fs_openfile* file, DWORD firstBlk, DWORD lastBlk, struct t2fs_inode* inode) {
+	struct t2fs_readahead* ra = &file->readAhead;
 
-		unsigned char* indDupla = (unsigned char*)malloc(SECTOR_SIZE * sectors_per_block);
-		for (int i = 0; i < sectors_per_block; i++)
-			read_sector(readIndex + i, &indDupla[i * SECTOR_SIZE]);
-		DWORD* pIndirDupla = (DWORD*)indDupla;
-		DWORD indDupla1 = pIndirDupla[indexIndir1];
-		
-		readIndex = setor_inicial + indDupla1 * sectors_per_block;
+	int sequential = (firstBlk == ra->nextBlock || firstBlk + 1 == ra->nextBlock);
+	ra->nextBlock = lastBlk + 1;
 
-		for (int i = 0; i < sectors_per_block; i++)
-			read_sector(readIndex + i, &indDupla[i * SECTOR_SIZE]);
+	if (mnt->readAheadMax <= 0 || !sequential) {
+		ra->window = 0;
+		ra->end = 0;
+		return;
+	}
 
-		pIndirDupla = (DWORD*)indDupla;
-		indDupla1 = pIndirDupla[indexIndir2];
-		readIndex = setor_inicial + indDupla1 * sectors_per_block;
+	ra->window = ra->window ? MIN(ra->window * 2, mnt->readAheadMax) : MIN(READAHEAD_MIN_WINDOW, mnt->readAheadMax);
 
-		for (int i = 0; i < sectors_per_block; i++)
-			read_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
+	// Ainda ha pelo menos meia janela antecipada a frente desta leitura
+	if (ra->end > lastBlk + ra->window / 2)
+		return;
 
-		DWORD indexRet = indDupla1;
-		free(indDupla);
+	fillReadAhead(file, MAX(firstBlk, ra->end), lastBlk, inode);
+}
 
-		return indexRet;
+/*-----------------------------------------------------------------------------
+Funcao:	Carrega na cache os blocos logicos a partir de "from" ate a janela
+		seguinte a "lastBlk", limitados a readAheadLimit blocos. Leituras
+		maiores que o limite chamam de novo ao alcancar file->readAhead.end
+-----------------------------------------------------------------------------*/
+static void fillReadAhead(struct t2fs_openfile* file, DWORD from, DWORD lastBlk, struct t2fs_inode* inode) {
+	struct t2fs_readahead* ra = &file->readAhead;
+
+	DWORD to = MIN(lastBlk + 1 + ra->window, inode->blocksFileSize);
+	to = MIN(to, from + mnt->readAheadLimit);
+
+	// Todos os blocos da janela, mesmo fragmentados, vao para o disco em um unico lote
+	if (file->readAheadSize < mnt->readAheadLimit + 1) {
+		unsigned int* blocks = (unsigned int*)realloc(file->readAheadBlocks, (mnt->readAheadLimit + 1) * sizeof(unsigned int));
+		if (blocks == NULL) {
+			ra->end = from;
+			return;
+		}
+		file->readAheadBlocks = blocks;
+		file->readAheadSize = mnt->readAheadLimit + 1;
 	}
-	else {
-		DEBUG("#ERRO readBlockFromInode: indice invalido para esse inode\n");
-		return -9;
+
+	unsigned int* blocks = file->readAheadBlocks;
+	DWORD b = from;
+	int count = 0;
+	while (b < to) {
+		int blockAddr = mapBlock(&file->map, file->record.inodeNumber, b, inode);
+		if (blockAddr < 0)
+			break;
+		blocks[count++] = blockAddr;
+		b++;
 	}
 
-	return 0;
+	if (count > 0 && prefetchBlockList(mnt->cache, blocks, count) < 0)
+		b = from;
+
+	ra->end = b;
 }
 
 /*-----------------------------------------------------------------------------
@@ -1102,69 +3245,30 @@ Retorno:
 		 0: Sucesso
 -----------------------------------------------------------------------------*/
 static int clearInodeBlocks(struct t2fs_inode* inode, int sectors_per_block) {
-	unsigned long long int maxIndirSimples = sectors_per_block * SECTOR_SIZE / sizeof(DWORD);
-
-	DWORD setor_inicial = 0;
-	partitionSectors(partitionMounted, &setor_inicial, NULL);
-
-	DWORD index = inode->blocksFileSize;
-
-	for (int i = index - 1; i >= 0; i--) {
-		if (index < 2)
-			disallocBlockOrInode(1, partitionMounted, inode->dataPtr[index]);
-		else if ((index - 2) < maxIndirSimples) {
-			index -= 2;
-
-			DWORD readIndex = setor_inicial + inode->singleIndPtr * sectors_per_block;
-			unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * sectors_per_block);
-			for (int i = 0; i < sectors_per_block; i++)
-				read_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
-
-			DWORD* pIndirSimples = (DWORD*)buffer;
-			disallocBlockOrInode(1, partitionMounted, pIndirSimples[index]);
-
-			for (int i = 0; i < sectors_per_block; i++)
-				write_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
-
-			free(buffer);
-
-			if(!index)
-				disallocBlockOrInode(1, partitionMounted, inode->singleIndPtr);
-
-		}
-		else if ((index - maxIndirSimples - 2) < (maxIndirSimples * maxIndirSimples)) {
-			index -= (2 + maxIndirSimples);
-
-			DWORD indexIndir1 = index / maxIndirSimples;
-			DWORD indexIndir2 = index % maxIndirSimples;
-
-			DWORD readIndex = setor_inicial + inode->doubleIndPtr * sectors_per_block;
-			unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * sectors_per_block);
-			for (int i = 0; i < sectors_per_block; i++)
-				read_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
-
-			DWORD* pIndirDupla1 = (DWORD*)buffer;
-			
-			readIndex = setor_inicial + pIndirDupla1[indexIndir1] * sectors_per_block;
-			for (int i = 0; i < sectors_per_block; i++)
-				read_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
-
-			DWORD* pIndirDupla2 = (DWORD*)buffer;
-			disallocBlockOrInode(1, partitionMounted, pIndirDupla2[indexIndir2]);
-
-			for (int i = 0; i < sectors_per_block; i++)
-				write_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
-
-			free(buffer);
-
-			if (pIndirDupla1[indexIndir1] == 0)
-				disallocBlockOrInode(1, partitionMounted, pIndirDupla1[indexIndir1]);
+	DWORD maxIndirSimples = sectors_per_block * SECTOR_SIZE / sizeof(DWORD);
+	DWORD blocks = inode->blocksFileSize;
+
+	// Blocos de dados (os ponteiros das indirecoes sao lidos pela cache de blocos)
+	for (DWORD i = 0; i < blocks; i++) {
+		int blockAddr = blockAddrFromInode(i, inode, sectors_per_block);
+		if (blockAddr >= 0)
+			disallocBlockOrInode(1, mnt->partition, blockAddr);
+	}
 
-			if (!index)
-				disallocBlockOrInode(1, partitionMounted, inode->doubleIndPtr);
+	// Blocos de indirecao
+	if (blocks > 2)
+		disallocBlockOrInode(1, mnt->partition, inode->singleIndPtr);
 
+	if (blocks > 2 + maxIndirSimples) {
+		DWORD indirBlocks = (blocks - 2 - maxIndirSimples + maxIndirSimples - 1) / maxIndirSimples;
+		for (DWORD j = 0; j < indirBlocks; j++) {
+			DWORD indir = 0;
+			if (!readBlockCache(mnt->cache, inode->doubleIndPtr, j * sizeof(DWORD), sizeof(DWORD), (unsigned char*)&indir))
+				disallocBlockOrInode(1, mnt->partition, indir);
 		}
+		disallocBlockOrInode(1, mnt->partition, inode->doubleIndPtr);
 	}
+
 	inode->blocksFileSize = 0;
 	inode->bytesFileSize = 0;
 	inode->dataPtr[0] = 0;
@@ -1188,9 +3292,6 @@ Retorno:
 static int addBlockOnInode(struct t2fs_inode *inode, int sectors_per_block, DWORD blockID) {
 	unsigned long long int maxIndirSimples = sectors_per_block * SECTOR_SIZE / sizeof(DWORD);
 
-	DWORD setor_inicial = 0;
-	partitionSectors(partitionMounted, &setor_inicial, NULL);
-
 	DWORD index = inode->blocksFileSize;
 
 	if (index < 2)
@@ -1199,7 +3300,7 @@ static int addBlockOnInode(struct t2fs_inode *inode, int sectors_per_block, DWOR
 		index -= 2;
 
 		if (inode->singleIndPtr == 0) {
-			DWORD indexBlk = allocBlockOrInode(1, partitionMounted);
+			int indexBlk = allocBlockOrInode(1, mnt->partition);
 			if (indexBlk < 0) {
 				DEBUG("#ERRO addBlockOnInode: erro ao alocar novo bloco\n");
 				return indexBlk;
@@ -1207,14 +3308,12 @@ static int addBlockOnInode(struct t2fs_inode *inode, int sectors_per_block, DWOR
 			inode->singleIndPtr = indexBlk;
 		}
 
-		DWORD readIndex = setor_inicial + inode->singleIndPtr * sectors_per_block;
+		DWORD readIndex = inode->singleIndPtr;
 		unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * sectors_per_block);
-		for (int i = 0; i < sectors_per_block; i++)
-			read_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
+		readBlock(readIndex, buffer);
 		DWORD* pIndirSimples = (DWORD*)buffer;
 		pIndirSimples[index] = blockID;
-		for (int i = 0; i < sectors_per_block; i++)
-			write_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
+		writeBlock(readIndex, buffer);
 
 		free(buffer);
 	}
@@ -1222,7 +3321,7 @@ static int addBlockOnInode(struct t2fs_inode *inode, int sectors_per_block, DWOR
 		index -= (2 + maxIndirSimples);
 
 		if (inode->doubleIndPtr == 0) {
-			DWORD indexBlk = allocBlockOrInode(1, partitionMounted);
+			int indexBlk = allocBlockOrInode(1, mnt->partition);
 			if (indexBlk < 0) {
 				DEBUG("#ERRO addBlockOnInode: erro ao alocar novo bloco\n");
 				return indexBlk;
@@ -1233,14 +3332,13 @@ static int addBlockOnInode(struct t2fs_inode *inode, int sectors_per_block, DWOR
 		DWORD indexIndir1 = index / maxIndirSimples;
 		DWORD indexIndir2 = index % maxIndirSimples;
 
-		DWORD readIndex = setor_inicial + inode->doubleIndPtr * sectors_per_block;
+		DWORD readIndex = inode->doubleIndPtr;
 		unsigned char* buffer = (unsigned char*)malloc(SECTOR_SIZE * sectors_per_block);
-		for (int i = 0; i < sectors_per_block; i++)
-			read_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
+		readBlock(readIndex, buffer);
 
 		DWORD* pIndirDupla1 = (DWORD*)buffer;
 		if (pIndirDupla1[indexIndir1] == 0) {
-			DWORD indexBlk = allocBlockOrInode(1, partitionMounted);
+			int indexBlk = allocBlockOrInode(1, mnt->partition);
 			if (indexBlk < 0) {
 				DEBUG("#ERRO addBlockOnInode: erro ao alocar novo bloco\n");
 				return indexBlk;
@@ -1249,151 +3347,693 @@ static int addBlockOnInode(struct t2fs_inode *inode, int sectors_per_block, DWOR
 			////DEBUG("#INFO addBlockOnInode: indexBlk = %u\n", indexBlk);
 
 			pIndirDupla1[indexIndir1] = indexBlk;
-			for (int i = 0; i < sectors_per_block; i++)
-				write_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
+			writeBlock(readIndex, buffer);
 		}
 
-		readIndex = setor_inicial + pIndirDupla1[indexIndir1] * sectors_per_block;
-		for (int i = 0; i < sectors_per_block; i++)
-			read_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
+		readIndex = pIndirDupla1[indexIndir1];
+		readBlock(readIndex, buffer);
 		DWORD* pIndirDupla2 = (DWORD*)buffer;
 		pIndirDupla2[indexIndir2] = blockID;
-		for (int i = 0; i < sectors_per_block; i++)
-			write_sector(readIndex + i, &buffer[i * SECTOR_SIZE]);
+		writeBlock(readIndex, buffer);
+
+		free(buffer);
+	}
+	else {
+		DEBUG("#ERRO addBlockOnInode: inode excede o limite de blocos\n");
+		return -12;
+	}
+
+	inode->blocksFileSize++;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Desaloca um bloco ou inode
+
+Entrada:
+		isBlock:	TRUE: alocar 1 bloco
+					FALSE: alocar 1 inode
+		index:		Indice a ser desalocado
+Retorno:
+		0: Sucesso
+-----------------------------------------------------------------------------*/
+static int disallocBlockOrInode(int isBlock, int partition, int index) {
+	int ret = 0;
+	struct t2fs_mountinfo info;
+	if ((ret = partitionInfo(partition, &info)))
+		return ret;
+
+	int indexToRemove = index;
+
+	if (isBlock)
+		indexToRemove -= info.firstDataBlock;
+
+	lockMutex(&mnt->allocLock);
+	if (setBitmap2(mnt->bitmaps, isBlock, indexToRemove, 0)) {
+		DEBUG("#ERRO allocBlockOrInode: erro ao alterar bitmap\n");
+		ret = -7;
+	}
+	unlockMutex(&mnt->allocLock);
+	
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Aloca um bloco ou inode e retorna o indice dele
+
+Entrada:
+		isBlock:	TRUE: alocar 1 bloco
+					FALSE: alocar 1 inode
+Retorno:
+		 #: Identificador do bloco/inode alocado
+		-3: Numero da particao invalido
+		-7: Erro em operacoes com funcoes de bitmap
+-----------------------------------------------------------------------------*/
+static int allocBlockOrInode(int isBlock, int partition) {
+	int ret = 0;
+	struct t2fs_mountinfo info;
+	if ((ret = partitionInfo(partition, &info)))
+		return ret;
+	struct t2fs_superbloco superbloco = info.superbloco;
+
+	DWORD numMax = 0;
+
+	if(isBlock)
+		numMax = superbloco.diskSize - info.firstDataBlock;
+	else
+		numMax = superbloco.inodeAreaSize * superbloco.blockSize * (SECTOR_SIZE / sizeof(struct t2fs_inode));
+
+	// Menor indice livre, a partir da dica mantida pelo bitmap (ja marcado como ocupado);
+	// um bloco so eh alocado se sobrar um alem dos reservados para os dados adiados
+	lockMutex(&mnt->allocLock);
+	int index = -1;
+	if (!isBlock || availableBlocks(numMax) > 0)
+		index = allocBitmap2(mnt->bitmaps, isBlock, numMax);
+	if (isBlock && index >= 0)
+		consumeReserved(1);
+	unlockMutex(&mnt->allocLock);
+	if (index < 0) {
+		DEBUG("#ERRO allocBlockOrInode: erro ao buscar bitmap\n");
+		return -7;
+	}
+
+	// Se for um bloco, limpar o conteudo dele
+	if (isBlock) {
+		index += info.firstDataBlock;
+
+		DWORD writeIndex = index;
+
+		unsigned char* buffer = (unsigned char*)calloc(SECTOR_SIZE * superbloco.blockSize, sizeof(unsigned char));
+		writeBlock(writeIndex, buffer);
+		free(buffer);
+	}
+	
+	return index;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Aloca ate "count" blocos de dados contiguos na particao montada, em uma
+		unica busca no bitmap, de preferencia comecando no bloco "goal"
+
+Entrada:
+		goal:		indice (na particao) preferido para o primeiro bloco
+					(0: qualquer posicao)
+		count:		qtde de blocos desejada
+		allocated:	recebe a qtde de blocos alocados (entre 1 e count)
+		zeroFill:	FALSE quando o chamador vai sobrescrever os blocos inteiros
+					(o conteudo nao eh zerado no disco)
+Retorno:
+		 #: Indice (na particao) do primeiro bloco alocado
+		-7: Erro em operacoes com funcoes de bitmap
+-----------------------------------------------------------------------------*/
+static int allocBlocks(DWORD goal, int count, int* allocated, int zeroFill) {
+	DWORD numMax = mnt->info.superbloco.diskSize - mnt->info.firstDataBlock;
+	int goalBit = goal >= mnt->info.firstDataBlock ? (int)(goal - mnt->info.firstDataBlock) : -1;
+
+	// Os blocos reservados para os dados adiados ficam de fora
+	lockMutex(&mnt->allocLock);
+	int first = -1;
+	count = MIN(count, availableBlocks(numMax));
+	if (count > 0)
+		first = allocExtentBitmap2(mnt->bitmaps, BITMAP_DADOS, goalBit, count, numMax, allocated);
+	if (first >= 0)
+		consumeReserved(*allocated);
+	unlockMutex(&mnt->allocLock);
+	if (first < 0) {
+		DEBUG("#ERRO allocBlocks: erro ao buscar bitmap\n");
+		return -7;
+	}
+	first += mnt->info.firstDataBlock;
+
+	if (!zeroFill)
+		return first;
+
+	// Limpa o conteudo dos blocos
+	unsigned char* buffer = (unsigned char*)calloc(SECTOR_SIZE * mnt->info.superbloco.blockSize, sizeof(unsigned char));
+	for (int i = 0; i < *allocated; i++)
+		writeBlock(first + i, buffer);
+	free(buffer);
+
+	return first;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le um inode. Na particao montada ele vem da tabela de inodes em memoria
+-----------------------------------------------------------------------------*/
+static int readInode(int index, struct t2fs_inode *inode, int partition) {
+	if (partition == mnt->partition) {
+		lockMutex(&mnt->inodeTableLock);
+		struct t2fs_incore* entry = getIncoreInode(index, 1);
+		if (entry)
+			*inode = entry->inode;
+		unlockMutex(&mnt->inodeTableLock);
+		if (entry)
+			return 0;
+	}
+
+	return loadInode(index, inode, partition);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Escreve um inode. Na particao montada apenas a copia em memoria eh
+		alterada; ela eh gravada no close2, sync2 ou umount (syncInodes)
+-----------------------------------------------------------------------------*/
+static int writeInode(int index, struct t2fs_inode inode, int partition) {
+	if (partition == mnt->partition) {
+		lockMutex(&mnt->inodeTableLock);
+		struct t2fs_incore* entry = getIncoreInode(index, 0);
+		if (entry) {
+			entry->inode = inode;
+			entry->dirty = 1;
+		}
+		unlockMutex(&mnt->inodeTableLock);
+		if (entry)
+			return 0;
+	}
+
+	return storeInode(index, inode, partition);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna a entrada da tabela de inodes para o inode "index", carregando-o
+		da area de inodes se "load" e ele nao estiver na tabela. A entrada
+		substituida eh a usada menos recentemente entre as que nao tem handles;
+		se todas tem, a tabela cresce. O chamador prende inodeTableLock.
+
+Retorno:
+		 #: Entrada do inode
+		 NULL: Erro de E/S ou na alocacao de memoria
+-----------------------------------------------------------------------------*/
+static struct t2fs_incore* getIncoreInode(int index, int load) {
+	struct t2fs_incore* victim = findIncoreInode(index);
+	if (victim != NULL) {
+		mnt->inodeHits++;
+		victim->lastUse = ++mnt->inodeClock;
+		return victim;
+	}
+
+	for (int i = 0; i < mnt->inodeTableSize; i++) {
+		struct t2fs_incore* entry = &mnt->inodeTable[i];
+		if (!entry->valid) {
+			if (victim == NULL || victim->valid)
+				victim = entry;
+		}
+		else if (entry->refCount == 0 && (victim == NULL || (victim->valid && entry->lastUse < victim->lastUse)))
+			victim = entry;
+	}
+
+	if (victim == NULL && (victim = growInodeTable()) == NULL)
+		return NULL;
+
+	mnt->inodeMisses++;
+
+	if (victim->valid && victim->dirty && storeInode(victim->inodeNumber, victim->inode, mnt->partition))
+		return NULL;
+
+	if (victim->valid)
+		unhashIncoreInode(victim);
+	victim->valid = 0;
+	if (load && loadInode(index, &victim->inode, mnt->partition))
+		return NULL;
+
+	victim->valid = 1;
+	victim->dirty = 0;
+	victim->refCount = 0;
+	victim->inodeNumber = index;
+	victim->lastUse = ++mnt->inodeClock;
+	hashIncoreInode(victim);
+
+	return victim;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Prende o inode na tabela em memoria enquanto houver um handle aberto
+
+Retorno:
+		 0: Sucesso
+		-5: Erro na leitura do inode ou na alocacao de memoria
+-----------------------------------------------------------------------------*/
+static int acquireInode(int index) {
+	lockMutex(&mnt->inodeTableLock);
+	struct t2fs_incore* entry = getIncoreInode(index, 1);
+	if (entry)
+		entry->refCount++;
+	unlockMutex(&mnt->inodeTableLock);
+
+	return entry ? 0 : -5;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Libera a referencia de um handle ao inode e grava a copia em memoria,
+		se ela foi alterada
+-----------------------------------------------------------------------------*/
+static int releaseInode(int index) {
+	int ret = 0;
+
+	lockMutex(&mnt->inodeTableLock);
+	struct t2fs_incore* entry = findIncoreInode(index);
+	if (entry) {
+		if (entry->refCount > 0)
+			entry->refCount--;
+		if (entry->dirty) {
+			if (storeInode(index, entry->inode, mnt->partition))
+				ret = -5;
+			else
+				entry->dirty = 0;
+		}
+	}
+	unlockMutex(&mnt->inodeTableLock);
+
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Grava na cache de blocos todos os inodes alterados da tabela em memoria
+-----------------------------------------------------------------------------*/
+static int syncInodes(void) {
+	int ret = 0;
+
+	lockMutex(&mnt->inodeTableLock);
+	for (int i = 0; i < mnt->inodeTableSize; i++) {
+		struct t2fs_incore* entry = &mnt->inodeTable[i];
+		if (entry->valid && entry->dirty) {
+			if (storeInode(entry->inodeNumber, entry->inode, mnt->partition))
+				ret = -5;
+			else
+				entry->dirty = 0;
+		}
+	}
+	unlockMutex(&mnt->inodeTableLock);
+
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retira da tabela em memoria um inode desalocado (sem gravar)
+-----------------------------------------------------------------------------*/
+static void dropInode(int index) {
+	discardDelayed(index);
+
+	lockMutex(&mnt->inodeTableLock);
+	struct t2fs_incore* entry = findIncoreInode(index);
+	if (entry) {
+		unhashIncoreInode(entry);
+		entry->valid = 0;
+	}
+	unlockMutex(&mnt->inodeTableLock);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna os dados do inode ainda sem blocos na particao (alocacao
+		adiada) e, em "blocks", o numero de blocos com dados. O ponteiro
+		continua valido enquanto o chamador prende o lock do inode.
+
+Retorno:
+		 #: Dados do bloco logico inode.blocksFileSize em diante
+		 NULL: Nenhum dado em memoria
+-----------------------------------------------------------------------------*/
+static unsigned char* delayedData(DWORD inodeNumber, DWORD* blocks) {
+	lockMutex(&mnt->inodeTableLock);
+	struct t2fs_incore* entry = findIncoreInode(inodeNumber);
+	unsigned char* data = entry ? entry->delayed : NULL;
+	*blocks = data ? entry->delayedBlocks : 0;
+	unlockMutex(&mnt->inodeTableLock);
+
+	return data;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Copia os "size" bytes seguintes dos buffers de "io" para os dados em
+		memoria do inode, a partir de "offset" (relativo ao primeiro bloco
+		nao alocado). A area cresce em blocos inteiros, zerados. O chamador
+		prende o lock do inode (exclusivo) e o inode esta preso na tabela por
+		um handle.
+
+Retorno:
+		  0: Sucesso
+		-17: Erro na alocacao de memoria
+-----------------------------------------------------------------------------*/
+static int writeDelayed(DWORD inodeNumber, DWORD offset, struct t2fs_iocursor* io, DWORD size, DWORD blockSizeBytes) {
+	DWORD blocks = (offset + size + blockSizeBytes - 1) / blockSizeBytes;
+
+	lockMutex(&mnt->inodeTableLock);
+	struct t2fs_incore* entry = findIncoreInode(inodeNumber);
+	if (entry != NULL && blocks > entry->delayedSize) {
+		DWORD newSize = MAX(blocks, 2 * entry->delayedSize);
+		unsigned char* data = (unsigned char*)realloc(entry->delayed, newSize * blockSizeBytes);
+		if (data != NULL) {
+			memset(&data[entry->delayedSize * blockSizeBytes], 0, (newSize - entry->delayedSize) * blockSizeBytes);
+			entry->delayed = data;
+			entry->delayedSize = newSize;
+		}
+	}
+	unsigned char* data = NULL;
+	if (entry != NULL && blocks <= entry->delayedSize) {
+		data = entry->delayed;
+		entry->delayedBlocks = MAX(entry->delayedBlocks, blocks);
+	}
+	unlockMutex(&mnt->inodeTableLock);
+
+	if (data == NULL)
+		return -17;
+
+	ioGather(io, &data[offset], size);
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Aloca os blocos dos dados em memoria do inode, em sequencias
+		contiguas a partir do ultimo bloco do arquivo, e grava os dados neles.
+		O chamador prende o lock do inode (exclusivo) ou fsLock exclusivo.
+		Se faltarem blocos, os dados que nao couberam sao descartados e o
+		tamanho do arquivo termina no ultimo bloco alocado.
+
+Retorno:
+		  0: Sucesso (ou nenhum dado em memoria)
+		 <0: Erro na alocacao dos blocos
+-----------------------------------------------------------------------------*/
+static int flushDelayed(DWORD inodeNumber) {
+	lockMutex(&mnt->inodeTableLock);
+	struct t2fs_incore* entry = findIncoreInode(inodeNumber);
+	unsigned char* data = entry ? entry->delayed : NULL;
+	DWORD blocks = data ? entry->delayedBlocks : 0;
+	DWORD reserved = entry ? entry->delayedReserved : 0;
+	if (entry != NULL) {
+		entry->delayed = NULL;
+		entry->delayedBlocks = 0;
+		entry->delayedSize = 0;
+		entry->delayedReserved = 0;
+	}
+	unlockMutex(&mnt->inodeTableLock);
+
+	if (data == NULL) {
+		releaseReserved(reserved);
+		return 0;
+	}
+
+	// A reserva continua valendo e eh consumida pelas alocacoes abaixo
+	reserveCredit = reserved;
+
+	int sectors_per_block = mnt->info.superbloco.blockSize;
+	DWORD blockSizeBytes = SECTOR_SIZE * sectors_per_block;
+	struct t2fs_inode inode;
+	readInode(inodeNumber, &inode, mnt->partition);
+
+	int ret = 0;
+	DWORD done = 0;
+	while (done < blocks && !ret) {
+		int goal = 0;
+		if (inode.blocksFileSize > 0)
+			goal = MAX(blockAddrFromInode(inode.blocksFileSize - 1, &inode, sectors_per_block) + 1, 0);
+
+		// Blocos escritos inteiros logo abaixo: nao precisam ser zerados
+		int allocated = 0;
+		int firstBlk = allocBlocks(goal, blocks - done, &allocated, 0);
+		if (firstBlk < 0) {
+			ret = firstBlk;
+			break;
+		}
+
+		for (int k = 0; k < allocated; k++) {
+			if (ret || (ret = addBlockOnInode(&inode, sectors_per_block, firstBlk + k))) {
+				disallocBlockOrInode(1, mnt->partition, firstBlk + k);
+				continue;
+			}
+			writeBlock(firstBlk + k, &data[(done + k) * blockSizeBytes]);
+		}
+		done += allocated;
+	}
+
+	if (ret) {
+		DEBUG("#ERRO flushDelayed: erro ao alocar os blocos do inode %u (%d)\n", inodeNumber, ret);
+		inode.bytesFileSize = MIN(inode.bytesFileSize, inode.blocksFileSize * blockSizeBytes);
+	}
+	writeInode(inodeNumber, inode, mnt->partition);
+	free(data);
+
+	// Sobra da reserva (blocos de indirecao ja existentes ou falha na alocacao)
+	releaseReserved(reserveCredit);
+	reserveCredit = 0;
+
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Aloca os blocos dos dados em memoria de todos os inodes da tabela
+		(sync2, com fsLock exclusivo)
+
+Retorno:
+		 0: Sucesso
+		-5: Erro na alocacao dos blocos de algum inode
+-----------------------------------------------------------------------------*/
+static int flushAllDelayed(void) {
+	int ret = 0;
+
+	for (int i = 0; ; i++) {
+		lockMutex(&mnt->inodeTableLock);
+		int last = (i >= mnt->inodeTableSize);
+		int pending = !last && mnt->inodeTable[i].valid && mnt->inodeTable[i].delayed != NULL;
+		DWORD inodeNumber = pending ? mnt->inodeTable[i].inodeNumber : 0;
+		unlockMutex(&mnt->inodeTableLock);
 
-		free(buffer);
-	}
-	else {
-		DEBUG("#ERRO addBlockOnInode: inode excede o limite de blocos\n");
-		return -12;
+		if (last)
+			break;
+		if (pending && flushDelayed(inodeNumber))
+			ret = -5;
 	}
 
-	inode->blocksFileSize++;
+	return ret;
+}
 
-	return 0;
+/*-----------------------------------------------------------------------------
+Funcao:	Descarta os dados em memoria do inode (blocos do inode liberados)
+-----------------------------------------------------------------------------*/
+static void discardDelayed(DWORD inodeNumber) {
+	DWORD reserved = 0;
+
+	lockMutex(&mnt->inodeTableLock);
+	struct t2fs_incore* entry = findIncoreInode(inodeNumber);
+	if (entry != NULL) {
+		free(entry->delayed);
+		reserved = entry->delayedReserved;
+		entry->delayed = NULL;
+		entry->delayedBlocks = 0;
+		entry->delayedSize = 0;
+		entry->delayedReserved = 0;
+	}
+	unlockMutex(&mnt->inodeTableLock);
+
+	releaseReserved(reserved);
 }
 
 /*-----------------------------------------------------------------------------
-Funcao:	Desaloca um bloco ou inode
+Funcao:	Reserva os blocos livres necessarios para que o inode, com
+		"allocatedBlocks" blocos alocados, tenha "delayedBlocks" blocos em
+		memoria (dados e os blocos de indirecao que eles vao exigir). Uma
+		reserva ja feita para o inode eh aproveitada. O chamador prende o
+		lock do inode (exclusivo).
 
-Entrada:
-		isBlock:	TRUE: alocar 1 bloco
-					FALSE: alocar 1 inode
-		index:		Indice a ser desalocado
 Retorno:
-		0: Sucesso
+		 0: Sucesso
+		-7: Blocos livres insuficientes
 -----------------------------------------------------------------------------*/
-static int disallocBlockOrInode(int isBlock, int partition, int index) {
-	DWORD setor_inicial = 0;
-	partitionSectors(partition, &setor_inicial, NULL);
+static int reserveDelayed(DWORD inodeNumber, DWORD allocatedBlocks, DWORD delayedBlocks) {
+	DWORD needed = delayedBlocks + indirectBlocks(allocatedBlocks + delayedBlocks) - indirectBlocks(allocatedBlocks);
+
+	lockMutex(&mnt->inodeTableLock);
+	struct t2fs_incore* entry = findIncoreInode(inodeNumber);
+	DWORD reserved = entry ? entry->delayedReserved : 0;
+	unlockMutex(&mnt->inodeTableLock);
 
-	if (openBitmap2(setor_inicial)) {
-		DEBUG("#ERRO allocBlockOrInode: erro ao abrir bitmap\n");
+	if (entry == NULL)
 		return -7;
-	}
+	if (needed <= reserved)
+		return 0;
 
-	int ret = 0;
-	struct t2fs_superbloco superbloco;
-	if ((ret = readSuperblock(partition, &superbloco)))
-		return ret;
+	DWORD numMax = mnt->info.superbloco.diskSize - mnt->info.firstDataBlock;
+	lockMutex(&mnt->allocLock);
+	int freeBlocks = countBitmap2(mnt->bitmaps, BITMAP_DADOS, 0, numMax);
+	int ok = (freeBlocks >= 0 && (DWORD)freeBlocks >= mnt->reservedBlocks + needed - reserved);
+	if (ok)
+		mnt->reservedBlocks += needed - reserved;
+	unlockMutex(&mnt->allocLock);
 
-	int indexToRemove = index;
+	if (!ok)
+		return -7;
 
-	if (isBlock)
-		indexToRemove -= superbloco.superblockSize + superbloco.freeBlocksBitmapSize + superbloco.freeInodeBitmapSize + superbloco.inodeAreaSize;
+	lockMutex(&mnt->inodeTableLock);
+	if ((entry = findIncoreInode(inodeNumber)) != NULL)
+		entry->delayedReserved = needed;
+	unlockMutex(&mnt->inodeTableLock);
 
-	if (setBitmap2(isBlock, indexToRemove, 0)) {
-		DEBUG("#ERRO allocBlockOrInode: erro ao alterar bitmap\n");
-		return -7;
-	}
-	
 	return 0;
 }
 
-/*-----------------------------------------------------------------------------
-Funcao:	Aloca um bloco ou inode e retorna o indice dele
-
-Entrada:
-		isBlock:	TRUE: alocar 1 bloco
-					FALSE: alocar 1 inode
-Retorno:
-		 #: Identificador do bloco/inode alocado
-		-3: Numero da particao invalido
-		-7: Erro em operacoes com funcoes de bitmap
------------------------------------------------------------------------------*/
-static int allocBlockOrInode(int isBlock, int partition) {
-	DWORD setor_inicial = 0;
-	partitionSectors(partition, &setor_inicial, NULL);
+static void releaseReserved(DWORD blocks) {
+	if (blocks == 0)
+		return;
 
-	if (openBitmap2(setor_inicial)) {
-		DEBUG("#ERRO allocBlockOrInode: erro ao abrir bitmap\n");
-		return -7;
-	}
+	lockMutex(&mnt->allocLock);
+	mnt->reservedBlocks -= MIN(blocks, mnt->reservedBlocks);
+	unlockMutex(&mnt->allocLock);
+}
 
-	int ret = 0;
-	struct t2fs_superbloco superbloco;
-	if ((ret = readSuperblock(partition, &superbloco)))
-		return ret;
+/*-----------------------------------------------------------------------------
+Funcao:	Blocos de dados que a thread pode alocar: os livres menos os reservados
+		para os dados adiados de outros inodes (o chamador prende allocLock)
+-----------------------------------------------------------------------------*/
+static int availableBlocks(DWORD numMax) {
+	int freeBlocks = countBitmap2(mnt->bitmaps, BITMAP_DADOS, 0, numMax);
+	DWORD others = mnt->reservedBlocks - MIN(reserveCredit, mnt->reservedBlocks);
 
-	DWORD numMax = 0;
+	if (freeBlocks < 0 || (DWORD)freeBlocks <= others)
+		return 0;
+	return freeBlocks - (int)others;
+}
 
-	if(isBlock)
-		numMax = superbloco.diskSize - (superbloco.superblockSize + superbloco.freeBlocksBitmapSize + superbloco.freeInodeBitmapSize + superbloco.inodeAreaSize);
-	else
-		numMax = superbloco.inodeAreaSize * superbloco.blockSize * (SECTOR_SIZE / sizeof(struct t2fs_inode));
+/*-----------------------------------------------------------------------------
+Funcao:	Desconta da reserva da thread os "blocks" blocos recem-alocados
+		(o chamador prende allocLock)
+-----------------------------------------------------------------------------*/
+static void consumeReserved(DWORD blocks) {
+	DWORD used = MIN(blocks, reserveCredit);
 
-	int index = 0;
+	reserveCredit -= used;
+	mnt->reservedBlocks -= MIN(used, mnt->reservedBlocks);
+}
 
-	while (index < numMax && (ret = getBitmap2(isBlock, index++)) == 1);
+/*-----------------------------------------------------------------------------
+Funcao:	Blocos de indirecao usados por um arquivo com "blocks" blocos de dados
+-----------------------------------------------------------------------------*/
+static DWORD indirectBlocks(DWORD blocks) {
+	DWORD maxIndirSimples = mnt->info.superbloco.blockSize * SECTOR_SIZE / sizeof(DWORD);
 
-	if (index >= numMax || ret != 0) {
-		DEBUG("#ERRO allocBlockOrInode: erro ao buscar bitmap\n");
-		return -7;
-	}
+	if (blocks <= 2)
+		return 0;
+	if (blocks <= 2 + maxIndirSimples)
+		return 1;
+	return 2 + (blocks - 2 - maxIndirSimples + maxIndirSimples - 1) / maxIndirSimples;
+}
 
-	if (setBitmap2(isBlock, --index, 1)) {
-		DEBUG("#ERRO allocBlockOrInode: erro ao alterar bitmap\n");
-		return -7;
-	}
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna a entrada do inode na tabela em memoria, sem carrega-lo
+		(NULL se ele nao esta na tabela). O chamador prende inodeTableLock.
+-----------------------------------------------------------------------------*/
+static struct t2fs_incore* findIncoreInode(int index) {
+	if (mnt->inodeTableSize == 0)
+		return NULL;
+
+	for (int e = mnt->inodeBuckets[(DWORD)index & (mnt->inodeTableSize - 1)]; e != NO_INCORE; e = mnt->inodeTable[e].hashNext)
+		if (mnt->inodeTable[e].inodeNumber == (DWORD)index)
+			return &mnt->inodeTable[e];
+	return NULL;
+}
 
-	if (closeBitmap2()) {
-		DEBUG("#ERRO allocBlockOrInode: erro ao fechar bitmap\n");
-		return -7;
-	}
+/*-----------------------------------------------------------------------------
+Funcao:	Inclui a entrada (valida) na lista do bucket do seu inode. O chamador
+		prende inodeTableLock.
+-----------------------------------------------------------------------------*/
+static void hashIncoreInode(struct t2fs_incore* entry) {
+	int* bucket = &mnt->inodeBuckets[entry->inodeNumber & (mnt->inodeTableSize - 1)];
+	entry->hashNext = *bucket;
+	*bucket = entry - mnt->inodeTable;
+}
 
-	// Se for um bloco, limpar o conteudo dele
-	if (isBlock) {
-		index += superbloco.superblockSize + superbloco.freeBlocksBitmapSize + superbloco.freeInodeBitmapSize + superbloco.inodeAreaSize;
+/*-----------------------------------------------------------------------------
+Funcao:	Retira a entrada da lista do bucket do seu inode. O chamador prende
+		inodeTableLock.
+-----------------------------------------------------------------------------*/
+static void unhashIncoreInode(struct t2fs_incore* entry) {
+	int* link = &mnt->inodeBuckets[entry->inodeNumber & (mnt->inodeTableSize - 1)];
+	int e = entry - mnt->inodeTable;
+
+	while (*link != NO_INCORE && *link != e)
+		link = &mnt->inodeTable[*link].hashNext;
+	if (*link == e)
+		*link = entry->hashNext;
+}
 
-		DWORD writeIndex = setor_inicial + index * superbloco.blockSize;
+/*-----------------------------------------------------------------------------
+Funcao:	Dobra a tabela de inodes em memoria (na primeira vez, cria com
+		INODE_TABLE_SIZE entradas). O chamador prende inodeTableLock.
 
-		unsigned char* buffer = (unsigned char*)calloc(SECTOR_SIZE, sizeof(unsigned char));
-		for (int i = 0; i < superbloco.blockSize; i++)
-			write_sector(writeIndex + i, buffer);
-		free(buffer);
-	}
-	
-	return index;
+Retorno:
+		 #: Primeira entrada nova (livre)
+		 NULL: Erro na alocacao de memoria
+-----------------------------------------------------------------------------*/
+static struct t2fs_incore* growInodeTable(void) {
+	int size = mnt->inodeTableSize ? mnt->inodeTableSize * 2 : INODE_TABLE_SIZE;
+	int* buckets = (int*)realloc(mnt->inodeBuckets, size * sizeof(int));
+	if (buckets == NULL)
+		return NULL;
+	mnt->inodeBuckets = buckets;
+
+	struct t2fs_incore* table = (struct t2fs_incore*)realloc(mnt->inodeTable, size * sizeof(struct t2fs_incore));
+	if (table == NULL)
+		return NULL;
+
+	memset(&table[mnt->inodeTableSize], 0, (size - mnt->inodeTableSize) * sizeof(struct t2fs_incore));
+	mnt->inodeTable = table;
+
+	struct t2fs_incore* first = &mnt->inodeTable[mnt->inodeTableSize];
+	int oldSize = mnt->inodeTableSize;
+	mnt->inodeTableSize = size;
+
+	// O numero de buckets acompanha a tabela: as listas sao refeitas
+	for (int b = 0; b < size; b++)
+		buckets[b] = NO_INCORE;
+	for (int i = 0; i < oldSize; i++)
+		if (table[i].valid)
+			hashIncoreInode(&table[i]);
+
+	return first;
 }
 
 /*-----------------------------------------------------------------------------
 Funcao:	Le um inode na area reservada para inodes
 -----------------------------------------------------------------------------*/
-static int readInode(int index, struct t2fs_inode *inode, int partition) {
+static int loadInode(int index, struct t2fs_inode *inode, int partition) {
 
-	struct t2fs_superbloco superbloco;
+	struct t2fs_mountinfo info;
 
 	int ret;
-	if ((ret = readSuperblock(partition, &superbloco)))
+	if ((ret = partitionInfo(partition, &info)))
 		return ret;
 
-	DWORD setor_inicial = 0;
-	partitionSectors(partition, &setor_inicial, NULL);
+	// Particao montada: inode lido atraves da cache de blocos
+	if (partition == mnt->partition) {
+		DWORD blockSizeBytes = SECTOR_SIZE * info.superbloco.blockSize;
+		DWORD offset = index * sizeof(struct t2fs_inode);
+		if (readBlockCache(mnt->cache, info.inodeAreaBlock + offset / blockSizeBytes, offset % blockSizeBytes, sizeof(struct t2fs_inode), (unsigned char*)inode))
+			return -5;
+		return 0;
+	}
 
-	DWORD sectorToRead = (superbloco.superblockSize + superbloco.freeBlocksBitmapSize + superbloco.freeInodeBitmapSize) * superbloco.blockSize + (index * sizeof(struct t2fs_inode) / SECTOR_SIZE);
+	DWORD sectorToRead = info.inodeAreaSector + (index * sizeof(struct t2fs_inode) / SECTOR_SIZE);
 
 	unsigned char buffer[SECTOR_SIZE];
-	read_sector(setor_inicial + sectorToRead, buffer);
+	read_sectors_ex(mnt->disk, sectorToRead, 1, buffer);
 
 	struct t2fs_inode* inodePointer = (struct t2fs_inode*)buffer;
 	*inode = inodePointer[index % (SECTOR_SIZE / sizeof(struct t2fs_inode))];
@@ -1404,27 +4044,70 @@ static int readInode(int index, struct t2fs_inode *inode, int partition) {
 /*-----------------------------------------------------------------------------
 Funcao:	Escreve um inode na area reservada para inodes
 -----------------------------------------------------------------------------*/
-static int writeInode(int index, struct t2fs_inode inode, int partition) {
+static int storeInode(int index, struct t2fs_inode inode, int partition) {
 
-	struct t2fs_superbloco superbloco;
+	struct t2fs_mountinfo info;
 
 	int ret;
-	if ((ret = readSuperblock(partition, &superbloco)))
+	if ((ret = partitionInfo(partition, &info)))
 		return ret;
 
-	DWORD setor_inicial = 0;
-	partitionSectors(partition, &setor_inicial, NULL);
+	// Particao montada: inode escrito atraves da cache de blocos
+	if (partition == mnt->partition) {
+		DWORD blockSizeBytes = SECTOR_SIZE * info.superbloco.blockSize;
+		DWORD offset = index * sizeof(struct t2fs_inode);
+		if (writeBlockCache(mnt->cache, info.inodeAreaBlock + offset / blockSizeBytes, offset % blockSizeBytes, sizeof(struct t2fs_inode), (unsigned char*)&inode))
+			return -5;
+		return 0;
+	}
 
-	int sectorToWrite = (superbloco.superblockSize + superbloco.freeBlocksBitmapSize + superbloco.freeInodeBitmapSize) * superbloco.blockSize + (index * sizeof(struct t2fs_inode) / SECTOR_SIZE);
+	DWORD sectorToWrite = info.inodeAreaSector + (index * sizeof(struct t2fs_inode) / SECTOR_SIZE);
 
 	unsigned char buffer[SECTOR_SIZE];
-	read_sector(setor_inicial + sectorToWrite, buffer);
+	read_sectors_ex(mnt->disk, sectorToWrite, 1, buffer);
 
 	struct t2fs_inode* inodePointer = (struct t2fs_inode*)buffer;
 	inodePointer[index % (SECTOR_SIZE / sizeof(struct t2fs_inode))] = inode;
 
-	write_sector(setor_inicial + sectorToWrite, buffer);
+	write_sectors_ex(mnt->disk, sectorToWrite, 1, buffer);
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le um bloco inteiro da particao montada, atraves da cache de blocos
+Entrada:
+		blockAddr: indice do bloco na particao
+		buffer: area com SECTOR_SIZE * superbloco.blockSize bytes
+-----------------------------------------------------------------------------*/
+static int readBlock(DWORD blockAddr, unsigned char* buffer) {
+	if (readBlockCache(mnt->cache, blockAddr, 0, SECTOR_SIZE * mnt->info.superbloco.blockSize, buffer)) {
+		DEBUG("#ERRO readBlock: erro na leitura do bloco %u\n", blockAddr);
+		return -5;
+	}
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le "size" bytes a partir de "offset" de um bloco da particao montada,
+		atraves da cache de blocos
+-----------------------------------------------------------------------------*/
+static int readBlockPart(DWORD blockAddr, DWORD offset, DWORD size, unsigned char* buffer) {
+	if (readBlockCache(mnt->cache, blockAddr, offset, size, buffer)) {
+		DEBUG("#ERRO readBlockPart: erro na leitura do bloco %u\n", blockAddr);
+		return -5;
+	}
+	return 0;
+}
 
+/*-----------------------------------------------------------------------------
+Funcao:	Escreve um bloco inteiro da particao montada, atraves da cache de blocos
+-----------------------------------------------------------------------------*/
+static int writeBlock(DWORD blockAddr, unsigned char* buffer) {
+	if (writeBlockCache(mnt->cache, blockAddr, 0, SECTOR_SIZE * mnt->info.superbloco.blockSize, buffer)) {
+		DEBUG("#ERRO writeBlock: erro na escrita do bloco %u\n", blockAddr);
+		return -5;
+	}
 	return 0;
 }
 
@@ -1433,16 +4116,51 @@ Funcao:	Retorna o superbloco da particao.
 		Pode ser usada para testar se a particao eh valida
 -----------------------------------------------------------------------------*/
 static int readSuperblock(int partition, struct t2fs_superbloco* superbloco) {
-	
+
+	int ret;
+	struct t2fs_mountinfo info;
+	if ((ret = partitionInfo(partition, &info)))
+		return ret;
+
+	if(superbloco)
+		*superbloco = info.superbloco;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna o contexto da particao: o guardado no mount, se for a
+		particao de mnt, ou lido do disco (loadPartitionInfo) nos demais casos
+-----------------------------------------------------------------------------*/
+static int partitionInfo(int partition, struct t2fs_mountinfo* info) {
+	if (partition == mnt->partition) {
+		*info = mnt->info;
+		return 0;
+	}
+
+	return loadPartitionInfo(partition, info);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Le do disco o MBR e o superbloco da particao, valida o checksum e
+		calcula os deslocamentos das areas (inodes e dados)
+
+Retorno:
+		 0: Sucesso
+		-2: Erro na leitura do setor zero do disco
+		-3: Numero da particao invalido
+		-6: Checksum invalido
+-----------------------------------------------------------------------------*/
+static int loadPartitionInfo(int partition, struct t2fs_mountinfo* info) {
+
 	int ret;
 	if ((ret = isPartition(partition)))
 		return ret;
 
-	DWORD setor_inicial = 0;
-	partitionSectors(partition, &setor_inicial, NULL);
+	partitionSectors(partition, &info->setor_inicial, &info->setor_final);
 
 	unsigned char buffer[SECTOR_SIZE];
-	read_sector(setor_inicial, buffer);
+	read_sectors_ex(mnt->disk, info->setor_inicial, 1, buffer);
 
 	// Calculando Checksum
 	if (Checksum((void*)buffer, 6)) {
@@ -1450,8 +4168,13 @@ static int readSuperblock(int partition, struct t2fs_superbloco* superbloco) {
 		return -6;
 	}
 
-	if(superbloco)
-		memcpy(superbloco, buffer, sizeof(struct t2fs_superbloco));
+	memcpy(&info->superbloco, buffer, sizeof(struct t2fs_superbloco));
+	info->hashedDir = (info->superbloco.version == T2FS_VERSION_HASHDIR);
+
+	struct t2fs_superbloco* sb = &info->superbloco;
+	info->inodeAreaSector = info->setor_inicial + (sb->superblockSize + sb->freeBlocksBitmapSize + sb->freeInodeBitmapSize) * sb->blockSize;
+	info->inodeAreaBlock = sb->superblockSize + sb->freeBlocksBitmapSize + sb->freeInodeBitmapSize;
+	info->firstDataBlock = sb->superblockSize + sb->freeBlocksBitmapSize + sb->freeInodeBitmapSize + sb->inodeAreaSize;
 
 	return 0;
 }
@@ -1460,9 +4183,17 @@ static int readSuperblock(int partition, struct t2fs_superbloco* superbloco) {
 Funcao:	Retorna o primeiro e ultimo setor da particao como referencia
 -----------------------------------------------------------------------------*/
 static void partitionSectors(int partition, DWORD* setor_inicial, DWORD* setor_final) {
+	if (partition == mnt->partition) {
+		if (setor_inicial)
+			*setor_inicial = mnt->info.setor_inicial;
+		if (setor_final)
+			*setor_final = mnt->info.setor_final;
+		return;
+	}
+
 	// Testar se existe a particao
 	unsigned char buffer[SECTOR_SIZE];
-	read_sector(0, buffer);
+	read_sectors_ex(mnt->disk, 0, 1, buffer);
 
 	int byte_inicial = strToInt(&buffer[4], 2) + 32 * partition;
 
@@ -1485,7 +4216,7 @@ static int isPartition(int partition) {
 	// Testar se existe a particao
 	unsigned char buffer[SECTOR_SIZE];
 
-	if (read_sector(0, buffer)) {
+	if (read_sectors_ex(mnt->disk, 0, 1, buffer)) {
 		DEBUG("#ERRO isPartition: erro na leitura do setor 0\n");
 		return -2;
 	}
@@ -1566,6 +4297,252 @@ static DWORD Checksum(void* data, int qty) {
 	return ~checksum;
 }
 
+/*-----------------------------------------------------------------------------
+Funcao:	Valida o handle (posicao aberta com a mesma geracao) e prende o seu
+		estado (file->lock) e o conteudo do arquivo (inodeLocks: compartilhado
+		para leitura, "exclusive" para escrita). A entrada vai para "file".
+
+Retorno:
+		  0: Sucesso (liberar com unlockFileHandle)
+		-14: Handle invalido
+		-15: Particao nao montada
+-----------------------------------------------------------------------------*/
+static int lockFileHandle(FILE2 handle, int exclusive, struct t2fs_openfile** file) {
+	struct t2fs_openfile* entry = findHandle(handle);
+	if (entry == NULL || mnt == &noMount) {
+		DEBUG("#ERRO lockFileHandle: handle invalido\n");
+		return -14;
+	}
+
+	if (mnt->partition == -1) {
+		DEBUG("#ERRO lockFileHandle: particao ou diretorio nao montado\n");
+		return -15;
+	}
+
+	lockMutex(&entry->lock);
+	if (!entry->open || entry->generation != handle / HANDLE_TABLE_MAX || entry->mount != mnt) {
+		unlockMutex(&entry->lock);
+		return -14;
+	}
+	lockRw(inodeLock(entry->record.inodeNumber), exclusive);
+
+	*file = entry;
+	return 0;
+}
+
+static void unlockFileHandle(struct t2fs_openfile* file) {
+	unlockRw(inodeLock(file->record.inodeNumber));
+	unlockMutex(&file->lock);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Valida o handle como lockFileHandle, mas mantem preso apenas o
+		conteudo do arquivo: file->lock eh liberado antes de retornar, e as
+		chamadas posicionais (pread2/pwrite2) no mesmo handle nao esperam
+		umas pelas outras. O inode continua na tabela ate o fim da chamada,
+		pois close2 prende o seu lock exclusivo antes de libera-lo.
+
+Retorno:
+		  0: Sucesso (o numero do inode vai para "inodeNumber"; liberar com
+			 unlockRw(inodeLock(inodeNumber)))
+		-14: Handle invalido
+		-15: Particao nao montada
+-----------------------------------------------------------------------------*/
+static int lockHandleInode(FILE2 handle, int exclusive, DWORD* inodeNumber) {
+	struct t2fs_openfile* file;
+	int ret = lockFileHandle(handle, exclusive, &file);
+	if (ret == 0) {
+		*inodeNumber = file->record.inodeNumber;
+		unlockMutex(&file->lock);
+	}
+
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Marca todas as montagens como livres e cria os seus locks (uma unica
+		vez, por pthread_once)
+-----------------------------------------------------------------------------*/
+static void initMounts(void) {
+	for (int m = 0; m <= MAX_MOUNTS + MAX_DISK_MOUNTS; m++) {
+		struct t2fs_mount* mount = (m < MAX_MOUNTS + MAX_DISK_MOUNTS) ? &mounts[m] : &noMount;
+
+		mount->id = m < MAX_MOUNTS + MAX_DISK_MOUNTS ? m : -1;
+		mount->partition = -1;
+		pthread_rwlock_init(&mount->fsLock, NULL);
+		pthread_rwlock_init(&mount->dirLock, NULL);
+		for (int i = 0; i < HANDLE_BUCKETS; i++)
+			pthread_mutex_init(&mount->handleBucketLocks[i], NULL);
+		for (int i = 0; i < INODE_LOCKS; i++)
+			pthread_rwlock_init(&mount->inodeLocks[i], NULL);
+		pthread_mutex_init(&mount->allocLock, NULL);
+		pthread_mutex_init(&mount->inodeTableLock, NULL);
+	}
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Retorna a montagem do identificador "mount" (noMount se ele for invalido)
+-----------------------------------------------------------------------------*/
+static struct t2fs_mount* mountById(MOUNT2 mount) {
+	pthread_once(&mountsOnce, initMounts);
+
+	return (mount >= 0 && mount < MAX_MOUNTS + MAX_DISK_MOUNTS) ? &mounts[mount] : &noMount;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Montagem da particao "partition" de t2fs_disk.dat (noMount se ela
+		for invalida), usada por mount2, mount_ex e format2_ex
+-----------------------------------------------------------------------------*/
+static struct t2fs_mount* partitionMount(int partition) {
+	return mountById(partition < MAX_MOUNTS ? partition : -1);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Abre a imagem "image" e a associa a uma entrada livre de mounts, a
+		partir de MAX_MOUNTS (a entrada fica reservada ate releaseDiskMount)
+
+Saida:	mount -> montagem (ainda nao montada) com a imagem aberta
+
+Retorno:
+		  0: Sucesso
+		 -2: Erro na abertura da imagem
+		-22: Nenhuma entrada livre
+-----------------------------------------------------------------------------*/
+static int claimDiskMount(char* image, struct t2fs_mount** mount) {
+	pthread_once(&mountsOnce, initMounts);
+
+	struct disk_image* disk = open_disk(image);
+	if (disk == NULL) {
+		DEBUG("#ERRO claimDiskMount: erro ao abrir a imagem\n");
+		return -2;
+	}
+
+	*mount = NULL;
+	pthread_mutex_lock(&diskMountsLock);
+	for (int m = MAX_MOUNTS; m < MAX_MOUNTS + MAX_DISK_MOUNTS && *mount == NULL; m++)
+		if (mounts[m].disk == NULL) {
+			*mount = &mounts[m];
+			(*mount)->disk = disk;
+		}
+	pthread_mutex_unlock(&diskMountsLock);
+
+	if (*mount == NULL) {
+		DEBUG("#ERRO claimDiskMount: limite de imagens montadas\n");
+		close_disk(disk);
+		return -22;
+	}
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Fecha a imagem da entrada e a libera (o chamador prende o seu fsLock
+		exclusivo, ou a entrada ainda nao foi montada)
+-----------------------------------------------------------------------------*/
+static void releaseDiskMount(struct t2fs_mount* mount) {
+	pthread_mutex_lock(&diskMountsLock);
+	struct disk_image* disk = mount->disk;
+	mount->disk = NULL;
+	pthread_mutex_unlock(&diskMountsLock);
+
+	close_disk(disk);
+}
+
+static MOUNT2 getDefaultMount(void) {
+	return __atomic_load_n(&defaultMount, __ATOMIC_ACQUIRE);
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Espera as requisicoes assincronas antes de uma funcao sobre "handle",
+		da montagem "mount": no modo thread-safe, apenas as do proprio handle
+		(as dos outros handles continuam na thread de E/S ao mesmo tempo);
+		sem ele, todas, como as demais funcoes publicas (drainAsync)
+-----------------------------------------------------------------------------*/
+static void drainHandle(struct t2fs_mount* mount, FILE2 handle) {
+	if (mount->threadSafe)
+		drainAsyncHandle(handle);
+	else
+		drainAsync();
+}
+
+/*-----------------------------------------------------------------------------
+Funcao:	Entra na montagem "mount" (mnt) e prende o seu fsLock na entrada de
+		uma funcao publica: exclusivo sempre e compartilhado apenas no modo
+		thread-safe. Chamadas aninhadas (uma funcao publica chamando outra)
+		apenas contam a profundidade e continuam na montagem externa.
+-----------------------------------------------------------------------------*/
+static void lockFs(struct t2fs_mount* mount, int exclusive) {
+	if (fsDepth++ > 0)
+		return;
+
+	mnt = mount;
+	if (exclusive)
+		pthread_rwlock_wrlock(&mnt->fsLock);
+	else if (mnt->threadSafe)
+		pthread_rwlock_rdlock(&mnt->fsLock);
+	else
+		return;
+	fsLocked = 1;
+}
+
+static void unlockFs(void) {
+	if (--fsDepth > 0)
+		return;
+
+	if (fsLocked) {
+		fsLocked = 0;
+		pthread_rwlock_unlock(&mnt->fsLock);
+	}
+	mnt = NULL;
+}
+
+static void lockDir(int exclusive) {
+	if (dirDepth++ > 0 || !mnt->threadSafe)
+		return;
+
+	if (exclusive)
+		pthread_rwlock_wrlock(&mnt->dirLock);
+	else
+		pthread_rwlock_rdlock(&mnt->dirLock);
+	dirLocked = 1;
+}
+
+static void unlockDir(void) {
+	if (--dirDepth > 0 || !dirLocked)
+		return;
+
+	dirLocked = 0;
+	pthread_rwlock_unlock(&mnt->dirLock);
+}
+
+static void lockMutex(pthread_mutex_t* mutex) {
+	if (mnt->threadSafe)
+		pthread_mutex_lock(mutex);
+}
+
+static void unlockMutex(pthread_mutex_t* mutex) {
+	if (mnt->threadSafe)
+		pthread_mutex_unlock(mutex);
+}
+
+static void lockRw(pthread_rwlock_t* lock, int exclusive) {
+	if (!mnt->threadSafe)
+		return;
+
+	if (exclusive)
+		pthread_rwlock_wrlock(lock);
+	else
+		pthread_rwlock_rdlock(lock);
+}
+
+static void unlockRw(pthread_rwlock_t* lock) {
+	if (mnt->threadSafe)
+		pthread_rwlock_unlock(lock);
+}
+
+static pthread_rwlock_t* inodeLock(DWORD inodeNumber) {
+	return &mnt->inodeLocks[inodeNumber % INODE_LOCKS];
+}
+
 /*-----------------------------------------------------------------------------
 Funcao para debug.
 